@@ -4,6 +4,7 @@
 #include <kernel/devicetree.h>
 #include <kernel/arch.h>
 #include <kernel/clock.h>
+#include <kernel/cls.h>
 #include <kernel/irq.h>
 #include <kernel/mm.h>
 #include <kernel/tty.h>
@@ -98,13 +99,13 @@ void wake_cores(void)
 {
 	cpu_spin_table[0] = (uintptr_t)&stack;
 
-	int cpuN = devicetree_count_dev_type("cpu");
+	int cpuN = cpu_count();
 	// int usePSCI = devicetree_count_dev_type("psci");
 
 	for (int i = 1; i < cpuN; i++)
 	{
 		cpu_spin_table[i] = (uintptr_t)page_alloc_s(CORE_BOOT_SP_SIZE) + CORE_BOOT_SP_SIZE;
-		int ret = psci_cpu_on(i, (uintptr_t)0x40400000);
+		int ret = psci_cpu_on(cpu_topology(i)->mpidr, (uintptr_t)0x40400000);
 		if (ret < 0)
 			terminal_logf("failed to boot CPU: %x", ret);
 	}
@@ -97,6 +97,10 @@
 #define VM_ENTRY_ISH (3ULL << 8)
 #define VM_ENTRY_OSH (2ULL << 8)
 #define VM_ENTRY_CONTIGUOUS (1ULL << 52)
+
+// Aligned L3 runs which can share a single TLB entry with the contiguous hint
+#define VM_CONTIGUOUS_ENTRIES (16)
+#define VM_CONTIGUOUS_SIZE (VM_CONTIGUOUS_ENTRIES * PAGE_SIZE)
 #define VM_ENTRY_AP_SHIFT (6)
 #define VM_ENTRY_PERM_RO (2ULL << VM_ENTRY_AP_SHIFT)
 #define VM_ENTRY_PERM_W (1ULL << VM_ENTRY_AP_SHIFT)
@@ -127,6 +131,10 @@
 #define TTBR_ASID_MASK (0xffff000000000000ULL)
 #define TTBR_BADDR_MASK (0x0000ffffffffffffULL)
 
+// Ranges over this many pages are invalidated by ASID rather than by VA
+#define VM_TLBI_MAX_PAGES (64)
+#define VM_TLBI_VA_MASK (0x00000fffffffffffULL)
+
 typedef struct vm_table_block_t
 {
 	uint64_t entries[512];
@@ -53,7 +53,7 @@ extern unsigned long stack;
 	if (next != thread && didsave)                                        \
 	{                                                                     \
 		thread = next;                                                    \
-		vm_set_table(thread->process->vm.vm_table, thread->process->pid); \
+		vm_set_table(thread->process->vm.vm_table, &thread->process->vm);  \
 	}                                                                     \
 	set_to_context(&thread->ctx, trapFrame);
 
@@ -14,14 +14,28 @@ bool spinlock_is_locked(spinlock_t *lock)
 	return lock != 0;
 }
 
-// Acquire the lock and disable IRQ
-int spinlock_acquire_irq(spinlock_t *lock)
+// Disable IRQ on the local core, returning the previous state
+int local_irq_save(void)
 {
 	int daif = 0;
 	__asm__ volatile("MRS %0, DAIF"
 					 : "=r"(daif));
 
 	disable_irq();
+
+	return daif;
+}
+
+// Restore the IRQ state of the local core
+void local_irq_restore(int state)
+{
+	__asm__ volatile("MSR DAIF, %0" ::"r"(state));
+}
+
+// Acquire the lock and disable IRQ
+int spinlock_acquire_irq(spinlock_t *lock)
+{
+	int daif = local_irq_save();
 	spinlock_acquire(lock);
 
 	return daif;
@@ -31,5 +45,5 @@ int spinlock_acquire_irq(spinlock_t *lock)
 void spinlock_release_irq(int state, spinlock_t *lock)
 {
 	spinlock_release(lock);
-	__asm__ volatile("MSR DAIF, %0" ::"r"(state));
+	local_irq_restore(state);
 }
\ No newline at end of file
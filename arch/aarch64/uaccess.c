@@ -1,6 +1,7 @@
 #include <kernel/uaccess.h>
 #include <kernel/cls.h>
 #include <kernel/strings.h>
+#include <kernel/umm.h>
 
 extern int _copy_from_user(void *src, void *dst, uint64_t size);
 extern int _copy_to_user(void *src, void *dst, uint64_t size);
@@ -41,7 +42,10 @@ int copy_to_user(void *src, void *dst, size_t size)
 		memcpy(dst, src, size);
 		ret = 0;
 	} else {
-		ret = _copy_to_user(src, dst, (uint64_t)size);
+		// unprivileged stores fault on read only copy on write pages instead of copying them
+		ret = vm_cow_break_range(cls->rq.current_thread, (uintptr_t)dst, size);
+		if (ret == 0)
+			ret = _copy_to_user(src, dst, (uint64_t)size);
 	}
 
 	cls->cfe = EXCEPTION_UNKNOWN;
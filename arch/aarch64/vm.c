@@ -4,10 +4,14 @@
 #include <kernel/paging.h>
 #include <kernel/panic.h>
 #include <kernel/regions.h>
+#include <kernel/sched.h>
 #include <kernel/strings.h>
+#include <kernel/syscall.h>
 #include <kernel/tty.h>
+#include <kernel/umm.h>
 #include <kernel/vm.h>
 #include <kernel/thread.h>
+#include <kernel/wait.h>
 #include <gic.h>
 #include "errno.h"
 
@@ -20,6 +24,9 @@ extern uintptr_t address_xlate_read(uintptr_t offset);
 extern uintptr_t address_xlate_write(uintptr_t offset);
 
 static void vm_free_table_block(vm_table_block *block, int level);
+static int vm_unmap_pending_sublevel(vm_table_block *cur_table, int level, int li, int level_start, int level_end);
+static vm_table_block *vm_alloc_table_block(void);
+static void vm_release_table_block(void *block, int zeroed);
 static vm_table_block *vm_table_desc_to_block(uint64_t *desc);
 static vm_table_block *vm_table_entry_to_block(uint64_t *entry);
 static vm_table_block *vm_get_or_alloc_block(vm_table_block *parent, uint16_t entry);
@@ -27,12 +34,71 @@ static vm_table_block *vm_copy_link_table_block(uint64_t *parent, vm_table_block
 static int vm_table_block_is_empty(vm_table_block *table);
 static uintptr_t vm_va_to_pa_current(uintptr_t addr);
 static uintptr_t vm_pa_to_va_current(uintptr_t addr);
+static void vm_invalidate_range(vm_table *table, vm_t *vm, uintptr_t vstart, uintptr_t vend, int whole);
+static vm_table_block *vm_split_block(vm_table *table, vm_t *vm, vm_table_block *parent, uint16_t entry, uintptr_t vaddr);
+static void vm_clear_contiguous(vm_table *table, vm_t *vm, vm_table_block *block, uintptr_t vbase, int start, int end);
+static void vm_unmap_partial_block(vm_table *table, vm_t *vm, vm_table_block *table_l2, uint16_t l2, uintptr_t vstart, uintptr_t vend);
+static uint64_t vm_entry_attrs(vm_table *table, uint64_t flags);
+static uint64_t *vm_page_entry(vm_table *table, vm_t *vm, uintptr_t vaddr, vm_table_block **block);
+static int vm_can_map_contiguous(vm_table_block *block, uint16_t entry, uintptr_t pstart, uintptr_t vstart, uint64_t vend);
 uintptr_t vm_va_to_pa(vm_table *table, uintptr_t vptr);
 uintptr_t vm_pa_to_va(vm_table *table, uintptr_t pptr);
 uintptr_t vm_pa_to_kva(uintptr_t pptr);
 
 vm_table *kernel_vm_map;
 
+/*
+ASIDs are allocated per address space with a generation in the bits above
+the ASID, so a switch only needs a TLB flush when the ASIDs roll over.
+- On switch, if the vm's generation is current the ASID is still valid and
+  TTBR0 is set without taking the lock
+- Otherwise a new ASID is taken from asid_map, keeping the old value if it
+  is still free in the new generation
+- When asid_map is full, the generation is bumped, the map is reset to the
+  ASIDs active on each CPU, and each CPU flushes its TLB on its next switch
+ASID 0 is reserved for the kernel table, which only holds global entries.
+*/
+
+#define ASID_BITS (16)
+#define ASID_MASK ((1ULL << ASID_BITS) - 1)
+#define ASID_FIRST_GENERATION (1ULL << ASID_BITS)
+#define NUM_ASIDS (1ULL << ASID_BITS)
+
+static spinlock_t asid_lock;
+static uint64_t asid_generation = ASID_FIRST_GENERATION;
+static uint64_t asid_map[NUM_ASIDS / 64] = {1}; // ASID 0 is the kernel
+static uint64_t asid_active[CLS_MAX_CPUS];
+static uint64_t asid_reserved[CLS_MAX_CPUS];
+static uint64_t asid_flush_pending;
+static uint64_t asid_next = 1;
+
+// max number of zeroed table pages held in a per-CPU table page cache
+#define VM_TABLE_CACHE_HIGH (64)
+
+// per-CPU stack of zeroed pages for new table levels, refilled by table frees
+// only the owning CPU touches its cache, with IRQs disabled
+typedef struct vm_table_cache_t
+{
+	uint32_t count;
+	void *blocks[VM_TABLE_CACHE_HIGH];
+} __attribute__((aligned(CACHE_LINE_SIZE))) vm_table_cache_t;
+
+static vm_table_cache_t *vm_table_caches;
+
+// tables of dead address spaces waiting for the reaper
+typedef struct vm_reap_entry_t
+{
+	struct list_head list;
+	vm_table *table;
+} vm_reap_entry_t;
+
+static spinlock_t vm_reap_lock;
+static struct list_head vm_reap_list;
+static thread_t *vm_reaper_thread;
+
+// the reaper sleeps here while there are no tables to tear down
+static waitqueue_head_t vm_reap_wq;
+
 vm_table_block *vm_table_desc_to_block(uint64_t *desc)
 {
 	return (vm_table_block *)vm_pa_to_kva(*desc & VM_ENTRY_OA_MASK);
@@ -180,7 +246,7 @@ uintptr_t vm_va_to_pa(vm_table *table, uintptr_t vptr)
 			return 0;
 
 		if ((block->entries[l1] & VM_ENTRY_ISTABLE) == 0)
-			return ((uintptr_t)(block->entries[l1] & 0x7FE0000000) | (vptr & 0x3FFFFFFFFF));
+			return ((uintptr_t)(block->entries[l1] & VM_ENTRY_OA_MASK & ~(L1_BLOCK_SIZE - 1)) | (vptr & (L1_BLOCK_SIZE - 1)));
 
 		// l2
 		block = vm_table_entry_to_block(&block->entries[l1]);
@@ -188,7 +254,7 @@ uintptr_t vm_va_to_pa(vm_table *table, uintptr_t vptr)
 			return 0;
 
 		if ((block->entries[l2] & VM_ENTRY_ISTABLE) == 0)
-			return ((uintptr_t)(block->entries[l2] & 0x7FFFF00000) | (vptr & 0xFFFFF));
+			return ((uintptr_t)(block->entries[l2] & VM_ENTRY_OA_MASK & ~(L2_BLOCK_SIZE - 1)) | (vptr & (L2_BLOCK_SIZE - 1)));
 
 		// l3
 		block = vm_table_entry_to_block(&block->entries[l2]);
@@ -202,6 +268,53 @@ uintptr_t vm_va_to_pa(vm_table *table, uintptr_t vptr)
 	return 0;
 }
 
+// vm_alloc_table_block gets a zeroed page for a new table level, from the CPU's table cache if available
+static vm_table_block *vm_alloc_table_block(void)
+{
+	void *block = 0;
+
+	if (vm_table_caches != 0)
+	{
+		int state = local_irq_save();
+		vm_table_cache_t *cache = &vm_table_caches[cpu_id()];
+
+		if (cache->count > 0)
+			block = cache->blocks[--cache->count];
+
+		local_irq_restore(state);
+
+		if (block != 0)
+			return (vm_table_block *)block;
+	}
+
+	return (vm_table_block *)page_zalloc_s(sizeof(vm_table_block));
+}
+
+// vm_release_table_block keeps a no longer referenced table page in the CPU's table cache,
+// otherwise gives it back to the page allocator. Stale walks of the table must already be invalidated
+static void vm_release_table_block(void *block, int zeroed)
+{
+	if (vm_table_caches != 0)
+	{
+		int state = local_irq_save();
+		vm_table_cache_t *cache = &vm_table_caches[cpu_id()];
+
+		if (cache->count < VM_TABLE_CACHE_HIGH)
+		{
+			if (!zeroed)
+				memset(block, 0, sizeof(vm_table_block));
+
+			cache->blocks[cache->count++] = block;
+			local_irq_restore(state);
+			return;
+		}
+
+		local_irq_restore(state);
+	}
+
+	page_free(block);
+}
+
 static void vm_free_table_block(vm_table_block *block, int level)
 {
 	for (int i = 0; i < 512; i++)
@@ -213,7 +326,8 @@ static void vm_free_table_block(vm_table_block *block, int level)
 			level < 3)
 			vm_free_table_block(vm_table_entry_to_block(&block->entries[i]), level + 1);
 	}
-	page_free(block);
+
+	vm_release_table_block(block, 0);
 }
 
 void vm_free_table(vm_table *table)
@@ -224,7 +338,112 @@ void vm_free_table(vm_table *table)
 			(table->descriptors[i] & VM_DESC_LINKED) == 0)
 			vm_free_table_block(vm_table_desc_to_block(&table->descriptors[i]), 1);
 
-	page_free(table);
+	vm_release_table_block(table, 0);
+}
+
+void vm_free_table_deferred(vm_table *table)
+{
+	vm_reap_entry_t *entry = 0;
+
+	if (vm_reaper_thread != 0)
+		entry = kmalloc(sizeof(vm_reap_entry_t));
+
+	if (entry == 0)
+	{
+		vm_free_table(table);
+		return;
+	}
+
+	entry->table = table;
+
+	spinlock_acquire(&vm_reap_lock);
+	list_add_tail(&entry->list, &vm_reap_list);
+	spinlock_release(&vm_reap_lock);
+
+	int state = spinlock_acquire_irq(&vm_reap_wq.lock);
+	try_wake_waitqueue(&vm_reap_wq);
+	spinlock_release_irq(state, &vm_reap_wq.lock);
+}
+
+// vm_reaper_can_wake wakes the reaper once there are tables queued
+static int vm_reaper_can_wake(__attribute__((unused)) waitqueue_entry_t *wqe)
+{
+	return !list_is_empty(&vm_reap_list);
+}
+
+// vm_reaper_wait blocks the reaper until vm_free_table_deferred queues a table
+static void vm_reaper_wait(void)
+{
+	waitqueue_entry_t *wqe = alloc_waitqueue_entry();
+	if (wqe == 0)
+	{
+		syscall0(SYSCALL_SCHED_YIELD);
+		return;
+	}
+
+	wqe->thread = current;
+	wqe->func = vm_reaper_can_wake;
+
+	// checked under the waitqueue lock, so a table queued after is seen by its wake
+	int state = spinlock_acquire_irq(&vm_reap_wq.lock);
+	if (!list_is_empty(&vm_reap_list))
+	{
+		spinlock_release_irq(state, &vm_reap_wq.lock);
+		kfree(wqe);
+		return;
+	}
+
+	list_add_tail(&wqe->list, &vm_reap_wq.head);
+	set_thread_state(current, THREAD_SLEEPING);
+	spinlock_release_irq(state, &vm_reap_wq.lock);
+
+	syscall0(SYSCALL_SCHED_YIELD);
+}
+
+// vm_reaper tears down the tables of dead address spaces in batches, away from the exiting thread
+static void vm_reaper(__attribute__((unused)) void *data)
+{
+	struct list_head batch;
+
+	while (1)
+	{
+		INIT_LIST_HEAD(&batch);
+
+		spinlock_acquire(&vm_reap_lock);
+		if (!list_is_empty(&vm_reap_list))
+		{
+			// take the whole list
+			batch.next = vm_reap_list.next;
+			batch.prev = vm_reap_list.prev;
+			batch.next->prev = &batch;
+			batch.prev->next = &batch;
+			INIT_LIST_HEAD(&vm_reap_list);
+		}
+		spinlock_release(&vm_reap_lock);
+
+		// the list head is the first member of an entry
+		struct list_head *pos, *next;
+		list_for_each_safe(pos, next, &batch)
+		{
+			vm_reap_entry_t *this = (vm_reap_entry_t *)pos;
+			vm_free_table(this->table);
+			kfree(this);
+		}
+
+		vm_reaper_wait();
+	}
+}
+
+void vm_reaper_init(void)
+{
+	spinlock_init(&vm_reap_lock);
+	INIT_LIST_HEAD(&vm_reap_list);
+	INIT_WAITQUEUE(&vm_reap_wq);
+
+	thread_t *reaper = create_kthread(&vm_reaper, "[vm reaper]", 0);
+	sched_append_pending(reaper);
+
+	vm_reaper_thread = reaper;
 }
 
 static vm_table_block *vm_get_or_alloc_block(vm_table_block *parent, uint16_t entry)
@@ -236,8 +455,7 @@ static vm_table_block *vm_get_or_alloc_block(vm_table_block *parent, uint16_t en
 
 	if (parent->entries[entry] == 0)
 	{
-		block = (vm_table_block *)page_alloc_s(sizeof(vm_table_block));
-		memset(block, 0, sizeof(vm_table_block));
+		block = vm_alloc_table_block();
 
 		parent->entries[entry] = vm_va_to_pa_current((uintptr_t)block) & VM_ENTRY_OA_MASK;
 		parent->entries[entry] |= (VM_ENTRY_ISTABLE | VM_ENTRY_VALID | VM_ENTRY_NONSECURE);
@@ -248,7 +466,132 @@ static vm_table_block *vm_get_or_alloc_block(vm_table_block *parent, uint16_t en
 	return block;
 }
 
-int vm_unmap_region(vm_table *table, uintptr_t vstart, size_t size)
+// vm_invalidate_range invalidates the TLB entries for the range of the table on all cores
+// the broadcast invalidations are issued back to back and completed by a single barrier
+static void vm_invalidate_range(vm_table *table, vm_t *vm, uintptr_t vstart, uintptr_t vend, int whole)
+{
+	size_t pages = ((vend - vstart) >> 12) + 1;
+	int global = table == kernel_vm_map;
+
+	// user tables without an address space can only be flushed as a whole
+	int by_asid = !global && vm != 0;
+	uint64_t asid = by_asid ? (__atomic_load_n(&vm->asid, __ATOMIC_RELAXED) & ASID_MASK) << TTBR_ASID_SHIFT : 0;
+
+	__asm__ volatile("DSB ISHST");
+
+	if (by_asid && asid == 0)
+	{
+		// never switched to, so no core can hold entries for it
+	}
+	else if (whole || pages > VM_TLBI_MAX_PAGES || (!global && !by_asid))
+	{
+		if (by_asid)
+			__asm__ volatile("TLBI ASIDE1IS, %0" ::"r"(asid));
+		else
+			__asm__ volatile("TLBI VMALLE1IS");
+	}
+	else
+	{
+		for (uintptr_t va = vstart; va < vend; va += PAGE_SIZE)
+		{
+			if (by_asid)
+				__asm__ volatile("TLBI VAE1IS, %0" ::"r"(asid | ((va >> 12) & VM_TLBI_VA_MASK)));
+			else
+				__asm__ volatile("TLBI VAAE1IS, %0" ::"r"((va >> 12) & VM_TLBI_VA_MASK));
+		}
+	}
+
+	__asm__ volatile("DSB ISH");
+	__asm__ volatile("ISB");
+}
+
+// vm_split_block replaces an L2 block with an L3 table mapping the same pages
+static vm_table_block *vm_split_block(vm_table *table, vm_t *vm, vm_table_block *parent, uint16_t entry, uintptr_t vaddr)
+{
+	vm_table_block *block = vm_alloc_table_block();
+
+	uint64_t block_entry = parent->entries[entry];
+	uint64_t addr = block_entry & VM_ENTRY_OA_MASK;
+	uint64_t attrs = (block_entry & ~VM_ENTRY_OA_MASK) | VM_ENTRY_ISTABLE;
+
+	for (int i = 0; i < 512; i++)
+		block->entries[i] = (addr + (i * PAGE_SIZE)) | attrs;
+
+	// break before make
+	parent->entries[entry] = 0;
+	vm_invalidate_range(table, vm, vaddr, vaddr + L2_BLOCK_SIZE - 1, 0);
+
+	parent->entries[entry] = vm_va_to_pa_current((uintptr_t)block) & VM_ENTRY_OA_MASK;
+	parent->entries[entry] |= (VM_ENTRY_ISTABLE | VM_ENTRY_VALID | VM_ENTRY_NONSECURE);
+
+	return block;
+}
+
+// vm_clear_contiguous clears the contiguous hint from the runs holding the start and end entries
+// vbase is the virtual address mapped by the first entry of the block
+static void vm_clear_contiguous(vm_table *table, vm_t *vm, vm_table_block *block, uintptr_t vbase, int start, int end)
+{
+	int runs[2] = {start & ~(VM_CONTIGUOUS_ENTRIES - 1), end & ~(VM_CONTIGUOUS_ENTRIES - 1)};
+
+	for (int r = 0; r < 2; r++)
+	{
+		if (r == 1 && runs[1] == runs[0])
+			break;
+
+		uint64_t *run = &block->entries[runs[r]];
+		if ((run[0] & VM_ENTRY_CONTIGUOUS) == 0)
+			continue;
+
+		// break before make, a run may not be cached alongside entries without the hint
+		uint64_t saved[VM_CONTIGUOUS_ENTRIES];
+		for (int i = 0; i < VM_CONTIGUOUS_ENTRIES; i++)
+		{
+			saved[i] = run[i];
+			run[i] = 0;
+		}
+
+		uintptr_t va = vbase + ((uintptr_t)runs[r] << 12);
+		vm_invalidate_range(table, vm, va, va + VM_CONTIGUOUS_SIZE - 1, 0);
+
+		for (int i = 0; i < VM_CONTIGUOUS_ENTRIES; i++)
+			run[i] = saved[i] & ~VM_ENTRY_CONTIGUOUS;
+	}
+}
+
+// vm_unmap_partial_block clears the pages of an L2 entry covered by the region, splitting a block first
+static void vm_unmap_partial_block(vm_table *table, vm_t *vm, vm_table_block *table_l2, uint16_t l2, uintptr_t vstart, uintptr_t vend)
+{
+	uint64_t entry = table_l2->entries[l2];
+	if ((entry & VM_ENTRY_VALID) == 0)
+		return;
+
+	uintptr_t vbase = vstart & ~(L2_BLOCK_SIZE - 1);
+
+	vm_table_block *table_l3;
+	if ((entry & VM_ENTRY_ISTABLE) != 0)
+		table_l3 = vm_table_entry_to_block(&table_l2->entries[l2]);
+	else
+		table_l3 = vm_split_block(table, vm, table_l2, l2, vbase);
+
+	int first = (vstart >> 12) & 0x1FF;
+	int last = (vend >> 12) & 0x1FF;
+
+	vm_clear_contiguous(table, vm, table_l3, vbase, first, last);
+
+	for (int i = first; i <= last; i++)
+		table_l3->entries[i] = 0;
+}
+
+// vm_unmap_pending_sublevel checks if the entry is a sublevel unlinked by vm_unmap_region but not yet freed
+static int vm_unmap_pending_sublevel(vm_table_block *cur_table, int level, int li, int level_start, int level_end)
+{
+	uint64_t entry = cur_table->entries[li];
+
+	return level != 3 && li > level_start && li < level_end &&
+		   (entry & VM_ENTRY_ISTABLE) != 0 && (entry & VM_ENTRY_VALID) == 0;
+}
+
+int vm_unmap_region(vm_table *table, vm_t *vm, uintptr_t vstart, size_t size)
 {
 	uint64_t vend = vstart + (uintptr_t)size;
 
@@ -308,6 +651,7 @@ int vm_unmap_region(vm_table *table, uintptr_t vstart, size_t size)
 	vm_table_block *cur_table = 0;
 
 	int vstart_level = 0;
+	int freed_sublevel = 0;
 
 	uint64_t *desc = &table->descriptors[l0];
 	if (*desc == 0)
@@ -327,6 +671,12 @@ int vm_unmap_region(vm_table *table, uintptr_t vstart, size_t size)
 		vstart_level++;
 		table_l3 = vm_table_entry_to_block(&table_l2->entries[l2]);
 	}
+	else if (level == 3 && (table_l2->entries[l2] & VM_ENTRY_VALID) != 0)
+	{
+		// unmapping part of a block
+		vstart_level++;
+		table_l3 = vm_split_block(table, vm, table_l2, l2, vstart & ~(L2_BLOCK_SIZE - 1));
+	}
 
 	switch (level)
 	{
@@ -343,9 +693,23 @@ int vm_unmap_region(vm_table *table, uintptr_t vstart, size_t size)
 		return -1;
 	}
 
+	// the rest of a contiguous run can no longer be treated as one entry
+	if (level == 3)
+		vm_clear_contiguous(table, vm, cur_table, vstart & ~(L2_BLOCK_SIZE - 1), level_start, level_end);
+
 	for (int li = level_start; li <= level_end; li++)
 	{
-		if ((cur_table->entries[li] & VM_ENTRY_ISTABLE) != 0 && level != 3)
+		if (level == 2 && li == level_start && (vstart & (L2_BLOCK_SIZE - 1)) != 0)
+		{
+			// the region starts part way into the entry
+			vm_unmap_partial_block(table, vm, cur_table, li, vstart, vstart | (L2_BLOCK_SIZE - 1));
+		}
+		else if (level == 2 && li == level_end && (vend & (L2_BLOCK_SIZE - 1)) != L2_BLOCK_SIZE - 1)
+		{
+			// the region ends part way into the entry
+			vm_unmap_partial_block(table, vm, cur_table, li, vend & ~(L2_BLOCK_SIZE - 1), vend);
+		}
+		else if ((cur_table->entries[li] & VM_ENTRY_ISTABLE) != 0 && level != 3)
 		{
 
 			if (li == level_start)
@@ -359,8 +723,10 @@ int vm_unmap_region(vm_table *table, uintptr_t vstart, size_t size)
 			else
 			{
 				terminal_logf("unmapping sublevel in middle");
-				vm_free_table_block(vm_table_entry_to_block(&cur_table->entries[li]), level + 1);
-				cur_table->entries[li] = 0;
+
+				// left invalid so walks stop here, freed once no walk through it can be cached
+				cur_table->entries[li] &= ~VM_ENTRY_VALID;
+				freed_sublevel = 1;
 			}
 		}
 		else
@@ -374,7 +740,7 @@ int vm_unmap_region(vm_table *table, uintptr_t vstart, size_t size)
 	int found_pte = 0;
 	for (int i = 0; i < 512; i++)
 	{
-		if (cur_table->entries[i] != 0)
+		if (cur_table->entries[i] != 0 && !vm_unmap_pending_sublevel(cur_table, level, i, level_start, level_end))
 		{
 			found_pte = 1;
 			break;
@@ -383,16 +749,198 @@ int vm_unmap_region(vm_table *table, uintptr_t vstart, size_t size)
 
 	if (found_pte == 0)
 	{
-		// table is empty
+		// table is empty, unlink it from its parent
 		// terminal_logf("table is empty, freeing");
-		vm_free_table_block(cur_table, level);
+		switch (level)
+		{
+		case 1:
+			*desc = 0;
+			break;
+		case 2:
+			table_l1->entries[l1] = 0;
+			break;
+		case 3:
+			table_l2->entries[l2] = 0;
+			break;
+		}
 	}
 
-	vm_clear_caches();
+	// walks through a freed table may be cached for addresses outside the range
+	vm_invalidate_range(table, vm, vstart, vend, found_pte == 0 || freed_sublevel);
+
+	// only reused once no walk can reach them
+	for (int li = level_start; freed_sublevel && li <= level_end; li++)
+	{
+		if (vm_unmap_pending_sublevel(cur_table, level, li, level_start, level_end))
+		{
+			vm_free_table_block(vm_table_entry_to_block(&cur_table->entries[li]), level + 1);
+			cur_table->entries[li] = 0;
+		}
+	}
+
+	if (found_pte == 0)
+		vm_release_table_block(cur_table, 1);
 
 	return 0;
 }
 
+// vm_entry_attrs gets the leaf entry attributes for the memory flags
+static uint64_t vm_entry_attrs(vm_table *table, uint64_t flags)
+{
+	uint64_t attrs = VM_ENTRY_VALID | VM_ENTRY_MAPPED | VM_ENTRY_NONSECURE | VM_ENTRY_AF | VM_ENTRY_ISH;
+
+	if ((flags & MEMORY_TYPE_DEVICE) != 0)
+		attrs |= (1 << VM_ENTRY_ATTR) | VM_ENTRY_OSH;
+	else
+		attrs |= (0 << VM_ENTRY_ATTR);
+
+	if ((flags & MEMORY_TYPE_USER) != 0)
+		attrs |= VM_ENTRY_USER;
+
+	// only kernel mappings are shared across every address space
+	if (table != kernel_vm_map)
+		attrs |= VM_ENTRY_NG;
+
+	if ((flags & MEMORY_NON_EXEC) != 0)
+		attrs |= VM_ENTRY_PXN | VM_ENTRY_UXN;
+
+	if ((flags & MEMORY_USER_NON_EXEC) != 0)
+		attrs |= VM_ENTRY_UXN;
+
+	if ((flags & MEMORY_PERM_RO) != 0)
+		attrs |= VM_ENTRY_PERM_RO | VM_ENTRY_PERM_W;
+
+	if ((flags & MEMORY_PERM_W) != 0)
+		attrs |= VM_ENTRY_PERM_W;
+
+	return attrs;
+}
+
+// vm_page_entry gets the L3 entry mapping the page, splitting any L2 block it is part of
+// returns 0 if the page is not mapped
+static uint64_t *vm_page_entry(vm_table *table, vm_t *vm, uintptr_t vaddr, vm_table_block **block)
+{
+	uint16_t l0 = vaddr >> 39;
+	uint16_t l1 = (vaddr >> 30) & 0x1FF;
+	uint16_t l2 = (vaddr >> 21) & 0x1FF;
+	uint16_t l3 = (vaddr >> 12) & 0x1FF;
+
+	if (table->descriptors[l0] == 0 || (table->descriptors[l0] & VM_DESC_LINKED) != 0)
+		return 0;
+
+	vm_table_block *table_l1 = vm_table_desc_to_block(&table->descriptors[l0]);
+	if ((table_l1->entries[l1] & VM_ENTRY_ISTABLE) == 0)
+		return 0;
+
+	vm_table_block *table_l2 = vm_table_entry_to_block(&table_l1->entries[l1]);
+	if ((table_l2->entries[l2] & VM_ENTRY_VALID) == 0)
+		return 0;
+
+	vm_table_block *table_l3;
+	if ((table_l2->entries[l2] & VM_ENTRY_ISTABLE) == 0)
+		table_l3 = vm_split_block(table, vm, table_l2, l2, vaddr & ~(L2_BLOCK_SIZE - 1));
+	else
+		table_l3 = vm_table_entry_to_block(&table_l2->entries[l2]);
+
+	if ((table_l3->entries[l3] & VM_ENTRY_VALID) == 0)
+		return 0;
+
+	*block = table_l3;
+	return &table_l3->entries[l3];
+}
+
+int vm_update_region(vm_table *table, vm_t *vm, uintptr_t vstart, size_t size, uint64_t flags)
+{
+	uint64_t vend = vstart + size;
+
+	if ((vstart & 0xFFF) != 0 || (vend & 0xFFF) != 0xFFF)
+		return -ERRINVAL;
+
+	uint64_t perms = VM_ENTRY_PERM_RO | VM_ENTRY_PERM_W | VM_ENTRY_PXN | VM_ENTRY_UXN;
+	uint64_t attrs = vm_entry_attrs(table, flags) & perms;
+
+	for (uintptr_t va = vstart; va < vend; va += PAGE_SIZE)
+	{
+		// blocks within the region keep their size
+		uint64_t *entry = vm_va_to_pte(table, va);
+		if (entry != 0 && (*entry & VM_ENTRY_ISTABLE) == 0 && (va & (L2_BLOCK_SIZE - 1)) == 0 && va + L2_BLOCK_SIZE - 1 <= vend)
+		{
+			*entry = (*entry & ~perms) | attrs;
+			va += L2_BLOCK_SIZE - PAGE_SIZE;
+			continue;
+		}
+
+		vm_table_block *block;
+		entry = vm_page_entry(table, vm, va, &block);
+		if (entry == 0)
+			continue;
+
+		// runs must keep the same attributes throughout
+		uintptr_t run = va & ~(VM_CONTIGUOUS_SIZE - 1);
+		if ((*entry & VM_ENTRY_CONTIGUOUS) != 0 && (run < vstart || run + VM_CONTIGUOUS_SIZE - 1 > vend))
+		{
+			int i = (va >> 12) & 0x1FF;
+			vm_clear_contiguous(table, vm, block, va & ~(L2_BLOCK_SIZE - 1), i, i);
+		}
+
+		*entry = (*entry & ~perms) | attrs;
+	}
+
+	return 0;
+}
+
+void vm_invalidate_region(vm_table *table, vm_t *vm, uintptr_t vstart, size_t size)
+{
+	vm_invalidate_range(table, vm, vstart, vstart + size, 0);
+}
+
+int vm_protect_region(vm_table *table, vm_t *vm, uintptr_t vstart, size_t size, uint64_t flags)
+{
+	int ret = vm_update_region(table, vm, vstart, size, flags);
+	if (ret < 0)
+		return ret;
+
+	// only the permissions changed, so no break before make is needed
+	vm_invalidate_region(table, vm, vstart, size);
+
+	return 0;
+}
+
+int vm_remap_page(vm_table *table, vm_t *vm, uintptr_t vaddr, uintptr_t pa, uint64_t flags)
+{
+	vm_table_block *block;
+	uint64_t *entry = vm_page_entry(table, vm, vaddr, &block);
+	if (entry == 0)
+		return -ERRINVAL;
+
+	int i = (vaddr >> 12) & 0x1FF;
+	vm_clear_contiguous(table, vm, block, vaddr & ~(L2_BLOCK_SIZE - 1), i, i);
+
+	// break before make
+	*entry = 0;
+	vm_invalidate_range(table, vm, vaddr, vaddr | (PAGE_SIZE - 1), 0);
+
+	*entry = (pa & VM_ENTRY_OA_MASK) | vm_entry_attrs(table, flags) | VM_ENTRY_ISTABLE;
+
+	__asm__ volatile("DSB ISHST");
+	__asm__ volatile("ISB");
+
+	return 0;
+}
+
+// vm_can_map_contiguous checks if a contiguous run of L3 entries can start at the entry
+static int vm_can_map_contiguous(vm_table_block *block, uint16_t entry, uintptr_t pstart, uintptr_t vstart, uint64_t vend)
+{
+	if (((vstart | pstart) & (VM_CONTIGUOUS_SIZE - 1)) != 0 || vend - vstart + 1 < VM_CONTIGUOUS_SIZE)
+		return 0;
+
+	for (int i = 0; i < VM_CONTIGUOUS_ENTRIES; i++)
+		if (block->entries[entry + i] != 0)
+			return 0;
+
+	return 1;
+}
+
 int vm_map_region(vm_table *table, uintptr_t pstart, uintptr_t vstart, size_t size, uint64_t flags)
 {
 	uint64_t vend = vstart + size;
@@ -419,8 +967,7 @@ int vm_map_region(vm_table *table, uintptr_t pstart, uintptr_t vstart, size_t si
 	if (*desc == 0)
 	{
 		// alloc block
-		table_l1 = (vm_table_block *)page_alloc_s(sizeof(vm_table_block));
-		memset(table_l1, 0, sizeof(vm_table_block));
+		table_l1 = vm_alloc_table_block();
 
 		*desc = (VM_DESC_VALID | VM_DESC_IS_DESC | VM_DESC_NONSECURE | VM_DESC_AF | VM_ENTRY_ISH);
 		*desc |= vm_va_to_pa_current((uintptr_t)table_l1) & VM_DESC_NEXT_LEVEL_MASK;
@@ -439,31 +986,25 @@ int vm_map_region(vm_table *table, uintptr_t pstart, uintptr_t vstart, size_t si
 	else
 		table_l1 = vm_table_desc_to_block(desc);
 
+	// remaining entries of the current contiguous run
+	int contiguous = 0;
+
 	while (vstart < vend)
 	{
 		int level = 3;
-		int range = vend - vstart;
-		int incsize = PAGE_SIZE;
+		uint64_t range = vend - vstart + 1;
+		uint64_t incsize = PAGE_SIZE;
 		uint64_t addr = pstart & VM_ENTRY_OA_MASK;
 
-		if (range > L1_BLOCK_SIZE && l3 == 0 && l2 == 0)
+		// blocks must have the virtual and physical address aligned to the block size
+		// 1GiB blocks are kept out of user space as unmap can only split 2MiB blocks
+		if (range >= L1_BLOCK_SIZE && ((vstart | pstart) & (L1_BLOCK_SIZE - 1)) == 0 &&
+			(flags & MEMORY_TYPE_USER) == 0 && table_l1->entries[l1] == 0)
 		{
 			level = 1;
 			incsize = L1_BLOCK_SIZE;
 			vpage = &table_l1->entries[l1];
 		}
-		else if (range > L2_BLOCK_SIZE && l3 == 0)
-		{
-			if (!table_l2)
-				table_l2 = vm_get_or_alloc_block(table_l1, l1);
-
-			if (table_l2->entries[l2] & VM_ENTRY_LINKED)
-				table_l2 = vm_copy_link_table_block(&table_l1->entries[l1], table_l2);
-
-			level = 2;
-			incsize = L2_BLOCK_SIZE;
-			vpage = &table_l2->entries[l2];
-		}
 		else
 		{
 			if (!table_l2)
@@ -472,13 +1013,26 @@ int vm_map_region(vm_table *table, uintptr_t pstart, uintptr_t vstart, size_t si
 			if (table_l2->entries[l2] & VM_ENTRY_LINKED)
 				table_l2 = vm_copy_link_table_block(&table_l1->entries[l1], table_l2);
 
-			if (!table_l3)
-				table_l3 = vm_get_or_alloc_block(table_l2, l2);
+			if (range >= L2_BLOCK_SIZE && ((vstart | pstart) & (L2_BLOCK_SIZE - 1)) == 0 &&
+				table_l2->entries[l2] == 0)
+			{
+				level = 2;
+				incsize = L2_BLOCK_SIZE;
+				vpage = &table_l2->entries[l2];
+			}
+			else
+			{
+				if (!table_l3)
+					table_l3 = vm_get_or_alloc_block(table_l2, l2);
 
-			if (table_l3->entries[l3] & VM_ENTRY_LINKED)
-				table_l3 = vm_copy_link_table_block(&table_l2->entries[l2], table_l3);
+				if (table_l3->entries[l3] & VM_ENTRY_LINKED)
+					table_l3 = vm_copy_link_table_block(&table_l2->entries[l2], table_l3);
 
-			vpage = &table_l3->entries[l3];
+				if (contiguous == 0 && vm_can_map_contiguous(table_l3, l3, pstart, vstart, vend))
+					contiguous = VM_CONTIGUOUS_ENTRIES;
+
+				vpage = &table_l3->entries[l3];
+			}
 		}
 
 		if ((*vpage & VM_ENTRY_MAPPED) > 0)
@@ -487,34 +1041,21 @@ int vm_map_region(vm_table *table, uintptr_t pstart, uintptr_t vstart, size_t si
 			return -2;
 		}
 
-		*vpage = addr | VM_ENTRY_VALID | VM_ENTRY_MAPPED | VM_ENTRY_NONSECURE | VM_ENTRY_AF | VM_ENTRY_ISH;
-		// TODO(tcfw) check if contiguous - see armv8-a ref RCBXXM
+		*vpage = addr | vm_entry_attrs(table, flags);
 
-		if ((flags & MEMORY_TYPE_DEVICE) != 0)
-			*vpage |= (1 << VM_ENTRY_ATTR) | VM_ENTRY_OSH;
-		else
-			*vpage |= (0 << VM_ENTRY_ATTR);
+		// see armv8-a ref RCBXXM, every entry in the run has the same attributes
+		if (level == 3 && contiguous > 0)
+		{
+			*vpage |= VM_ENTRY_CONTIGUOUS;
+			contiguous--;
+		}
 
 		if (level == 3)
 			*vpage |= VM_ENTRY_ISTABLE;
 
-		if ((flags & MEMORY_TYPE_USER) != 0)
-			*vpage |= VM_ENTRY_USER;
-
-		if ((flags & MEMORY_NON_EXEC) != 0)
-			*vpage |= VM_ENTRY_PXN | VM_ENTRY_UXN;
-
-		if ((flags & MEMORY_USER_NON_EXEC) != 0)
-			*vpage |= VM_ENTRY_UXN;
-
-		if ((flags & MEMORY_PERM_RO) != 0)
-			*vpage |= VM_ENTRY_PERM_RO | VM_ENTRY_PERM_W;
-
-		if ((flags & MEMORY_PERM_W) != 0)
-			*vpage |= VM_ENTRY_PERM_W;
-
 		// terminal_logf("mapped memory v:0x%x to p:0x%x at level %x in pte %x (%x %x %x %x): %x", vstart, pstart, level, vpage, l0, l1, l2, l3, *vpage);
 
+		// lower level tables are only allocated once needed, so the next entries may still be blocks
 		switch (level)
 		{
 		case 3:
@@ -522,9 +1063,12 @@ int vm_map_region(vm_table *table, uintptr_t pstart, uintptr_t vstart, size_t si
 			break;
 		case 2:
 			l2++;
+			table_l3 = 0;
 			break;
 		case 1:
 			l1++;
+			table_l2 = 0;
+			table_l3 = 0;
 			break;
 		case 0:
 			l0++;
@@ -535,39 +1079,176 @@ int vm_map_region(vm_table *table, uintptr_t pstart, uintptr_t vstart, size_t si
 		{
 			l3 = 0;
 			l2++;
-			table_l3 = vm_get_or_alloc_block(table_l2, l2);
+			table_l3 = 0;
 		}
 
 		if (l2 > 511)
 		{
 			l2 = 0;
 			l1++;
-			table_l2 = vm_get_or_alloc_block(table_l1, l1);
-			table_l3 = vm_get_or_alloc_block(table_l2, l2);
+			table_l2 = 0;
+			table_l3 = 0;
 		}
 
-		if (l1 > 512)
+		if (l1 > 511)
 		{
 			l1 = 0;
 			l0++;
 			table_l1 = vm_table_desc_to_block(&table->descriptors[l0]);
-			table_l2 = vm_get_or_alloc_block(table_l1, l1);
-			table_l3 = vm_get_or_alloc_block(table_l2, l2);
+			table_l2 = 0;
+			table_l3 = 0;
 		}
 
 		vstart += incsize;
 		pstart += incsize;
 	}
 
+	// new entries need no TLB maintenance, only to be visible to the table walker
+	__asm__ volatile("DSB ISHST");
+	__asm__ volatile("ISB");
+
 	return 0;
 }
 
-void vm_set_table(vm_table *table, pid_t pid)
+// asid_rollover starts a new ASID generation, keeping the ASIDs currently in use by each CPU
+// asid_lock must be held
+static void asid_rollover(void)
+{
+	memset(asid_map, 0, sizeof(asid_map));
+	asid_map[0] = 1; // kernel
+
+	for (uint32_t i = 0; i < cpu_count(); i++)
+	{
+		uint64_t asid = __atomic_exchange_n(&asid_active[i], 0, __ATOMIC_RELAXED);
+
+		// CPU has already rolled over since it last switched, keep what it's running
+		if (asid == 0)
+			asid = asid_reserved[i];
+
+		asid_map[(asid & ASID_MASK) / 64] |= 1ULL << ((asid & ASID_MASK) % 64);
+		asid_reserved[i] = asid;
+	}
+
+	asid_flush_pending = ~0ULL;
+}
+
+// asid_update_reserved moves a reserved ASID into the new generation, if any CPU holds it
+// asid_lock must be held
+static int asid_update_reserved(uint64_t asid, uint64_t newasid)
+{
+	int hit = 0;
+
+	for (uint32_t i = 0; i < cpu_count(); i++)
+	{
+		if (asid_reserved[i] == asid)
+		{
+			hit = 1;
+			asid_reserved[i] = newasid;
+		}
+	}
+
+	return hit;
+}
+
+// asid_find_free finds the next free ASID from asid_next, or 0 if all are in use
+// asid_lock must be held
+static uint64_t asid_find_free(void)
+{
+	for (uint64_t n = 0; n < NUM_ASIDS; n++)
+	{
+		uint64_t asid = (asid_next + n) & ASID_MASK;
+		if ((asid_map[asid / 64] & (1ULL << (asid % 64))) == 0)
+			return asid;
+	}
+
+	return 0;
+}
+
+// asid_new_context gets an ASID for the vm in the current generation
+// asid_lock must be held
+static uint64_t asid_new_context(vm_t *vm)
+{
+	uint64_t asid = vm->asid;
+	uint64_t generation = asid_generation;
+
+	if (asid != 0)
+	{
+		uint64_t newasid = generation | (asid & ASID_MASK);
+
+		// was running on a CPU during a rollover
+		if (asid_update_reserved(asid, newasid))
+			return newasid;
+
+		// reuse the same ASID if it's still free
+		if ((asid_map[(asid & ASID_MASK) / 64] & (1ULL << (asid % 64))) == 0)
+		{
+			asid_map[(asid & ASID_MASK) / 64] |= 1ULL << (asid % 64);
+			return newasid;
+		}
+	}
+
+	asid = asid_find_free();
+	if (asid == 0)
+	{
+		generation = __atomic_add_fetch(&asid_generation, ASID_FIRST_GENERATION, __ATOMIC_RELAXED);
+		asid_rollover();
+		asid = asid_find_free();
+	}
+
+	asid_map[asid / 64] |= 1ULL << (asid % 64);
+	asid_next = asid + 1;
+
+	return generation | asid;
+}
+
+// vm_asid_switch gets the ASID to use for the vm on the current CPU, flushing the local TLB
+// if there was a rollover since the CPU last switched
+static uint64_t vm_asid_switch(vm_t *vm)
+{
+	uint32_t cpu = cpu_id();
+	uint64_t asid = __atomic_load_n(&vm->asid, __ATOMIC_RELAXED);
+	uint64_t active = __atomic_load_n(&asid_active[cpu], __ATOMIC_RELAXED);
+
+	// a zero active ASID means a rollover happened on another CPU
+	if (active != 0 &&
+		((asid ^ __atomic_load_n(&asid_generation, __ATOMIC_RELAXED)) >> ASID_BITS) == 0 &&
+		__atomic_compare_exchange_n(&asid_active[cpu], &active, asid, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		return asid & ASID_MASK;
+
+	spinlock_acquire(&asid_lock);
+
+	asid = vm->asid;
+	if (((asid ^ asid_generation) >> ASID_BITS) != 0)
+	{
+		asid = asid_new_context(vm);
+		__atomic_store_n(&vm->asid, asid, __ATOMIC_RELAXED);
+	}
+
+	if ((asid_flush_pending & (1ULL << cpu)) != 0)
+	{
+		asid_flush_pending &= ~(1ULL << cpu);
+		__asm__ volatile("TLBI VMALLE1");
+		__asm__ volatile("DSB NSH");
+	}
+
+	__atomic_store_n(&asid_active[cpu], asid, __ATOMIC_RELAXED);
+
+	spinlock_release(&asid_lock);
+
+	return asid & ASID_MASK;
+}
+
+void vm_set_table(vm_table *table, struct vm_t *vm)
 {
 	uintptr_t table_pa = vm_va_to_pa_current((uintptr_t)table);
-	uint64_t asid = pid << TTBR_ASID_SHIFT & TTBR_ASID_MASK;
-	uint64_t ttbr0 = asid | (table_pa & TTBR_BADDR_MASK) | 1;
+	uint64_t asid = 0;
+
+	if (vm != 0 && table != kernel_vm_map)
+		asid = vm_asid_switch(vm);
+
+	uint64_t ttbr0 = (asid << TTBR_ASID_SHIFT & TTBR_ASID_MASK) | (table_pa & TTBR_BADDR_MASK) | 1;
 	__asm__ volatile("MSR TTBR0_EL1, %0" ::"r"(ttbr0));
+	__asm__ volatile("ISB");
 
 	// Enable E/S PAN
 	uint64_t sctlr = 0;
@@ -575,9 +1256,6 @@ void vm_set_table(vm_table *table, pid_t pid)
 					 : "=r"(sctlr));
 	sctlr |= 1ULL << 22 | 1ULL << 57; // EPAN | SPAN
 	__asm__ volatile("MSR SCTLR_EL1, %0" ::"r"(sctlr));
-
-	// invalidate TLBs
-	vm_clear_caches();
 }
 
 void vm_clear_caches()
@@ -589,6 +1267,35 @@ void vm_clear_caches()
 	__asm__ volatile("ISB");
 }
 
+void vm_clean_dcache_pou(void *addr, size_t size)
+{
+	uint64_t ctr = 0;
+	__asm__ volatile("MRS %0, CTR_EL0"
+					 : "=r"(ctr));
+
+	// DminLine is log2 of the smallest data cache line in words
+	uintptr_t line = 4ULL << ((ctr >> 16) & 0xF);
+	uintptr_t end = (uintptr_t)addr + size;
+
+	for (uintptr_t cur = (uintptr_t)addr & ~(line - 1); cur < end; cur += line)
+		__asm__ volatile("DC CVAU, %0" ::"r"(cur));
+
+	__asm__ volatile("DSB ISH");
+}
+
+void vm_invalidate_icache()
+{
+	__asm__ volatile("IC IALLUIS");
+	__asm__ volatile("DSB ISH");
+	__asm__ volatile("ISB");
+}
+
+void vm_sync_icache(void *addr, size_t size)
+{
+	vm_clean_dcache_pou(addr, size);
+	vm_invalidate_icache();
+}
+
 void vm_enable()
 {
 	// Set up MAIR_EL1
@@ -601,7 +1308,7 @@ void vm_enable()
 
 	// Setup TCR_EL1
 	uint64_t tcr = (TCR_AS_16BIT_ASID | TCR_IPS_44BITS |
-					TCR_TG1_GRANULE_4KB | TCR_A1_ASID1 |
+					TCR_TG1_GRANULE_4KB |
 					TCR_TG0_GRANULE_4KB | (20 << TCR_T1SZ_SHIFT) |
 					(20 << TCR_T0SZ_SHIFT) | TCR_SH0_INNER | TCR_IRGN0_WRITEBACK |
 					TCR_ORGN0_WRITEBACK);
@@ -696,6 +1403,11 @@ int access_ok(enum AccessType type, void *addr, size_t n)
 
 void vm_init()
 {
+	size_t caches_size = sizeof(vm_table_cache_t) * cpu_count();
+	vm_table_cache_t *caches = (vm_table_cache_t *)page_alloc_s(caches_size);
+	memset(caches, 0, caches_size);
+	vm_table_caches = caches;
+
 	kernel_vm_map = (vm_table *)page_alloc_s(sizeof(vm_table));
 
 	// map terminal device space
@@ -766,29 +1478,20 @@ void populate_kernel_vm_maps(vm_t *kernel_vm)
 	desc_region->vm_addr = DEVICE_DESCRIPTOR_REGION;
 	desc_region->length = 0x100000 - 1;
 
-	list_add(dev_region, &kernel_vm->vm_maps);
-	list_add(gic_region, &kernel_vm->vm_maps);
-	list_add(gic_cpu_region, &kernel_vm->vm_maps);
-	list_add(gic_redist_region, &kernel_vm->vm_maps);
-	list_add(mem_region, &kernel_vm->vm_maps);
-	list_add(desc_region, &kernel_vm->vm_maps);
+	vm_maps_insert(kernel_vm, dev_region);
+	vm_maps_insert(kernel_vm, gic_region);
+	vm_maps_insert(kernel_vm, gic_cpu_region);
+	vm_maps_insert(kernel_vm, gic_redist_region);
+	vm_maps_insert(kernel_vm, mem_region);
+	vm_maps_insert(kernel_vm, desc_region);
 }
 
 int current_vm_region_shared(uintptr_t uaddr, size_t len)
 {
-	vm_mapping *this;
-	struct list_head *vm_maps = (struct list_head *)&current->process->vm.vm_maps;
-
-	list_head_for_each(this, vm_maps)
-	{
-		if (!(this->vm_addr <= uaddr && this->vm_addr + this->length >= uaddr + len))
-			continue;
+	vm_mapping *this = vm_maps_find(&current->process->vm, uaddr);
 
-		if (this->flags & VM_MAP_FLAG_SHARED)
-		{
-			return 1;
-		}
-	}
+	if (this == 0 || this->vm_addr + this->length < uaddr + len)
+		return 0;
 
-	return 0;
+	return (this->flags & VM_MAP_FLAG_SHARED) != 0;
 }
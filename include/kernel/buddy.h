@@ -10,28 +10,31 @@
 #define BUDDY_MAX_ORDER 12
 #define BUDDY_MAX_BITS 8192
 #define BUDDY_BLOCK_SIZE 4096
+#define BUDDY_FREE_MAP_WORDS 133 // sum of ceil((2 ^ (m-n)) / 64) for each order n
+#define BUDDY_INDEX_MAX_BUDDIES 4096
+#define BUDDY_INDEX_WORDS (BUDDY_INDEX_MAX_BUDDIES / 64)
 
 /*
 The budy allocator uses 12 order binary buddies for 4KiB pages provides
-management over 8MiB buddy.
+management over a 16MiB buddy.
 
 Each buddy is linked to the next to provide managed over all available
 memory space. The last buddy may not be able to provide all 12 orders.
 
 In the buddy_tree bitmap, each bit provides a mapping of the binary tree,
 1 being split/allocated, 0 being unallocated.
-The first bit in the bitmap represents the whole 8MiB, the second and third
-bits represent if first and second 4MiB blocks if the 8MiB block was split, the
+The first bit in the bitmap represents the whole 16MiB, the second and third
+bits represent if first and second 8MiB blocks if the 16MiB block was split, the
 next order down, and so on until each bit represents the individual 4KiB pages.
 
 Order |   0  |   1  |   2   |   3   |    4  |    5   |    6   |    7   |  8   |  9   |  10  |  11  |  12   |
 Size  | 4KiB | 8KiB | 16KiB | 32KiB | 64KiB | 128KiB | 256KiB | 512KiB | 1MiB | 2MiB | 4MiB | 8MiB | 16MiB |
 
-Order 12 - [               1               ] - 8MiB
-Order 11 - [       1       |       0       ] - 4MiB
-Order 10 - [   1   |   1   |   0   |   0   ] - 2MiB
-Order  9 - [ 0 | 0 | 0 | 1 | 0 | 0 | 0 | 0 ] - 1MiB
-Order  8 - [0|0|0|0|0|0|0|0|0|0|0|0|0|0|0|0] - 512KiB
+Order 12 - [               1               ] - 16MiB
+Order 11 - [       1       |       0       ] - 8MiB
+Order 10 - [   1   |   1   |   0   |   0   ] - 4MiB
+Order  9 - [ 0 | 0 | 0 | 1 | 0 | 0 | 0 | 0 ] - 2MiB
+Order  8 - [0|0|0|0|0|0|0|0|0|0|0|0|0|0|0|0] - 1MiB
 ...
 
 The bitmap example above shows that:
@@ -60,8 +63,8 @@ As a flatten bitmap this is represented in binary as:
 |- Start of order 12
 
 Based on the bitmap, we can see that the addresses allocated are:
-arena + 0x0 at a size of 2MiB
-arena + 0x800000 at a size of 1MiB
+arena + 0x0 at a size of 4MiB
+arena + 0x600000 at a size of 2MiB
 
 During a free(void *), the allocated order coalesces, updating the buddy_tree and
 trying to merge order back into higher orders. A buddy can be merged to a higher
@@ -69,16 +72,19 @@ order if it's companion buddy is unallocated and not split.
 
 More info see https://en.wikipedia.org/wiki/Buddy_memory_allocation
 
-To speed up allocs, a pointer to the next free slot in each order is maintained.
-For example, give then bitmap above, the free list would slow
-freelist[BUDDY_MAX_ORDER] = {
-...
-  7 - 5 //bit 5 is free
-  8 - 3 //bit 3 is free
-  9 - 3 //bit 3 is free
- 10 - 2 //bit 2 is free
- 11 - 0 //none free
-}
+To keep alloc and free at O(max order), a bitmap of whole free blocks is kept
+for each order alongside the buddy_tree. A free block has a 0 in the buddy_tree
+and a 1 in its order's free map. Each order also holds a summary word, where
+bit n is set if word n of the order's free map has any free blocks, and
+free_orders holds a bit for each order with at least one free block, such that:
+- finding the smallest order with a free block is a single ctz on free_orders
+- finding a free block within an order is a ctz on the summary then on the
+  free map word
+- a companion buddy can be checked for coalescing with a single bit test
+
+Free map words per order (4096 order 0 blocks, 64 bits per word):
+Order |  0 |  1 |  2 | 3 | 4 | 5 | 6 | 7 | 8 | 9 | 10 | 11 | 12 |
+Words | 64 | 32 | 16 | 8 | 4 | 2 | 1 | 1 | 1 | 1 |  1 |  1 |  1 |
 
 Algos:
 - bitmap position from order = 2^(m-n)-1 where m = max order, n = order
@@ -88,8 +94,25 @@ Algos:
 - companion buddy: if(p&0x1) ? c=p-1 : c=p+1, where b = position of bit
 - position to addr: while(p<mb) {p<<1} & p>>1 - BUDDY_MIN_BUDDY_FOR_ORDER(order) * block size + arena; where mb=max bit (2^13-1)
 - addr to position: addr-=arena; p=2^m+(addr/bs); while(p!=1) p>>1 //start at lowest order, get offset, travel up until a 1
+
+Buddy index:
+When the buddies are laid out as one contiguous array with contiguous arenas,
+a buddy_index_t can be attached to them so that neither alloc or free walk the
+chain of buddies.
+For each order, the index holds a bitmap of the buddies which can satisfy an
+alloc of that order (that is, have a free block at that order or above), and a
+summary word where bit n is set if word n of the order's bitmap is non-zero.
+The bits of a buddy only change when its largest free order changes.
+- finding a buddy for an alloc is a ctz on the order summary, then on the bitmap word
+- finding the buddy of a pointer is (ptr - first arena) / BUDDY_ARENA_SIZE
+
+Since the arenas are contiguous, allocs larger than an arena are satisfied by a
+span of whole free arenas, each allocated at the max order. The first arena of
+the span records its length, so the whole span is freed by its first address.
 */
 
+struct buddy_index_t;
+
 struct buddy_t
 {
 	struct buddy_t *next;
@@ -100,10 +123,25 @@ struct buddy_t
 
 	unsigned char *arena;
 
-	uint16_t freelist[BUDDY_MAX_ORDER + 1];
+	struct buddy_index_t *index;
+	uint32_t id;
+	uint32_t span; // number of arenas in a span alloc starting at this arena
+
+	uint16_t free_orders;
+	uint64_t free_summary[BUDDY_MAX_ORDER + 1];
+	uint64_t free_map[BUDDY_FREE_MAP_WORDS];
 	uint8_t buddy_tree[BUDDY_TREE_SIZE];
 };
 
+struct buddy_index_t
+{
+	struct buddy_t *buddies;
+	uint32_t count;
+
+	uint64_t summary[BUDDY_MAX_ORDER + 1];
+	uint64_t avail[BUDDY_MAX_ORDER + 1][BUDDY_INDEX_WORDS];
+};
+
 #define BUDDY_MAX_BUDDY_FOR_ORDER(o) ((1 << ((BUDDY_MAX_ORDER - o) + 1)) - 1)
 #define BUDDY_MIN_BUDDY_FOR_ORDER(o) ((1 << (BUDDY_MAX_ORDER - o)) - 1)
 #define BUDDY_PARENT_POSITION(p) (((p & 0x1) == 1) ? (p >> 1) : ((p - 1) >> 1))
@@ -111,19 +149,33 @@ struct buddy_t
 #define BUDDY_COMPANION_POSITION(p) (((p & 0x1) == 1) ? (p + 1) : (p - 1))
 #define BUDDY_ORDER_POSITION_OFFSET(o, f) (BUDDY_MIN_BUDDY_FOR_ORDER(o) + (f))
 #define BUDDY_GET_POSITION(buddy, p) ((buddy->buddy_tree[p / 8] >> (p % 8)) & 0x1)
-#define BUDDY_ARENA_SIZE ((1 << (BUDDY_MAX_ORDER + 1)) * PAGE_SIZE)
+#define BUDDY_ARENA_SIZE ((1 << BUDDY_MAX_ORDER) * PAGE_SIZE)
 
 /*
 Note: the functions below not are thread safe. It's assumed the caller, usually mm.c, will do correct locking
 */
 
-// buddy_init inits the buddy freelist
+// buddy_init inits the buddy free maps from the buddy size
 void buddy_init(struct buddy_t *buddy);
 
+// buddy_index_init attaches an index to an array of count buddies, each already
+// init'd and with arenas contiguous at BUDDY_ARENA_SIZE
+void buddy_index_init(struct buddy_index_t *index, struct buddy_t *buddies, uint32_t count);
+
 // buddy_alloc get a free section given the order
+// orders above BUDDY_MAX_ORDER are only available to indexed buddies
 void *buddy_alloc(struct buddy_t *buddy, int order);
 
+// buddy_alloc_span allocates n contiguous whole arenas from an indexed buddy
+void *buddy_alloc_span(struct buddy_t *buddy, uint32_t n);
+
 // buddy_free frees a page given a pointer
 void buddy_free(struct buddy_t *buddy, void *ptr);
 
+// buddy_alloc_order gets the order of an allocated block given a pointer, or -1 if
+// the pointer is not the start of an allocated block.
+// The bits of an allocated block only change once it is freed, so the holder of
+// the block may call this without locking
+int buddy_alloc_order(struct buddy_t *buddy, void *ptr);
+
 #endif
\ No newline at end of file
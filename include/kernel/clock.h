@@ -74,6 +74,9 @@ void global_clock_init(void);
 
 void timespec_from_cs(struct clocksource_t *cs, timespec_t *ts);
 
+// Convert a timespec to the first counter value of the clock source at or after it
+uint64_t timespec_to_cs(struct clocksource_t *cs, const timespec_t *ts);
+
 // Compare timespecs.
 //  0 if equal
 //  1 if t2 is after t1
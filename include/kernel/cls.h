@@ -8,6 +8,18 @@
 
 #define is_current_cls(cls) cls == get_cls()
 
+#define CLS_MAX_CPUS (64)
+
+// Boot time description of a CPU, as described by the devicetree
+typedef struct cpu_topology_t
+{
+	// affinity as would be read from MPIDR_EL1
+	uint64_t mpidr;
+
+	// cluster the CPU belongs to
+	uint32_t cluster;
+} cpu_topology_t;
+
 enum exception_operation
 {
 	EXCEPTION_UNKNOWN = 0,
@@ -34,8 +46,8 @@ typedef struct cls_t
 	// schedule runqueue
 	sched_rq_t rq;
 
-	// sleep queue
-	waitqueue_head_t sleepq;
+	// sleep queue, ordered by wake time
+	timerqueue_head_t sleepq;
 
 	// cause for exception handler
 	enum exception_operation cfe;
@@ -53,6 +65,16 @@ cls_t *get_core_cls(uint8_t n);
 // Init the core local storage for all cores
 void init_cls();
 
+// Read the CPU topology from the devicetree
+// Must be called before any per-CPU structures are sized
+void init_topology(void);
+
+// Get the number of CPUs
+uint32_t cpu_count(void);
+
+// Get the topology of a specific CPU
+const cpu_topology_t *cpu_topology(uint32_t n);
+
 // Set the current working thread
 void set_current_thread(thread_t *thread);
 
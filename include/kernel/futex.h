@@ -44,6 +44,10 @@ typedef struct futex_queue_t
 	union futex_key key;
 	int wanted_value;
 	thread_t *thread;
+
+	// the wait condition the entry wakes, and set once futex_do_wake has taken the entry off the chain
+	const void *wc;
+	int taken;
 } futex_queue_t;
 
 typedef struct futex_hb_t
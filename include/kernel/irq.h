@@ -8,6 +8,7 @@
 
 #define SOFT_IRQ_HALT_CORE (0)
 #define SOFT_IRQ_THREAD_STOP (1)
+#define SOFT_IRQ_RESCHEDULE (2)
 
 // Init the interrupt hardware for all cores
 void init_xrq(void);
@@ -30,9 +30,41 @@ struct page *page_alloc(unsigned int order);
 // Get a free page at a specific size
 struct page *page_alloc_s(size_t size);
 
+// Get a zero'd page at the order size, from the zeroed page pool if available
+struct page *page_zalloc(unsigned int order);
+
+// Get a zero'd page at a specific size
+struct page *page_zalloc_s(size_t size);
+
+// Zero a block into the current CPU's zeroed page pool
+// Returns 0 if the pool is already full, otherwise 1
+int page_zero_pool_fill(void);
+
+// Get the number of zeroed blocks of the order in the current CPU's pool
+int page_zero_pool_count(unsigned int order);
+
 // Free an allocated page
 void page_free(void *page);
 
+// Take an extra reference on a page shared between address spaces
+void page_ref_get(void *page);
+
+// Drop an extra reference on a shared page, returning the number of extra
+// references before the drop. 0 means the caller was the only owner
+// Pages outside of the page arenas are never owned, so always return 1
+int page_ref_put(void *page);
+
+// Get the number of extra references on a page
+// Pages outside of the page arenas always have 1
+int page_ref_count(void *page);
+
+// Take an extra reference on an allocated block shared between mappings
+void page_block_ref_get(void *block);
+
+// Drop an extra reference on a shared block, returning the number of extra
+// references before the drop. 0 means the caller should free the block
+int page_block_ref_put(void *block);
+
 // Get the required order which can fit the desired size
 unsigned int size_to_order(size_t size);
 
@@ -4,5 +4,6 @@
 #define MMAP_READ (1ULL << 0)
 #define MMAP_WRITE (1ULL << 1)
 #define MMAP_DEVICE (1ULL << 2)
+#define MMAP_EXEC (1ULL << 3)
 
 #endif
\ No newline at end of file
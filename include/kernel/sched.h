@@ -9,6 +9,22 @@
 
 #define SCHED_MIN_TICK_DURATION (0UL)
 
+// fixed point scale of the run queue load averages
+#define SCHED_LOAD_SHIFT (10)
+#define SCHED_LOAD_SCALE (1ULL << SCHED_LOAD_SHIFT)
+
+// each schedule moves the load average 1/8th of the way to the current load
+#define SCHED_LOAD_DECAY_SHIFT (3)
+
+// how often a busy core checks if it should pull from a busier core
+#define SCHED_BALANCE_HZ (25)
+
+// length of a time slice when other threads are waiting to run
+#define SCHED_SLICE_HZ (250)
+
+// furthest ahead the timer can be programmed, the counter is 32bit signed
+#define SCHED_MAX_TIMER_TICKS (0x7fffffffULL)
+
 #define MAX_PRIO (20)
 #define PRIO_INTERVAL_BASE (50000.0)
 
@@ -27,9 +43,24 @@ typedef struct sched_rq_t
 	skiplist_t lrf;
 	thread_t *idle;
 
+	// threads placed on the core but not yet enqueued
+	// pushed by any core without locks, taken all at once by the owning core
+	thread_t *inbox;
+
 	spinlock_t lock;
 
 	uint64_t last_tick;
+
+	// decaying average of the runnable threads, in SCHED_LOAD_SCALE units
+	// read by other cores without the lock
+	uint64_t load_avg;
+
+	// last time the core pulled from a busier core
+	uint64_t last_balance;
+
+	// set when the core has no timer programmed and must be kicked to
+	// notice new threads in its inbox
+	int tickless;
 } sched_rq_t;
 
 typedef struct sched_class_t sched_class_t;
@@ -61,10 +92,12 @@ void sched_init(void);
 
 void sched_local_init(void);
 
-thread_t *sched_get_pending(uint64_t affinity);
-
+// Place a new or woken thread on the least loaded core it may run on
 void sched_append_pending(thread_t *thread);
 
+// Push a thread to a specific core's inbox, waking the core if it is tickless
+void sched_push_pending(int core, thread_t *thread);
+
 uint64_t sched_affinity(uint64_t cpu_id);
 
 sched_class_t *sched_get_class(enum Sched_Classes class);
@@ -0,0 +1,57 @@
+#ifndef _KERNEL_SHM_H
+#define _KERNEL_SHM_H
+
+#include <kernel/buddy.h>
+#include <kernel/stdint.h>
+#include <kernel/sync.h>
+#include <kernel/thread.h>
+
+#define MAX_SHM_NAME_SIZE (50)
+#define MAX_SHM_SIZE (BUDDY_ARENA_SIZE)
+
+// fail if a segment with the same name already exists
+#define SHM_GET_EXCL (1ULL << 0)
+
+// map the segment read only
+#define SHM_ATTACH_RDONLY (1ULL << 0)
+
+enum SHM_CTRL_OP
+{
+	SHM_CTRL_OP_REMOVE,
+	SHM_CTRL_OP_SIZE,
+	SHM_CTRL_OP_MAX,
+};
+
+struct shm_get_params
+{
+	uint32_t flags;
+	uint64_t size;
+	char name[MAX_SHM_NAME_SIZE];
+};
+
+// A shared memory segment, backed by a single block
+// The segment holds a reference on the block until it is removed,
+// each attached mapping holds another
+typedef struct shm_t
+{
+	char name[MAX_SHM_NAME_SIZE];
+	uint32_t id;
+	pid_t owner;
+
+	size_t size;
+	void *page;
+} shm_t;
+
+void shm_init();
+
+skiplist_t *shm_get_skl();
+
+uint64_t syscall_shm_get(thread_t *thread, ...);
+
+uint64_t syscall_shm_ctrl(thread_t *thread, ...);
+
+uint64_t syscall_shm_attach(thread_t *thread, ...);
+
+uint64_t syscall_shm_detach(thread_t *thread, ...);
+
+#endif
@@ -2,6 +2,7 @@
 #define _KERNEL_SKIPLIST_H
 
 #include <kernel/sync.h>
+#include <kernel/unistd.h>
 
 #define SKIPLIST_DEFAULT_LEVELS (7)
 
@@ -13,6 +14,17 @@ typedef struct skl_node_t
 	struct skl_node_t **forward;
 } skl_node_t;
 
+// A node kept inside the real node, so inserting and removing never allocate
+// rnode is 0 while the node is not in a skip list
+typedef struct skl_embedded_node_t
+{
+	skl_node_t node;
+	skl_node_t *forward[SKIPLIST_DEFAULT_LEVELS];
+} skl_embedded_node_t;
+
+// nodes are embedded in the real nodes, see skl_init_embedded
+#define SKIPLIST_FLAG_EMBEDDED (1 << 0)
+
 // 1 for rnode is greater than list_rnode
 // 0 for rnode is equal to list_rnode
 // -1 for rnode is less than list_rnode
@@ -37,6 +49,9 @@ typedef struct skiplist_t
 	// node value comparator
 	skiplist_compare compare;
 
+	// offset of the skl_embedded_node_t in the real nodes
+	size_t node_offset;
+
 	// level heads
 	skl_node_t head;
 } skiplist_t;
@@ -44,6 +59,10 @@ typedef struct skiplist_t
 // Init a new skip list
 void skl_init(skiplist_t *skl, int max_levels, skiplist_compare insert_comparator, int flags);
 
+// Init a new skip list using the skl_embedded_node_t at node_offset in each real node
+// A real node can only be in one skip list per embedded node
+void skl_init_embedded(skiplist_t *skl, int max_levels, skiplist_compare insert_comparator, size_t node_offset);
+
 // Insert real node pointer into the skip list
 //-1 will be returned if the pointer is already in the
 // skip list, otherwise 0 is returned
@@ -64,4 +83,7 @@ void *skl_first(skiplist_t *skl);
 // Get first node in the skip list and remove it
 void *skl_pull_first(skiplist_t *skl);
 
+// Free all nodes in the skip list, leaving the real nodes untouched
+void skl_destroy(skiplist_t *skl);
+
 #endif
\ No newline at end of file
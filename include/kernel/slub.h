@@ -5,6 +5,7 @@
 #include <kernel/sync.h>
 #include <kernel/paging.h>
 #include <kernel/stdint.h>
+#include <kernel/unistd.h>
 
 /*
 
@@ -50,7 +51,26 @@ Slubs:
 - cache_alloc_order is the order of pages to use to create a
   new empty/partial cache entry
 - object_size is the size of the objects in bytes
-- object_count is the number of active objects in the slub
+
+Per-CPU caches:
+- Each CPU owns at most one cache entry at a time (owner = cpu id)
+- Allocs and frees on the owning CPU only disable IRQs and never take
+  the cache entry lock or the slub lock
+- Frees from other CPUs are pushed onto the cache entry remote_free
+  list under the cache entry lock, and are spliced back into first by
+  the owner once the local freelist runs dry
+- Caches not owned by any CPU (owner = SLUB_CACHE_NO_OWNER) are either on
+  the partial list or full and untracked; these are managed under the
+  slub lock, then the cache entry lock
+- Alloc, free and refill counters are kept per-CPU and only summed on
+  read via slub_object_count or slub_stats, so allocs on one CPU may be
+  freed on another
+
+Stats:
+- allocs/frees are the objects alloc'd and free'd
+- refills are the number of times a CPU had to claim a new cache entry
+- partial_hits are the refills which were served from the partial list
+- pages are the pages currently held by the slub's cache entries
 */
 
 #define POISON_VALUE (0x6C6C6C6CUL)
@@ -63,20 +83,46 @@ typedef struct slub_entry_t
 
 typedef struct slub_t slub_t;
 
+#define SLUB_CACHE_NO_OWNER (-1)
+
+#define SLUB_CACHE_FLAG_PARTIAL (1 << 0)
+
 typedef struct slub_cache_entry_t
 {
 	struct list_head list;
 	spinlock_t lock;
+	int32_t owner;
 
 	slub_t *slub;
 
 	uint32_t used;
+	uint32_t remote_count;
 
 	void *first;
+	void *remote_free;
 
-	char padding[16];
+	uint32_t flags;
 } slub_cache_entry_t;
 
+typedef struct slub_cpu_t
+{
+	slub_cache_entry_t *cache;
+
+	uint64_t allocs;
+	uint64_t frees;
+	uint64_t refills;
+	uint64_t partial_hits;
+} __attribute__((aligned(CACHE_LINE_SIZE))) slub_cpu_t;
+
+typedef struct slub_stats_t
+{
+	uint64_t allocs;
+	uint64_t frees;
+	uint64_t refills;
+	uint64_t partial_hits;
+	int64_t pages;
+} slub_stats_t;
+
 typedef struct slub_t slub_t;
 
 typedef struct slub_t
@@ -87,12 +133,13 @@ typedef struct slub_t
 
 	unsigned int cache_alloc_order;
 	unsigned int object_size;
-	unsigned int object_count;
 
 	spinlock_t lock;
 	struct list_head partial;
 
-	slub_cache_entry_t **per_cpu_partial;
+	int64_t pages;
+
+	slub_cpu_t *per_cpu;
 } slub_t;
 
 typedef struct slub_class_catalogue_t
@@ -102,6 +149,9 @@ typedef struct slub_class_catalogue_t
 
 slub_t *DEFINE_DYN_SLUB(unsigned int objsize);
 
+// Size of a slub including the per-CPU caches trailing it
+size_t slub_struct_size(unsigned int ncpu);
+
 typedef void (*slub_callback)(int op, void *addr);
 
 void slub_register_cb(slub_callback cb);
@@ -112,4 +162,10 @@ void *slub_alloc(slub_t *slub);
 
 void slub_free(void *);
 
+// Sum the active objects across all per-CPU counters
+int64_t slub_object_count(slub_t *slub);
+
+// Sum the stats across all per-CPU counters
+void slub_stats(slub_t *slub, slub_stats_t *stats);
+
 #endif
\ No newline at end of file
@@ -27,4 +27,10 @@ int spinlock_acquire_irq(spinlock_t *lock);
 // Release the lock from disabled IRQ
 void spinlock_release_irq(int state, spinlock_t *lock);
 
+// Disable IRQ on the local core, returning the previous state
+int local_irq_save(void);
+
+// Restore the IRQ state of the local core
+void local_irq_restore(int state);
+
 #endif
\ No newline at end of file
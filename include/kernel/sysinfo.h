@@ -22,4 +22,23 @@ struct sysinfo
 	uint32_t page_size;
 };
 
+#define SYSINFO_SLUB_MAX_CLASSES (32)
+
+struct sysinfo_slub_class
+{
+	uint32_t object_size;
+	uint64_t objects;
+	uint64_t allocs;
+	uint64_t frees;
+	uint64_t refills;
+	uint64_t partial_hits;
+	uint64_t pages;
+};
+
+struct sysinfo_slub
+{
+	uint32_t nclasses;
+	struct sysinfo_slub_class classes[SYSINFO_SLUB_MAX_CLASSES];
+};
+
 #endif
\ No newline at end of file
@@ -10,6 +10,7 @@
 #include <kernel/regions.h>
 #include <kernel/sched.h>
 #include <kernel/signal.h>
+#include <kernel/skiplist.h>
 #include <kernel/stdint.h>
 #include <kernel/sync.h>
 #include <kernel/vm.h>
@@ -36,7 +37,12 @@ typedef struct vm_t
 {
 	vm_table *vm_table;
 
+	// address space ID and the generation it was allocated in
+	uint64_t asid;
+
+	// mappings in address order, indexed by vm_maps_index
 	struct list_head vm_maps;
+	skiplist_t vm_maps_index;
 
 	unsigned long start_code, end_code, start_data, end_data;
 	unsigned long start_brk, brk, start_stack;
@@ -144,6 +150,9 @@ typedef struct sched_entity_t
 	int64_t deadline;
 	uint64_t last_deadline;
 	uint64_t prio;
+
+	// run queue node, embedded so queueing never allocates
+	skl_embedded_node_t rq_node;
 } sched_entity_t;
 
 typedef struct thread_t
@@ -166,6 +175,10 @@ typedef struct thread_t
 
 	spinlock_t wc_lock;
 	thread_wait_cond *wc;
+
+	// next thread in a core's pending inbox, and set while in one
+	struct thread_t *pending_next;
+	uint32_t pending_queued;
 } thread_t;
 
 typedef struct thread_list_entry_t
@@ -182,6 +195,15 @@ typedef struct thread_table
 
 void init_kthread_proc();
 
+// Init the slub caches for thread objects
+void init_thread_caches(void);
+
+// Allocate a zero'd thread
+thread_t *alloc_thread(void);
+
+// Allocate a zero'd thread list entry
+thread_list_entry_t *alloc_thread_list_entry(void);
+
 // Init a thread
 void init_thread(thread_t *thread);
 
@@ -203,6 +225,10 @@ thread_t *create_kthread(void(entry)(void *), const char *name, void *data);
 // Mark a thread as awake
 void wake_thread(thread_t *thread);
 
+// Mark a thread as awake only if it is still waiting on the condition
+// Returns 1 if the thread was woken
+int wake_thread_cond(thread_t *thread, const void *cond);
+
 void sleep_kthread(const timespec_t *ts, timespec_t *rem);
 
 // Put thread to sleep for ts time
@@ -224,6 +250,9 @@ void mark_zombie_thread(thread_t *thread);
 
 void init_proc(process_t *proc, char *cmd);
 
+// Get the next unused process ID
+pid_t alloc_pid(void);
+
 void free_process(process_t *proc);
 
 void free_thread(thread_t *thread);
@@ -10,10 +10,49 @@ enum UserDataAbortOp
 	USER_DATA_ABORT_WRITE = 1,
 };
 
+// Init the mapping list and index of the vm
+void vm_maps_init(vm_t *vm);
+
+// Free the mapping index of the vm, leaving the mappings untouched
+void vm_maps_destroy(vm_t *vm);
+
+// Add a mapping to the vm in address order
+// The process lock must be held
+int vm_maps_insert(vm_t *vm, vm_mapping *map);
+
+// Remove a mapping from the vm
+// The process lock must be held
+void vm_maps_remove(vm_t *vm, vm_mapping *map);
+
+// Get the mapping with the highest address at or below addr, which
+// may not contain addr
+// The process lock must be held
+vm_mapping *vm_maps_find(vm_t *vm, uintptr_t addr);
+
+// Get the first mapping starting at or above addr
+// The process lock must be held
+vm_mapping *vm_maps_first_from(vm_t *vm, uintptr_t addr);
+
 vm_mapping *has_mapping(thread_t *thread, uintptr_t addr, size_t length);
 
+// Split the mapping at the offset, returning the new mapping of the remainder
+// The process lock must be held
+vm_mapping *vm_split_mapping(vm_t *vm, vm_mapping *map, size_t offset);
+
+// Copy the mappings of one vm into another, sharing writable private
+// pages copy-on-write. The process lock of the from vm must be held
+int vm_clone(vm_t *from, vm_t *to);
+
+// Free the pages held by a mapping, keeping pages still shared with another
+// address space. If unmap is set, the pages are also unmapped from the vm
+void vm_release_mapping(vm_t *vm, vm_mapping *map, int unmap);
+
 void user_data_abort(uintptr_t daddr, enum UserDataAbortOp op, uintptr_t pc);
 
+// Copy the shared copy on write pages in a range of the thread's address space
+// before the kernel writes to them
+int vm_cow_break_range(thread_t *thread, uintptr_t addr, size_t length);
+
 int vm_alloc_lazy_mapping(thread_t *thread, vm_mapping *map, uint64_t alloc_size);
 
 int64_t actualise_lazy_reservation(thread_t *thread, vm_mapping *map, int flags);
@@ -7,6 +7,8 @@
 #include <kernel/unistd.h>
 #include <kernel/buddy.h>
 
+struct vm_t;
+
 #define MEMORY_TYPE_DEVICE (1ULL << 0)
 #define MEMORY_TYPE_KERNEL (1ULL << 1)
 #define MEMORY_TYPE_USER (1ULL << 2)
@@ -39,6 +41,9 @@ uintptr_t vm_pa_to_va(vm_table *table, uintptr_t pptr);
 // Convert a virtual address to a physical address
 uintptr_t vm_va_to_pa(vm_table *table, uintptr_t vptr);
 
+// Convert a physical address to its address in the kernel linear map
+uintptr_t vm_pa_to_kva(uintptr_t pptr);
+
 uint64_t *vm_va_to_pte(vm_table *table, uintptr_t vptr);
 
 // Allocate a set of pages directly into a table for a given size
@@ -48,7 +53,21 @@ void vm_alloc(vm_table *table, uintptr_t vsstart, size_t size);
 int vm_map_region(vm_table *table, uintptr_t pstart, uintptr_t vstart, size_t size, uint64_t flags);
 
 // Unmap a region of physical memory from the given table
-int vm_unmap_region(vm_table *table, uintptr_t vstart, size_t size);
+// vm is the address space using the table, for its ASID, or 0 for the kernel table
+int vm_unmap_region(vm_table *table, struct vm_t *vm, uintptr_t vstart, size_t size);
+
+// Change the permissions of the mapped pages in a region of the given table
+int vm_protect_region(vm_table *table, struct vm_t *vm, uintptr_t vstart, size_t size, uint64_t flags);
+
+// Rewrite the permissions of the mapped pages in a region of the given table,
+// leaving stale TLB entries until vm_invalidate_region is called
+int vm_update_region(vm_table *table, struct vm_t *vm, uintptr_t vstart, size_t size, uint64_t flags);
+
+// Invalidate the TLB entries for a region of the given table on all cores
+void vm_invalidate_region(vm_table *table, struct vm_t *vm, uintptr_t vstart, size_t size);
+
+// Replace the physical page mapped at the virtual address in the given table
+int vm_remap_page(vm_table *table, struct vm_t *vm, uintptr_t vaddr, uintptr_t pa, uint64_t flags);
 
 // Mark a region of memory with a given state
 int vm_mark_region(vm_table *table, entry_state_e state, uintptr_t page);
@@ -56,9 +75,16 @@ int vm_mark_region(vm_table *table, entry_state_e state, uintptr_t page);
 // Free the given table from alloc memory
 void vm_free_table(vm_table *table);
 
-// Set the given table as the active page table, updating/clearing any
-// required caches
-void vm_set_table(vm_table *table, pid_t pid);
+// Queue the given table to be freed by the reaper thread
+// No core may still be walking the table
+void vm_free_table_deferred(vm_table *table);
+
+// Start the reaper thread which frees tables queued by vm_free_table_deferred
+void vm_reaper_init(void);
+
+// Set the given table as the active page table, switching to the address
+// space ID of vm. vm may be 0 for tables only holding kernel mappings
+void vm_set_table(vm_table *table, struct vm_t *vm);
 
 // Symbolically map all virtual addresses from table 2 onto table 1
 int vm_link_tables(vm_table *table1, vm_table *table2);
@@ -66,6 +92,16 @@ int vm_link_tables(vm_table *table1, vm_table *table2);
 // Clear any virtual memory caches for the local core
 void vm_clear_caches();
 
+// Clean the data cache to the point of unification for the kernel address range
+void vm_clean_dcache_pou(void *addr, size_t size);
+
+// Invalidate the instruction caches of all cores
+void vm_invalidate_icache();
+
+// Make instructions written through the kernel address range visible to instruction
+// fetches on all cores, for pages which are or will be mapped executable
+void vm_sync_icache(void *addr, size_t size);
+
 // Enable virtual memory mapping for the current core
 void vm_enable();
 
@@ -87,6 +123,9 @@ int access_ok(enum AccessType type, void *addr, size_t n);
 #define VM_MAP_FLAG_PHY_KERNEL (1ULL << (MEMORY_VM_FLAG_MAX + 1))
 #define VM_MAP_FLAG_DEVICE (1ULL << (MEMORY_VM_FLAG_MAX + 2))
 #define VM_MAP_FLAG_LAZY (1ULL << (MEMORY_VM_FLAG_MAX + 3))
+#define VM_MAP_FLAG_COW (1ULL << (MEMORY_VM_FLAG_MAX + 4))
+#define VM_MAP_FLAG_SHM (1ULL << (MEMORY_VM_FLAG_MAX + 5))
+#define VM_MAP_FLAG_SHM_RDONLY (1ULL << (MEMORY_VM_FLAG_MAX + 6))
 
 typedef struct vm_mapping
 {
@@ -98,6 +137,11 @@ typedef struct vm_mapping
 	uint64_t flags;
 
 	struct page *page;
+
+	// lazy mappings only, the address a sequential fault is expected
+	// at and the size of the window mapped ahead of it
+	uintptr_t fault_next;
+	size_t fault_window;
 } vm_mapping;
 
 int current_vm_region_shared(uintptr_t uaddr, size_t len);
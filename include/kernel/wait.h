@@ -23,16 +23,58 @@ typedef struct waitqueue_entry_t
 	waitqueue_func_t func;
 	timespec_t *timeout;
 	void *data;
+
+	// counter value the entry expires at, and its place while in a timer queue
+	uint64_t expires;
+	struct timerqueue_head_t *tq;
+	size_t tq_idx;
 } waitqueue_entry_t;
 
+// Waiters ordered by expiry in a binary min-heap, so expiring only touches expired entries
+typedef struct timerqueue_head_t
+{
+	waitqueue_entry_t **heap;
+	size_t size;
+	size_t cap;
+	spinlock_t lock;
+} timerqueue_head_t;
+
 static inline void INIT_WAITQUEUE(waitqueue_head_t *wq)
 {
 	INIT_LIST_HEAD(&wq->head);
 	spinlock_init(&wq->lock);
 }
 
+static inline void INIT_TIMERQUEUE(timerqueue_head_t *tq)
+{
+	tq->heap = 0;
+	tq->size = 0;
+	tq->cap = 0;
+	spinlock_init(&tq->lock);
+}
+
+// Init the slub cache for wait queue entries
+void init_waitqueue_cache(void);
+
+// Allocate a zero'd wait queue entry
+waitqueue_entry_t *alloc_waitqueue_entry(void);
+
 void try_wake_waitqueue(waitqueue_head_t *wq);
 
 int wq_can_wake_thread(waitqueue_entry_t *wq_entry);
 
+// Queue an entry to wake its thread at the counter value
+// The entry's data must be the thread wait condition it times out
+int timerqueue_add(timerqueue_head_t *tq, waitqueue_entry_t *wqe, uint64_t expires);
+
+// Remove and free an entry which has not expired yet. The thread's wc_lock must be held
+// Returns 0 if the entry has already been taken to expire, and is freed by the expiring core
+int timerqueue_cancel(waitqueue_entry_t *wqe);
+
+// Get the earliest expiry in the queue. Returns 0 if the queue is empty
+int timerqueue_next(timerqueue_head_t *tq, uint64_t *expires);
+
+// Wake the threads of all entries expired by the counter value
+void timerqueue_expire(timerqueue_head_t *tq, uint64_t now);
+
 #endif
\ No newline at end of file
@@ -2,170 +2,203 @@
 #include <kernel/buddy.h>
 #include <kernel/tty.h>
 
-// buddy_is_full checks if all orders have been allocated or split via the freelist
+// offset of the first free map word for each order
+static const uint16_t buddy_free_map_offset[BUDDY_MAX_ORDER + 1] = {0, 64, 96, 112, 120, 124, 126, 127, 128, 129, 130, 131, 132};
+
+// buddy_is_full checks if no order at or above the given order has a free block
 static bool buddy_is_full(struct buddy_t *buddy, uint8_t order);
 
-// buddy_is_parent_split checks if the parent is split (parent pos = 1 and either children is 1)
-static bool buddy_is_parent_split(struct buddy_t *buddy, uint16_t p);
+// buddy_set_position sets an individual bit at position p in the buddy tree
+static void buddy_set_position(struct buddy_t *buddy, uint16_t p, uint8_t v);
 
-// buddy_is_parent_allocd checks if a parent is allocated (parent pos = 1 and all chicdren are 0)
-static bool buddy_is_parent_allocd(struct buddy_t *buddy, uint16_t p);
+// buddy_is_free checks if the block at index i of the order is a whole free block
+static bool buddy_is_free(struct buddy_t *buddy, uint8_t order, uint16_t i);
 
-// buddy_order_next_free_pos finds the next best free position for a given order
-static uint16_t buddy_order_next_free_pos(struct buddy_t *buddy, uint8_t order);
+// buddy_mark_free marks the block at index i of the order as a whole free block
+static void buddy_mark_free(struct buddy_t *buddy, uint8_t order, uint16_t i);
 
-// buddy_pos_to_addr converts a position to an address, excluding the office of the arena
-static uintptr_t buddy_pos_to_addr(int pos);
+// buddy_clear_free removes the block at index i of the order from the free map
+static void buddy_clear_free(struct buddy_t *buddy, uint8_t order, uint16_t i);
 
-// buddy_set_position sets an individual bit at position p in the buddy tree
-static void buddy_set_position(struct buddy_t *buddy, uint16_t p, uint8_t v);
+// buddy_first_free finds the index of the first free block in the order
+static uint16_t buddy_first_free(struct buddy_t *buddy, uint8_t order);
 
-// buddy_split_parent recursively split parents until we find a parent that is already split
-// if the split can be done it'll mark the parent as split
-static uint16_t buddy_split_mark_parent(struct buddy_t *buddy, uint16_t p);
+// buddy_top_order gets the largest order with a free block, or -1 if full
+static int buddy_top_order(uint16_t free_orders);
 
-// buddy_coalesce attempts to free and collapse/coalesce buddies to mark parents as free
-static void buddy_coalesce(struct buddy_t *buddy, uint8_t o, uint16_t p);
+// buddy_index_update updates the index of the buddy after its free orders have changed
+static void buddy_index_update(struct buddy_t *buddy, uint16_t prev_free_orders);
+
+// buddy_index_find finds the first buddy in the index which can satisfy the order
+static struct buddy_t *buddy_index_find(struct buddy_index_t *index, uint8_t order);
+
+// buddy_alloc_from allocates a block of the order from a buddy known to have a free block at or above the order
+static void *buddy_alloc_from(struct buddy_t *candidate, uint8_t order);
+
+// buddy_free_block frees the allocated block at index i of the order, coalescing with free companions
+static void buddy_free_block(struct buddy_t *candidate, uint8_t order, uint16_t i);
+
+// buddy_lookup finds the buddy, order and index of the allocated block starting at ptr
+static struct buddy_t *buddy_lookup(struct buddy_t *buddy, void *ptr, uint8_t *order, uint16_t *index);
 
 bool buddy_is_full(struct buddy_t *buddy, uint8_t order)
 {
-	for (int i = BUDDY_MAX_ORDER; i >= order; i--)
-		if (buddy->freelist[i] != 0)
-			return false;
-
-	return true;
+	return (buddy->free_orders >> order) == 0;
 }
 
-static bool buddy_is_parent_split(struct buddy_t *buddy, uint16_t p)
+static void buddy_set_position(struct buddy_t *buddy, uint16_t p, uint8_t v)
 {
-	if (p == 0)
-		return true;
+	uint16_t pChar = p / 8;
+	uint8_t pOffset = (p % 8);
+
+	uint8_t cbv = buddy->buddy_tree[pChar];
 
-	uint8_t pv = BUDDY_GET_POSITION(buddy, BUDDY_PARENT_POSITION(p));
-	uint8_t mv = BUDDY_GET_POSITION(buddy, p);
-	uint8_t cv = BUDDY_GET_POSITION(buddy, BUDDY_COMPANION_POSITION(p));
+	v = (v & 0x1) << (pOffset);
+	cbv &= ~(1 << pOffset);
 
-	return pv == 1 && (mv == 1 || cv == 1);
+	buddy->buddy_tree[pChar] = v | cbv;
 }
 
-static bool buddy_is_parent_allocd(struct buddy_t *buddy, uint16_t p)
+static bool buddy_is_free(struct buddy_t *buddy, uint8_t order, uint16_t i)
 {
-	if (p == 0)
-		return false;
-
-	uint8_t pv = BUDDY_GET_POSITION(buddy, BUDDY_PARENT_POSITION(p));
-	uint8_t mv = BUDDY_GET_POSITION(buddy, p);
-	uint8_t cv = BUDDY_GET_POSITION(buddy, BUDDY_COMPANION_POSITION(p));
+	uint64_t word = buddy->free_map[buddy_free_map_offset[order] + (i / 64)];
+	return (word >> (i % 64)) & 0x1;
+}
 
-	return pv == 1 && mv == 0 && cv == 0;
+static void buddy_mark_free(struct buddy_t *buddy, uint8_t order, uint16_t i)
+{
+	buddy->free_map[buddy_free_map_offset[order] + (i / 64)] |= 1ULL << (i % 64);
+	buddy->free_summary[order] |= 1ULL << (i / 64);
+	buddy->free_orders |= 1 << order;
 }
 
-static uintptr_t buddy_pos_to_addr(int pos)
+static void buddy_clear_free(struct buddy_t *buddy, uint8_t order, uint16_t i)
 {
-	while (pos < BUDDY_MIN_BUDDY_FOR_ORDER(0))
-		pos = (pos << 1) + 1;
+	uint64_t *word = &buddy->free_map[buddy_free_map_offset[order] + (i / 64)];
+	*word &= ~(1ULL << (i % 64));
 
-	pos -= BUDDY_MIN_BUDDY_FOR_ORDER(0);
+	if (*word != 0)
+		return;
 
-	return pos * BUDDY_BLOCK_SIZE;
+	buddy->free_summary[order] &= ~(1ULL << (i / 64));
+	if (buddy->free_summary[order] == 0)
+		buddy->free_orders &= ~(1 << order);
 }
 
-void buddy_init(struct buddy_t *buddy)
+static uint16_t buddy_first_free(struct buddy_t *buddy, uint8_t order)
 {
-	for (int i = 0; i <= BUDDY_MAX_ORDER; i++)
-	{
-		buddy->freelist[i] = 1;
-	}
+	uint16_t w = __builtin_ctzll(buddy->free_summary[order]);
+	uint64_t word = buddy->free_map[buddy_free_map_offset[order] + w];
+
+	return (w * 64) + __builtin_ctzll(word);
 }
 
-static uint16_t buddy_order_next_free_pos(struct buddy_t *buddy, uint8_t order)
+static int buddy_top_order(uint16_t free_orders)
 {
-	for (
-		uint16_t pos = BUDDY_MIN_BUDDY_FOR_ORDER(order);
-		pos < BUDDY_MAX_BUDDY_FOR_ORDER(order);
-		pos++)
-	{
-		// skip anything either split or allocated
-		if (BUDDY_GET_POSITION(buddy, pos) == 1)
-			continue;
+	if (free_orders == 0)
+		return -1;
 
-		// traverse up the tree to see if anything further up has been split
-		uint16_t ppos = pos;
-		while (ppos > 0)
-		{
-			if (buddy_is_parent_allocd(buddy, ppos))
-				break;
+	return 31 - __builtin_clz(free_orders);
+}
 
-			if (buddy_is_parent_split(buddy, ppos))
-			{
-				return pos - BUDDY_MIN_BUDDY_FOR_ORDER(order) + 1;
-			}
+static void buddy_index_update(struct buddy_t *buddy, uint16_t prev_free_orders)
+{
+	struct buddy_index_t *index = buddy->index;
 
-			ppos = BUDDY_PARENT_POSITION(ppos);
-		}
-	}
+	if (index == 0 || prev_free_orders == buddy->free_orders)
+		return;
 
-	return 0;
-}
+	int prev_top = buddy_top_order(prev_free_orders);
+	int top = buddy_top_order(buddy->free_orders);
+	uint32_t w = buddy->id / 64;
+	uint64_t bit = 1ULL << (buddy->id % 64);
 
-static uint16_t buddy_split_mark_parent(struct buddy_t *buddy, uint16_t p)
-{
-	if (p == 0)
+	// orders which can no longer be satisfied
+	for (int o = top + 1; o <= prev_top; o++)
 	{
-		buddy_set_position(buddy, p, 1);
-		return 0;
+		index->avail[o][w] &= ~bit;
+		if (index->avail[o][w] == 0)
+			index->summary[o] &= ~(1ULL << w);
 	}
 
-	if (BUDDY_GET_POSITION(buddy, p) == 1 || buddy_is_parent_allocd(buddy, p))
+	// orders which can now be satisfied
+	for (int o = prev_top + 1; o <= top; o++)
 	{
-		return 2;
+		index->avail[o][w] |= bit;
+		index->summary[o] |= 1ULL << w;
 	}
+}
 
-	if (buddy_is_parent_split(buddy, p))
-	{
-		buddy_set_position(buddy, p, 1);
+static struct buddy_t *buddy_index_find(struct buddy_index_t *index, uint8_t order)
+{
+	if (index->summary[order] == 0)
 		return 0;
-	}
-
-	uint16_t ppos = BUDDY_PARENT_POSITION(p);
 
-	int ps = buddy_split_mark_parent(buddy, ppos);
-	if (ps != 2)
-		buddy_set_position(buddy, p, 1);
+	uint32_t w = __builtin_ctzll(index->summary[order]);
 
-	return ps;
+	return &index->buddies[(w * 64) + __builtin_ctzll(index->avail[order][w])];
 }
 
-static void buddy_set_position(struct buddy_t *buddy, uint16_t p, uint8_t v)
+void buddy_index_init(struct buddy_index_t *index, struct buddy_t *buddies, uint32_t count)
 {
-	uint16_t pChar = p / 8;
-	uint8_t pOffset = (p % 8);
+	if (count > BUDDY_INDEX_MAX_BUDDIES)
+		count = BUDDY_INDEX_MAX_BUDDIES;
 
-	uint8_t cbv = buddy->buddy_tree[pChar];
+	index->buddies = buddies;
+	index->count = count;
 
-	v = (v & 0x1) << (pOffset);
-	cbv &= ~(1 << pOffset);
+	for (int o = 0; o <= BUDDY_MAX_ORDER; o++)
+	{
+		index->summary[o] = 0;
+		for (int w = 0; w < BUDDY_INDEX_WORDS; w++)
+			index->avail[o][w] = 0;
+	}
 
-	buddy->buddy_tree[pChar] = v | cbv;
+	for (uint32_t i = 0; i < count; i++)
+	{
+		buddies[i].index = index;
+		buddies[i].id = i;
+		buddy_index_update(&buddies[i], 0);
+	}
 }
 
-static void buddy_coalesce(struct buddy_t *buddy, uint8_t order, uint16_t p)
+void buddy_init(struct buddy_t *buddy)
 {
-	buddy_set_position(buddy, p, 0);
-
-	uint16_t fpos = p - BUDDY_MIN_BUDDY_FOR_ORDER(order) + 1;
-
-	if (fpos < buddy->freelist[order] || buddy->freelist[order] == 0)
+	uint64_t npages = buddy->size / BUDDY_BLOCK_SIZE;
+	if (npages > (1 << BUDDY_MAX_ORDER))
+		npages = 1 << BUDDY_MAX_ORDER;
+
+	buddy->index = 0;
+	buddy->id = 0;
+	buddy->span = 0;
+	buddy->free_orders = 0;
+	for (int i = 0; i <= BUDDY_MAX_ORDER; i++)
+		buddy->free_summary[i] = 0;
+	for (int i = 0; i < BUDDY_FREE_MAP_WORDS; i++)
+		buddy->free_map[i] = 0;
+	for (int i = 0; i < BUDDY_TREE_SIZE; i++)
+		buddy->buddy_tree[i] = 0;
+
+	// carve the arena into the largest aligned blocks which fit, marking
+	// their parents as split
+	uint64_t start = 0;
+	while (start < npages)
 	{
-		buddy->freelist[order] = fpos;
-	}
+		int order = BUDDY_MAX_ORDER;
+		while (order > 0 && ((start & ((1ULL << order) - 1)) != 0 || start + (1ULL << order) > npages))
+			order--;
 
-	if (p == 0)
-		return;
+		uint16_t i = start >> order;
+		buddy_mark_free(buddy, order, i);
 
-	if (BUDDY_GET_POSITION(buddy, BUDDY_COMPANION_POSITION(p)) == 0)
-	{
-		return buddy_coalesce(buddy, order + 1, BUDDY_PARENT_POSITION(p));
+		uint16_t pos = BUDDY_ORDER_POSITION_OFFSET(order, i);
+		while (pos > 0)
+		{
+			pos = BUDDY_PARENT_POSITION(pos);
+			buddy_set_position(buddy, pos, 1);
+		}
+
+		start += 1ULL << order;
 	}
 }
 
@@ -173,135 +206,214 @@ void *buddy_alloc(struct buddy_t *buddy, int order)
 {
 	if (order > BUDDY_MAX_ORDER)
 	{
-		return 0;
+		if (buddy->index == 0 || order - BUDDY_MAX_ORDER >= 32)
+			return 0;
+
+		return buddy_alloc_span(buddy, 1U << (order - BUDDY_MAX_ORDER));
 	}
 
 	// find a empty or partial buddy
 	struct buddy_t *candidate = buddy;
-	while (candidate)
+	if (buddy->index != 0)
 	{
-		if (buddy_is_full(candidate, order))
-		{
+		candidate = buddy_index_find(buddy->index, order);
+	}
+	else
+	{
+		while (candidate && buddy_is_full(candidate, order))
 			candidate = candidate->next;
-		}
-		else
-		{
-			break;
-		}
 	}
 
 	if (!candidate)
 		return 0;
 
-	// find a slot
-	uint16_t freepos = candidate->freelist[order];
+	return buddy_alloc_from(candidate, order);
+}
+
+static void *buddy_alloc_from(struct buddy_t *candidate, uint8_t order)
+{
+	uint16_t prev_free_orders = candidate->free_orders;
+
+	// smallest order with a free block
+	uint8_t from = order + __builtin_ctz(candidate->free_orders >> order);
+	uint16_t i = buddy_first_free(candidate, from);
+
+	buddy_clear_free(candidate, from, i);
+	buddy_set_position(candidate, BUDDY_ORDER_POSITION_OFFSET(from, i), 1);
 
-	if (freepos > 0 && (freepos - 1) < BUDDY_MAX_BUDDY_FOR_ORDER(order))
+	// split down to the wanted order, freeing the right hand buddies
+	while (from > order)
 	{
-		uint16_t pos = BUDDY_ORDER_POSITION_OFFSET(order, freepos - 1);
-		uint8_t v = BUDDY_GET_POSITION(candidate, pos);
-		void *addr = (void *)((uintptr_t)buddy_pos_to_addr(pos) + (uintptr_t)&candidate->arena[0]);
+		from--;
+		i <<= 1;
 
-		if (v)
-		{
-			// somethings wrong!
-			// our freelist says it should be free but is not
-			terminal_log("Unexpected value found in buddy freelist!!");
-			return 0;
-		}
+		buddy_set_position(candidate, BUDDY_ORDER_POSITION_OFFSET(from, i), 1);
+		buddy_mark_free(candidate, from, i + 1);
+	}
 
-		if (buddy_is_parent_split(candidate, pos))
-		{
-			// fast alloc
-			buddy_set_position(candidate, pos, 1);
+	buddy_index_update(candidate, prev_free_orders);
 
-			for (int orderToUpdate = order; orderToUpdate >= 0; orderToUpdate--)
-			{
-				candidate->freelist[orderToUpdate] = buddy_order_next_free_pos(candidate, orderToUpdate);
-			}
+	candidate->allocs++;
 
-			buddy->allocs++;
+	return (void *)((uintptr_t)&candidate->arena[0] + ((uintptr_t)i << order) * BUDDY_BLOCK_SIZE);
+}
 
-			return addr;
-		}
+void *buddy_alloc_span(struct buddy_t *buddy, uint32_t n)
+{
+	struct buddy_index_t *index = buddy->index;
 
-		// split parent
-		int split = buddy_split_mark_parent(candidate, pos);
-		switch (split)
+	if (index == 0 || n == 0 || n > index->count)
+		return 0;
+
+	// find a run of n whole free arenas
+	uint64_t *avail = index->avail[BUDDY_MAX_ORDER];
+	uint32_t start = 0;
+	uint32_t run = 0;
+
+	for (uint32_t id = 0; id < index->count && run < n; id++)
+	{
+		if ((id % 64) == 0 && avail[id / 64] == 0)
 		{
-		case 0:
-			// TODO(tcfw) get split mark to return the max order it split up to
-			buddy_set_position(buddy, pos, 1);
-			break;
-		case 1:
-			// fell below max order - should never happen
-			terminal_log("ran past buddy max order!");
-			return 0;
-		case 2:
-			// position was already allocated, meaning our freelist is corrupt
-			break;
-		default:
-			terminal_log("unexpected return from buddy split mark parent!");
-			return 0;
+			run = 0;
+			id += 63;
+			continue;
 		}
 
-		// recalculate for all orders
-		for (int orderToUpdate = BUDDY_MAX_ORDER; orderToUpdate >= 0; orderToUpdate--)
+		if ((avail[id / 64] >> (id % 64)) & 0x1)
+		{
+			if (run++ == 0)
+				start = id;
+		}
+		else
 		{
-			candidate->freelist[orderToUpdate] = buddy_order_next_free_pos(candidate, orderToUpdate);
+			run = 0;
 		}
+	}
 
-		buddy->allocs++;
+	if (run < n)
+		return 0;
 
-		return addr;
-	}
+	for (uint32_t id = start; id < start + n; id++)
+		buddy_alloc_from(&index->buddies[id], BUDDY_MAX_ORDER);
+
+	index->buddies[start].span = n;
 
-	return 0;
+	return &index->buddies[start].arena[0];
 }
 
-void buddy_free(struct buddy_t *buddy, void *ptr)
+static struct buddy_t *buddy_lookup(struct buddy_t *buddy, void *ptr, uint8_t *order, uint16_t *index)
 {
 	struct buddy_t *candidate = buddy;
 	uintptr_t reladdr = 0;
 	uint64_t l0_offset = 0;
 
-	while (candidate)
+	if (buddy->index != 0)
 	{
+		// arenas are contiguous, so the buddy is found directly
+		struct buddy_index_t *index = buddy->index;
+		uintptr_t base = (uintptr_t)&index->buddies[0].arena[0];
+
+		if ((uintptr_t)ptr < base || ((uintptr_t)ptr - base) / BUDDY_ARENA_SIZE >= index->count)
+			return 0;
+
+		candidate = &index->buddies[((uintptr_t)ptr - base) / BUDDY_ARENA_SIZE];
 		reladdr = (uintptr_t)ptr - (uintptr_t)&candidate->arena[0];
 		l0_offset = reladdr / BUDDY_BLOCK_SIZE;
 
-		if (l0_offset < BUDDY_MAX_BUDDY_FOR_ORDER(0))
+		if (l0_offset >= (candidate->size / BUDDY_BLOCK_SIZE))
+			return 0;
+	}
+	else
+	{
+		while (candidate)
 		{
-			break;
-		}
+			reladdr = (uintptr_t)ptr - (uintptr_t)&candidate->arena[0];
+			l0_offset = reladdr / BUDDY_BLOCK_SIZE;
+
+			if ((uintptr_t)ptr >= (uintptr_t)&candidate->arena[0] && l0_offset < (candidate->size / BUDDY_BLOCK_SIZE))
+			{
+				break;
+			}
 
-		candidate = candidate->next;
+			candidate = candidate->next;
+		}
 	}
 
 	if (!candidate)
 		// not a valid address
+		return 0;
+
+	// travel up from the lowest order until we find the allocated block
+	uint8_t o = 0;
+	uint16_t i = l0_offset;
+
+	while (BUDDY_GET_POSITION(candidate, BUDDY_ORDER_POSITION_OFFSET(o, i)) == 0)
+	{
+		if (o == BUDDY_MAX_ORDER || (i & 0x1) != 0 || buddy_is_free(candidate, o, i))
+			// was not allocd, or not the start of a block
+			return 0;
+
+		o++;
+		i >>= 1;
+	}
+
+	*order = o;
+	*index = i;
+
+	return candidate;
+}
+
+int buddy_alloc_order(struct buddy_t *buddy, void *ptr)
+{
+	uint8_t order;
+	uint16_t i;
+
+	if (buddy_lookup(buddy, ptr, &order, &i) == 0)
+		return -1;
+
+	return order;
+}
+
+void buddy_free(struct buddy_t *buddy, void *ptr)
+{
+	uint8_t order;
+	uint16_t i;
+
+	struct buddy_t *candidate = buddy_lookup(buddy, ptr, &order, &i);
+	if (!candidate)
 		return;
 
-	uint8_t order = 0;
-	uint16_t pos = l0_offset + BUDDY_MIN_BUDDY_FOR_ORDER(0);
+	if (candidate->span > 1)
+	{
+		// the following arenas of a span are whole max order blocks
+		for (uint32_t n = 1; n < candidate->span; n++)
+			buddy_free_block(&candidate->index->buddies[candidate->id + n], BUDDY_MAX_ORDER, 0);
+
+		candidate->span = 0;
+	}
+
+	buddy_free_block(candidate, order, i);
+}
 
-	while (order < BUDDY_MAX_ORDER)
+static void buddy_free_block(struct buddy_t *candidate, uint8_t order, uint16_t i)
+{
+	uint16_t prev_free_orders = candidate->free_orders;
+
+	buddy_set_position(candidate, BUDDY_ORDER_POSITION_OFFSET(order, i), 0);
+
+	// coalesce with free companion buddies
+	while (order < BUDDY_MAX_ORDER && buddy_is_free(candidate, order, i ^ 1))
 	{
-		if (BUDDY_GET_POSITION(candidate, pos) == 1)
-		{
-			break;
-		}
+		buddy_clear_free(candidate, order, i ^ 1);
 
 		order++;
-		pos = BUDDY_PARENT_POSITION(pos);
-		if (order > BUDDY_MAX_ORDER)
-		{
-			// was not allocd
-			return;
-		}
+		i >>= 1;
+
+		buddy_set_position(candidate, BUDDY_ORDER_POSITION_OFFSET(order, i), 0);
 	}
 
-	buddy_coalesce(candidate, order, pos);
+	buddy_mark_free(candidate, order, i);
+	buddy_index_update(candidate, prev_free_orders);
 
-	buddy->frees++;
-}
\ No newline at end of file
+	candidate->frees++;
+}
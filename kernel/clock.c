@@ -42,12 +42,24 @@ void timespec_from_cs(struct clocksource_t *cs, timespec_t *ts)
 	uint64_t freq = cs->getFreq(cs);
 
 	uint64_t seconds = cc / freq;
-	uint64_t clock_nanos = 1000000000 / freq;
-	uint64_t nano = (cc - (seconds * freq)) * clock_nanos;
+
+	// scaled before dividing, the inverse of timespec_to_cs without losing the sub-nanosecond tick period
+	uint64_t nano = (cc - (seconds * freq)) * 1000000000 / freq;
 	ts->seconds = seconds;
 	ts->nanoseconds = nano;
 }
 
+uint64_t timespec_to_cs(struct clocksource_t *cs, const timespec_t *ts)
+{
+	uint64_t freq = cs->getFreq(cs);
+
+	if (ts->seconds < 0)
+		return 0;
+
+	// round up, so the timespec has passed once the counter reaches the value
+	return ts->seconds * freq + (ts->nanoseconds * freq + 999999999) / 1000000000;
+}
+
 void timespec_diff(const timespec_t *a, const timespec_t *b, timespec_t *result)
 {
 	result->seconds = a->seconds - b->seconds;
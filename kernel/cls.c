@@ -3,13 +3,73 @@
 #include <kernel/arch.h>
 #include <kernel/devicetree.h>
 #include <kernel/stdint.h>
+#include <kernel/strings.h>
+#include <kernel/tty.h>
 
 static cls_t *cls;
 static uint8_t max_cls;
 
+static cpu_topology_t topology[CLS_MAX_CPUS];
+static uint32_t ncpu;
+
+void init_topology(void)
+{
+	void *node = devicetree_first_with_device_type("cpu");
+
+	ncpu = 0;
+
+	while (node != 0)
+	{
+		char *devType = devicetree_get_property(node, FDT_DEVICE_TYPE_PROP);
+		if (devType == 0 || strcmp(devType, "cpu") != 0)
+		{
+			node = devicetree_get_next_node(node);
+			continue;
+		}
+
+		if (ncpu == CLS_MAX_CPUS)
+		{
+			terminal_logf("limiting CPUs to %d", CLS_MAX_CPUS);
+			break;
+		}
+
+		cpu_topology_t *cpu = &topology[ncpu];
+
+		// reg holds the MPIDR affinity fields in 1 or 2 cells
+		uint32_t *reg = (uint32_t *)devicetree_get_property(node, "reg");
+		uint32_t reg_len = devicetree_get_property_len(node, "reg");
+
+		if (reg == 0)
+			cpu->mpidr = ncpu;
+		else if (reg_len >= sizeof(uint64_t))
+			cpu->mpidr = ((uint64_t)BIG_ENDIAN_UINT32(reg[0]) << 32) | BIG_ENDIAN_UINT32(reg[1]);
+		else
+			cpu->mpidr = BIG_ENDIAN_UINT32(reg[0]);
+
+		// Aff1
+		cpu->cluster = (cpu->mpidr >> 8) & 0xFF;
+
+		ncpu++;
+		node = devicetree_get_next_node(node);
+	}
+}
+
+uint32_t cpu_count(void)
+{
+	return ncpu;
+}
+
+const cpu_topology_t *cpu_topology(uint32_t n)
+{
+	if (n >= ncpu)
+		return 0;
+
+	return &topology[n];
+}
+
 void init_cls()
 {
-	uint32_t n = devicetree_count_dev_type("cpu");
+	uint32_t n = cpu_count();
 
 	max_cls = n;
 
@@ -30,7 +90,7 @@ cls_t *get_cls(void)
 
 cls_t *get_core_cls(uint8_t n)
 {
-	if (n > max_cls)
+	if (n >= max_cls)
 		return 0;
 
 	return (cls_t *)(cls + n);
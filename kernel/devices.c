@@ -131,7 +131,7 @@ static char *virtio_subsystem_compatibility(void *dev_bar, size_t bar_size, char
 		compatibility = newcompat;
 	}
 
-	if (vm_unmap_region(vm_get_kernel(), (uintptr_t)barpg, devpgsize) < 0)
+	if (vm_unmap_region(vm_get_kernel(), 0, (uintptr_t)barpg, devpgsize) < 0)
 		terminal_log("failed to unmap device region");
 
 	return compatibility;
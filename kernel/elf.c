@@ -3,6 +3,7 @@
 #include <kernel/elf.h>
 #include <kernel/mm.h>
 #include <kernel/tty.h>
+#include <kernel/umm.h>
 #include <kernel/vm.h>
 #include <kernel/strings.h>
 
@@ -56,6 +57,10 @@ int load_elf(vm_t *vm, struct elf_hdr_64_t *hdr)
 			paddr = vm_va_to_pa(vm_get_current_table(), (uintptr_t)page);
 		}
 
+		// the page may have held another process's code
+		if ((phdr->p_flags & PF_X) != 0)
+			vm_sync_icache(page != 0 ? page : (uint8_t *)hdr + phdr->p_offset, phdr->p_memsz);
+
 		int ret = vm_map_region(vm->vm_table, paddr, (uintptr_t)phdr->p_vaddr, region_size, flags);
 		if (ret < 0)
 			return ret;
@@ -69,7 +74,7 @@ int load_elf(vm_t *vm, struct elf_hdr_64_t *hdr)
 		map->vm_addr = phdr->p_vaddr;
 		map->length = phdr->p_memsz;
 		map->page = page;
-		list_add(&map->list, &vm->vm_maps);
+		vm_maps_insert(vm, map);
 
 		if (map->vm_addr + map->length > vm->brk)
 			vm->start_brk = map->vm_addr + map->length;
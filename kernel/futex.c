@@ -13,9 +13,12 @@
 #include <kernel/wait.h>
 
 futex_hb_t *futex_buckets;
+static slub_t *futex_queue_slub;
 
 void futex_init(void)
 {
+	futex_queue_slub = DEFINE_DYN_SLUB(sizeof(futex_queue_t));
+
 	futex_buckets = (futex_hb_t *)page_alloc_s(sizeof(futex_hb_t) * FUTEX_HASHBUCKETS_SIZE);
 
 	futex_hb_t *f = futex_buckets;
@@ -84,7 +87,9 @@ int futex_do_wake(void *uaddr, uint32_t n_wake, uint32_t val)
 		if (queued_task->wanted_value != val)
 			continue;
 
+		// the waker now owns the entry, even if a timeout wakes the thread first
 		list_del(queued_task);
+		queued_task->taken = 1;
 		list_add(&queued_task->list, &to_wake);
 
 		if (++ret >= n_wake)
@@ -93,8 +98,12 @@ int futex_do_wake(void *uaddr, uint32_t n_wake, uint32_t val)
 
 	spinlock_release(&hb->lock);
 
+	// only wakes the thread if it is still in the same wait
 	list_head_for_each_safe(queued_task, next, &to_wake)
-		wake_thread(queued_task->thread);
+	{
+		wake_thread_cond(queued_task->thread, queued_task->wc);
+		kfree(queued_task);
+	}
 
 	return ret;
 }
@@ -132,7 +141,7 @@ int futex_do_sleep(void *uaddr, uint32_t val, int64_t timeout_ns)
 
 	thread_t *thread = current;
 
-	futex_queue_t *queue = kmalloc(sizeof(futex_queue_t));
+	futex_queue_t *queue = slub_alloc(futex_queue_slub);
 	if (queue == NULL)
 	{
 		spinlock_release(&hb->lock);
@@ -141,56 +150,58 @@ int futex_do_sleep(void *uaddr, uint32_t val, int64_t timeout_ns)
 	queue->key.both = key.both;
 	queue->wanted_value = val;
 	queue->thread = thread;
+	queue->taken = 0;
 
 	struct thread_wait_cond_futex *wc = kmalloc(sizeof(struct thread_wait_cond_futex));
 	if (wc == NULL)
-	{
-		spinlock_release(&hb->lock);
 		goto freeQueue;
-	}
 
 	wc->cond.type = WAIT;
 	wc->queue = queue;
+	queue->wc = wc;
+	wc->timeout = NULL;
+
+	if (timeout_ns > 0)
+	{
+		wc->timeout = alloc_waitqueue_entry();
+		if (wc->timeout == NULL)
+			goto freeWC;
+	}
 
 	thread_wait_for_cond(thread, wc);
 	list_add_tail(&queue->list, &hb->chain);
 
-	spinlock_release(&hb->lock);
-
-	if (timeout_ns <= 0)
-		return ret;
-
-	timespec_t *t = kmalloc(sizeof(*t));
-	if (t == NULL)
-		goto freeWC;
-
-	t->nanoseconds = timeout_ns & ((1 << 30) - 1);
-	t->seconds = timeout_ns >> 30;
-
-	waitqueue_entry_t *wqe = kmalloc(sizeof(waitqueue_entry_t));
-	if (wqe == NULL)
-		goto freeToT;
-
-	wqe->thread = thread;
-	wqe->func = wq_can_wake_thread;
-	wqe->timeout = t;
-	wc->timeout = wqe;
+	if (timeout_ns > 0)
+	{
+		// timeouts are absolute, in 2^30ns seconds
+		timespec_t t = {
+			.seconds = timeout_ns >> 30,
+			.nanoseconds = timeout_ns & ((1 << 30) - 1),
+		};
+
+		waitqueue_entry_t *wqe = wc->timeout;
+		wqe->thread = thread;
+		wqe->data = wc;
+
+		// queued before releasing the bucket, so a wake always finds the timeout to cancel
+		ret = timerqueue_add(&get_cls()->sleepq, wqe, timespec_to_cs(clock_first(CS_GLOBAL), &t));
+		if (ret < 0)
+		{
+			list_del(queue);
+			goto freeTimeout;
+		}
+	}
 
-	cls_t *cls = get_cls();
-	spinlock_acquire(&cls->sleepq.lock);
-	list_add_tail(&wqe->list, &cls->sleepq.head);
-	spinlock_release(&cls->sleepq.lock);
+	spinlock_release(&hb->lock);
 
 	return 0;
 
-freeToT:
-	kfree(t);
+freeTimeout:
+	kfree(wc->timeout);
 freeWC:
 	thread->wc = NULL;
 	kfree(wc);
 freeQueue:
-	spinlock_acquire(&hb->lock);
-	list_del(queue);
 	spinlock_release(&hb->lock);
 	kfree(queue);
 	set_thread_state(thread, THREAD_RUNNING);
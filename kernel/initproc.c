@@ -7,6 +7,7 @@
 #include <kernel/strings.h>
 #include <kernel/thread.h>
 #include <kernel/tty.h>
+#include <kernel/umm.h>
 #include <kernel/vm.h>
 
 int load_initproc()
@@ -57,16 +58,16 @@ int load_initproc()
 	}
 	map->flags = VM_MAP_FLAG_PHY_KERNEL | stack_flags;
 	map->phy_addr = stack_paddr;
-	map->vm_addr = stack_vaddr_top;
+	map->vm_addr = stack_vaddr_bottom;
 	map->length = USER_STACK_SIZE;
 	map->page = (struct page *)stack;
-	list_add(&map->list, &proc->vm.vm_maps);
+	vm_maps_insert(&proc->vm, map);
 
 	// TODO(tcfw) load VDSO
 
 	proc->vm.start_stack = stack_vaddr_top;
 
-	thread_t *thread = (thread_t *)page_alloc_s(sizeof(thread_t));
+	thread_t *thread = alloc_thread();
 	if (!thread)
 	{
 		ret = -ERRNOMEM;
@@ -78,7 +79,7 @@ int load_initproc()
 	thread->ctx.pc = initproc->e_entry;
 	thread->ctx.sp = stack_vaddr_top - 0xA0;
 
-	thread_list_entry_t *tle = kmalloc(sizeof(thread_list_entry_t));
+	thread_list_entry_t *tle = alloc_thread_list_entry();
 	if (!tle)
 	{
 		ret = -ERRNOMEM;
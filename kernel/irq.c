@@ -84,8 +84,10 @@ void k_setup_soft_irq()
 {
 	assign_irq_hook(SOFT_IRQ_HALT_CORE, halt_core);
 	assign_irq_hook(SOFT_IRQ_THREAD_STOP, thread_stop_core);
+	assign_irq_hook(SOFT_IRQ_RESCHEDULE, thread_stop_core);
 	enable_xrq_n(0);
 	enable_xrq_n(1);
+	enable_xrq_n(2);
 }
 
 void k_setup_clock_irq()
@@ -107,12 +109,8 @@ static void clock_tick(unsigned int xrq)
 	cs->disable(cs);
 	cs->disableIRQ(cs);
 
+	// schedule programs the next deadline, or leaves the timer off if there is none
 	schedule();
-
-	uint64_t freq = cs->getFreq(cs);
-	cs->countNTicks(cs, freq / 250);
-	cs->enableIRQ(cs);
-	cs->enable(cs);
 }
 
 static void halt_core(__attribute__((unused)) unsigned int _)
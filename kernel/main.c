@@ -14,6 +14,7 @@
 #include <kernel/msgs.h>
 #include <kernel/queue.h>
 #include <kernel/regions.h>
+#include <kernel/shm.h>
 #include <kernel/stdint.h>
 #include <kernel/strings.h>
 #include <kernel/syscall.h>
@@ -162,17 +163,22 @@ void kernel_main(void)
     // dumpdevicetree();
 
     global_clock_init();
+    init_topology();
     page_alloc_init();
     slub_alloc_init();
+    init_thread_caches();
+    init_waitqueue_cache();
     vm_init();
     init_cls();
     sched_init();
     syscall_init();
     queues_init();
+    shm_init();
     futex_init();
     mod_init();
 
     init_kthread_proc();
+    vm_reaper_init();
     setup_init_threads();
 
     if (RUN_SELF_TESTS == 1)
@@ -213,7 +219,7 @@ void kernel_main2(void) __attribute__((kernel))
     {
         terminal_logf("Waiting for other cores to boot...");
 
-        unsigned int cpuN = devicetree_count_dev_type("cpu");
+        unsigned int cpuN = cpu_count();
         while (cpuN != __atomic_load_n(&booted, __ATOMIC_CONSUME))
         {
         }
@@ -1,6 +1,6 @@
 #include <kernel/arch.h>
 #include <kernel/buddy.h>
-#include <kernel/devicetree.h>
+#include <kernel/cls.h>
 #include <kernel/mm.h>
 #include <kernel/panic.h>
 #include <kernel/regions.h>
@@ -15,11 +15,69 @@ extern uint64_t kernelend;
 extern uint64_t kernelvstart;
 
 struct buddy_t *pages;
+static struct buddy_index_t pages_index;
 static spinlock_t page_lock;
 
+// highest order held in the per-CPU page caches
+#define PAGE_CPU_CACHE_MAX_ORDER (2)
+
+// number of pages moved between a per-CPU page cache and the buddy at once
+#define PAGE_CPU_CACHE_BATCH (8)
+
+// max number of blocks held per order in a per-CPU page cache
+#define PAGE_CPU_CACHE_HIGH (32)
+
+// per-CPU stack of free low order blocks in front of the buddy
+// the owning CPU takes the lock with IRQs disabled, other CPUs only take it
+// to drain the cache when the buddy is exhausted, so it is rarely contended
+typedef struct page_cpu_cache_t
+{
+	spinlock_t lock;
+	uint32_t count[PAGE_CPU_CACHE_MAX_ORDER + 1];
+	void *blocks[PAGE_CPU_CACHE_MAX_ORDER + 1][PAGE_CPU_CACHE_HIGH];
+} __attribute__((aligned(CACHE_LINE_SIZE))) page_cpu_cache_t;
+
+static page_cpu_cache_t *page_cpu_caches;
+
+// highest order held in the per-CPU zeroed page pools
+#define PAGE_ZERO_POOL_MAX_ORDER (4)
+
+// max number of zeroed blocks held per order in a per-CPU zeroed page pool
+#define PAGE_ZERO_POOL_HIGH (8)
+
+// per-CPU stack of pre-zeroed blocks, topped up by the CPU's idle thread
+// locked the same way as the per-CPU page caches
+typedef struct page_zero_pool_t
+{
+	spinlock_t lock;
+	uint32_t count[PAGE_ZERO_POOL_MAX_ORDER + 1];
+	void *blocks[PAGE_ZERO_POOL_MAX_ORDER + 1][PAGE_ZERO_POOL_HIGH];
+} __attribute__((aligned(CACHE_LINE_SIZE))) page_zero_pool_t;
+
+static page_zero_pool_t *page_zero_pools;
+
+// extra owners of a page shared between address spaces
+// untracked pages have no extra owners, so the table starts zeroed
+typedef struct page_ref_t
+{
+	// address spaces mapping the page, less one
+	uint16_t refs;
+
+	// mappings holding the block starting at this page, less one
+	uint16_t block_refs;
+} page_ref_t;
+
+static page_ref_t *page_refs;
+static uintptr_t page_refs_start;
+static uint64_t page_refs_count;
+
 slub_t *slub_head;
 
-#define MAX_SLUB_CLASSES (12)
+#define MAX_SLUB_CLASSES (18)
+
+// granularity of the kmalloc size to class table
+#define SLUB_CLASS_LOOKUP_SHIFT (3)
+#define SLUB_CLASS_LOOKUP_SIZE ((PAGE_SIZE >> SLUB_CLASS_LOOKUP_SHIFT) + 1)
 
 const slub_class_catalogue_t slub_classes[MAX_SLUB_CLASSES] = {
 	{8},
@@ -31,12 +89,22 @@ const slub_class_catalogue_t slub_classes[MAX_SLUB_CLASSES] = {
 	{72},
 	{88},
 	{128},
+	{192},
+	{256},
+	{384},
+	{512},
+	{768},
 	{1024},
 	{2048},
 	{3072},
 	{PAGE_SIZE - sizeof(slub_cache_entry_t)},
 };
 
+static slub_t *slub_class_slubs[MAX_SLUB_CLASSES];
+
+// index of the smallest class which fits, by size rounded up to the lookup granularity
+static uint8_t slub_class_lookup[SLUB_CLASS_LOOKUP_SIZE];
+
 slub_t *get_slub_head()
 {
 	return slub_head;
@@ -65,13 +133,21 @@ void page_alloc_init()
 	if (ram_max_addr - (n_arenas * buddy_size) > (BUDDY_ARENA_SIZE / 2))
 		n_arenas++;
 
+	if (n_arenas > BUDDY_INDEX_MAX_BUDDIES)
+	{
+		terminal_logf("limiting page arenas to %d", BUDDY_INDEX_MAX_BUDDIES);
+		n_arenas = BUDDY_INDEX_MAX_BUDDIES;
+	}
+
 	uint64_t end_of_buddies = (uint64_t)&kernelend + (n_arenas * buddy_struct_size);
 
 	// first buddy
 	pages = (struct buddy_t *)&kernelend;
 	pages->size = BUDDY_ARENA_SIZE;
 	pages->arena = (unsigned char *)end_of_buddies;
-	pages->arena += PAGE_SIZE - ((uintptr_t)pages->arena % PAGE_SIZE); // page align
+
+	// block aligned, so large buddy blocks can be mapped with a single L2 block entry
+	pages->arena = (unsigned char *)(((uintptr_t)pages->arena + L2_BLOCK_SIZE - 1) & ~(uintptr_t)(L2_BLOCK_SIZE - 1));
 
 	buddy_init(pages);
 
@@ -88,12 +164,20 @@ void page_alloc_init()
 		struct buddy_t *cb = (struct buddy_t *)(prev + 1);
 		cb->size = BUDDY_ARENA_SIZE;
 		cb->arena = prev->arena + prev->size;
-		buddy_init(cb);
+
+		// the alignment of the first arena may have left no room for the last
+		if ((uintptr_t)cb->arena >= ram_max_addr)
+		{
+			n_arenas = i;
+			break;
+		}
 
 		// partial buddy
 		if ((uintptr_t)(cb->arena + cb->size) > ram_max_addr)
 			cb->size = ram_max_addr - (uint64_t)cb->arena;
 
+		buddy_init(cb);
+
 		// terminal_logf("Buddy: *0x%X size: 0x%X arena: 0x%X", cb, cb->size, cb->arena);
 
 		prev->next = cb;
@@ -101,6 +185,100 @@ void page_alloc_init()
 	}
 
 	terminal_logf("End of pages arena: 0x%X", (uintptr_t)(prev->arena + prev->size));
+
+	buddy_index_init(&pages_index, pages, n_arenas);
+
+	size_t caches_size = sizeof(page_cpu_cache_t) * cpu_count();
+	page_cpu_cache_t *caches = (page_cpu_cache_t *)page_alloc_s(caches_size);
+	memset(caches, 0, caches_size);
+
+	size_t pools_size = sizeof(page_zero_pool_t) * cpu_count();
+	page_zero_pool_t *pools = (page_zero_pool_t *)page_alloc_s(pools_size);
+	memset(pools, 0, pools_size);
+
+	int cc = cpu_count();
+	for (int c = 0; c < cc; c++)
+	{
+		spinlock_init(&caches[c].lock);
+		spinlock_init(&pools[c].lock);
+	}
+
+	page_cpu_caches = caches;
+	page_zero_pools = pools;
+
+	page_refs_start = (uintptr_t)pages->arena;
+	page_refs_count = ((uintptr_t)(prev->arena + prev->size) - page_refs_start) / PAGE_SIZE;
+
+	size_t refs_size = sizeof(page_ref_t) * page_refs_count;
+	page_ref_t *refs = (page_ref_t *)page_alloc_s(refs_size);
+	memset(refs, 0, refs_size);
+	page_refs = refs;
+}
+
+// page_ref finds the ref counts of the page, or 0 if the page is not from the page arenas
+static page_ref_t *page_ref(void *page)
+{
+	uintptr_t addr = (uintptr_t)page;
+
+	if (page_refs == 0 || addr < page_refs_start)
+		return 0;
+
+	uint64_t n = (addr - page_refs_start) / PAGE_SIZE;
+	if (n >= page_refs_count)
+		return 0;
+
+	return &page_refs[n];
+}
+
+void page_ref_get(void *page)
+{
+	page_ref_t *ref = page_ref(page);
+	if (ref != 0)
+		__atomic_add_fetch(&ref->refs, 1, __ATOMIC_RELAXED);
+}
+
+int page_ref_put(void *page)
+{
+	page_ref_t *ref = page_ref(page);
+
+	// never owned outright
+	if (ref == 0)
+		return 1;
+
+	uint16_t refs = __atomic_load_n(&ref->refs, __ATOMIC_RELAXED);
+	while (refs != 0 && !__atomic_compare_exchange_n(&ref->refs, &refs, refs - 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+		;
+
+	return refs;
+}
+
+int page_ref_count(void *page)
+{
+	page_ref_t *ref = page_ref(page);
+	if (ref == 0)
+		return 1;
+
+	return __atomic_load_n(&ref->refs, __ATOMIC_ACQUIRE);
+}
+
+void page_block_ref_get(void *block)
+{
+	page_ref_t *ref = page_ref(block);
+	if (ref != 0)
+		__atomic_add_fetch(&ref->block_refs, 1, __ATOMIC_RELAXED);
+}
+
+int page_block_ref_put(void *block)
+{
+	page_ref_t *ref = page_ref(block);
+	if (ref == 0)
+		return 1;
+
+	uint16_t refs = __atomic_load_n(&ref->block_refs, __ATOMIC_RELAXED);
+	while (refs != 0 && !__atomic_compare_exchange_n(&ref->block_refs, &refs, refs - 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+		;
+
+	return refs;
 }
 
 unsigned int size_to_order(size_t size)
@@ -117,24 +295,244 @@ unsigned int size_to_order(size_t size)
 
 struct page *__attribute__((malloc)) page_alloc_s(size_t size)
 {
+	if (size > BUDDY_ARENA_SIZE)
+	{
+		// span of whole arenas, rather than rounding up to the next order
+		uint32_t n = (size + BUDDY_ARENA_SIZE - 1) / BUDDY_ARENA_SIZE;
+
+		int state = spinlock_acquire_irq(&page_lock);
+		void *addr = buddy_alloc_span(pages, n);
+		spinlock_release_irq(state, &page_lock);
+
+		return (struct page *)addr;
+	}
+
 	unsigned int order = size_to_order(size);
 	return (struct page *)page_alloc(order);
 }
 
+// page_cpu_cache_refill moves a batch of blocks from the buddy into the per-CPU cache
+static void page_cpu_cache_refill(page_cpu_cache_t *cache, unsigned int order)
+{
+	spinlock_acquire(&page_lock);
+
+	while (cache->count[order] < PAGE_CPU_CACHE_BATCH)
+	{
+		void *addr = buddy_alloc(pages, order);
+		if (addr == 0)
+			break;
+
+		cache->blocks[order][cache->count[order]++] = addr;
+	}
+
+	spinlock_release(&page_lock);
+}
+
+// page_cpu_cache_drain returns up to n blocks of the order from the per-CPU cache to the buddy
+static void page_cpu_cache_drain(page_cpu_cache_t *cache, unsigned int order, unsigned int n)
+{
+	spinlock_acquire(&page_lock);
+
+	while (n-- > 0 && cache->count[order] > 0)
+		buddy_free(pages, cache->blocks[order][--cache->count[order]]);
+
+	spinlock_release(&page_lock);
+}
+
+// page_cpu_cache_drain_all returns every block held in the per-CPU cache to the buddy
+static void page_cpu_cache_drain_all(page_cpu_cache_t *cache)
+{
+	for (unsigned int order = 0; order <= PAGE_CPU_CACHE_MAX_ORDER; order++)
+		page_cpu_cache_drain(cache, order, PAGE_CPU_CACHE_HIGH);
+}
+
+// page_zero_pool_drain returns every block held in the per-CPU zeroed page pool to the buddy
+static void page_zero_pool_drain(page_zero_pool_t *pool)
+{
+	spinlock_acquire(&page_lock);
+
+	for (unsigned int order = 0; order <= PAGE_ZERO_POOL_MAX_ORDER; order++)
+		while (pool->count[order] > 0)
+			buddy_free(pages, pool->blocks[order][--pool->count[order]]);
+
+	spinlock_release(&page_lock);
+}
+
+// page_drain_all_cpus returns the blocks held by every CPU's cache and zeroed page pool to the buddy
+// a cache or pool lock is always taken before the page lock, so neither may be held by the caller
+// IRQs must be disabled
+static void page_drain_all_cpus(void)
+{
+	int cc = cpu_count();
+	for (int c = 0; c < cc; c++)
+	{
+		spinlock_acquire(&page_cpu_caches[c].lock);
+		page_cpu_cache_drain_all(&page_cpu_caches[c]);
+		spinlock_release(&page_cpu_caches[c].lock);
+
+		spinlock_acquire(&page_zero_pools[c].lock);
+		page_zero_pool_drain(&page_zero_pools[c]);
+		spinlock_release(&page_zero_pools[c].lock);
+	}
+}
+
 struct page *__attribute__((malloc)) page_alloc(unsigned int order)
 {
+	void *addr = 0;
+
+	if (order <= PAGE_CPU_CACHE_MAX_ORDER && page_cpu_caches != 0)
+	{
+		int state = local_irq_save();
+		page_cpu_cache_t *cache = &page_cpu_caches[cpu_id()];
+		spinlock_acquire(&cache->lock);
+
+		if (cache->count[order] == 0)
+			page_cpu_cache_refill(cache, order);
+
+		if (cache->count[order] > 0)
+			addr = cache->blocks[order][--cache->count[order]];
+
+		spinlock_release(&cache->lock);
+		local_irq_restore(state);
+
+		if (addr != 0)
+			return (struct page *)addr;
+	}
+
 	int state = spinlock_acquire_irq(&page_lock);
 
-	void *addr = buddy_alloc(pages, order);
+	addr = buddy_alloc(pages, order);
 
 	spinlock_release_irq(state, &page_lock);
 
+	if (addr == 0 && page_cpu_caches != 0)
+	{
+		// give back what every CPU is holding onto, which may coalesce into a large enough block
+		state = local_irq_save();
+		page_drain_all_cpus();
+
+		spinlock_acquire(&page_lock);
+		addr = buddy_alloc(pages, order);
+		spinlock_release(&page_lock);
+
+		local_irq_restore(state);
+	}
+
 	return (struct page *)addr;
 }
 
+struct page *__attribute__((malloc)) page_zalloc(unsigned int order)
+{
+	void *addr = 0;
+
+	if (order <= PAGE_ZERO_POOL_MAX_ORDER && page_zero_pools != 0)
+	{
+		int state = local_irq_save();
+		page_zero_pool_t *pool = &page_zero_pools[cpu_id()];
+		spinlock_acquire(&pool->lock);
+
+		if (pool->count[order] > 0)
+			addr = pool->blocks[order][--pool->count[order]];
+
+		spinlock_release(&pool->lock);
+		local_irq_restore(state);
+
+		if (addr != 0)
+			return (struct page *)addr;
+	}
+
+	addr = page_alloc(order);
+	if (addr != 0)
+		memset(addr, 0, (size_t)BUDDY_BLOCK_SIZE << order);
+
+	return (struct page *)addr;
+}
+
+struct page *__attribute__((malloc)) page_zalloc_s(size_t size)
+{
+	if (size > BUDDY_ARENA_SIZE)
+	{
+		void *addr = page_alloc_s(size);
+		if (addr != 0)
+			memset(addr, 0, size);
+
+		return (struct page *)addr;
+	}
+
+	return page_zalloc(size_to_order(size));
+}
+
+int page_zero_pool_count(unsigned int order)
+{
+	if (page_zero_pools == 0 || order > PAGE_ZERO_POOL_MAX_ORDER)
+		return 0;
+
+	int state = local_irq_save();
+	int count = page_zero_pools[cpu_id()].count[order];
+	local_irq_restore(state);
+
+	return count;
+}
+
+int page_zero_pool_fill(void)
+{
+	if (page_zero_pools == 0)
+		return 0;
+
+	int state = local_irq_save();
+	page_zero_pool_t *pool = &page_zero_pools[cpu_id()];
+	int order = -1;
+
+	for (int o = 0; o <= PAGE_ZERO_POOL_MAX_ORDER; o++)
+	{
+		if (pool->count[o] < PAGE_ZERO_POOL_HIGH)
+		{
+			order = o;
+			break;
+		}
+	}
+
+	local_irq_restore(state);
+
+	if (order < 0)
+		return 0;
+
+	void *addr = page_alloc(order);
+	if (addr == 0)
+		return 0;
+
+	// zero with IRQs enabled, the block is not visible to the pool until pushed
+	memset(addr, 0, (size_t)BUDDY_BLOCK_SIZE << order);
+
+	state = local_irq_save();
+	pool = &page_zero_pools[cpu_id()];
+	spinlock_acquire(&pool->lock);
+
+	if (pool->count[order] < PAGE_ZERO_POOL_HIGH)
+	{
+		pool->blocks[order][pool->count[order]++] = addr;
+		addr = 0;
+	}
+
+	spinlock_release(&pool->lock);
+	local_irq_restore(state);
+
+	if (addr != 0)
+		page_free(addr);
+
+	return 1;
+}
+
 void page_reloc(uintptr_t offset)
 {
 	pages = (struct buddy_t *)((void *)pages + offset);
+	pages_index.buddies = pages;
+
+	if (page_refs != 0)
+	{
+		page_refs = (page_ref_t *)((void *)page_refs + offset);
+		page_refs_start += offset;
+	}
 
 	struct buddy_t *cb = pages;
 
@@ -153,10 +551,32 @@ void page_free(void *ptr)
 	if (((uintptr_t)ptr & (PAGE_SIZE - 1)) != 0)
 		panicf("unaligned page_free 0x%X", ptr);
 
-	int state = spinlock_acquire_irq(&page_lock);
-
 	// terminal_logf("page_free 0x%X", ptr);
 
+	if (page_cpu_caches != 0)
+	{
+		// the order of a held block is stable, so can be read without the page lock
+		int order = buddy_alloc_order(pages, ptr);
+
+		if (order >= 0 && order <= PAGE_CPU_CACHE_MAX_ORDER)
+		{
+			int state = local_irq_save();
+			page_cpu_cache_t *cache = &page_cpu_caches[cpu_id()];
+			spinlock_acquire(&cache->lock);
+
+			if (cache->count[order] == PAGE_CPU_CACHE_HIGH)
+				page_cpu_cache_drain(cache, order, PAGE_CPU_CACHE_BATCH);
+
+			cache->blocks[order][cache->count[order]++] = ptr;
+
+			spinlock_release(&cache->lock);
+			local_irq_restore(state);
+			return;
+		}
+	}
+
+	int state = spinlock_acquire_irq(&page_lock);
+
 	buddy_free(pages, ptr);
 
 	spinlock_release_irq(state, &page_lock);
@@ -164,12 +584,12 @@ void page_free(void *ptr)
 
 void slub_alloc_init(void)
 {
-	int cpuN = devicetree_count_dev_type("cpu");
+	int cpuN = cpu_count();
 
-	int slub_size = sizeof(slub_t) + (sizeof(slub_cache_entry_t *) * cpuN);
-	slub_size += CACHE_LINE_SIZE - (slub_size % CACHE_LINE_SIZE);
+	int slub_size = slub_struct_size(cpuN);
 
 	char *slubs = (char *)page_alloc_s(slub_size * MAX_SLUB_CLASSES);
+	memset(slubs, 0, slub_size * MAX_SLUB_CLASSES);
 	slub_t *prev = 0;
 
 	for (int i = 0; i < MAX_SLUB_CLASSES; i++)
@@ -178,6 +598,7 @@ void slub_alloc_init(void)
 		slub->object_size = slub_classes[i].object_size;
 
 		slub_init(slub);
+		slub_class_slubs[i] = slub;
 
 		if (prev != 0)
 			prev->next = slub;
@@ -186,24 +607,38 @@ void slub_alloc_init(void)
 
 		prev = slub;
 	}
+
+	int class = 0;
+	for (int i = 0; i < SLUB_CLASS_LOOKUP_SIZE; i++)
+	{
+		size_t size = (size_t)i << SLUB_CLASS_LOOKUP_SHIFT;
+
+		while (class < MAX_SLUB_CLASSES && size > slub_classes[class].object_size)
+			class++;
+
+		// sizes above the largest class are served by the page allocator
+		slub_class_lookup[i] = class;
+	}
 }
 
 void *__attribute__((malloc)) kmalloc(size_t size)
 {
-	slub_t *slub_class = slub_head;
-
-	while (slub_class)
+	if (size <= PAGE_SIZE)
 	{
-		if (size <= (size_t)slub_class->object_size)
-			return slub_alloc(slub_class);
+		uint8_t class = slub_class_lookup[(size + (1 << SLUB_CLASS_LOOKUP_SHIFT) - 1) >> SLUB_CLASS_LOOKUP_SHIFT];
 
-		slub_class = slub_class->next;
+		if (class < MAX_SLUB_CLASSES)
+			return slub_alloc(slub_class_slubs[class]);
 	}
 
-	return 0;
+	// slub objects are never page aligned, so kfree can tell these apart
+	return page_zalloc_s(size);
 }
 
 void kfree(void *obj)
 {
+	if (((uintptr_t)obj & (PAGE_SIZE - 1)) == 0)
+		return page_free(obj);
+
 	return slub_free(obj);
-}
\ No newline at end of file
+}
@@ -13,6 +13,7 @@
 
 static uint32_t queue_id_counter;
 static skiplist_t queues;
+static slub_t *queue_buffer_list_entry_slub;
 
 skiplist_t *queues_get_skl()
 {
@@ -59,6 +60,7 @@ void queues_init()
 {
 	skl_init(&queues, SKIPLIST_DEFAULT_LEVELS, named_queues_comparator, 0);
 	queue_id_counter = 1;
+	queue_buffer_list_entry_slub = DEFINE_DYN_SLUB(sizeof(queue_buffer_list_entry_t));
 }
 
 static void free_mq_buffers(queue_t *queue)
@@ -335,7 +337,7 @@ DEFINE_SYSCALL3(syscall_mq_send, SYSCALL_MQ_SEND, const struct mq_send_params *,
 
 			list_add(&qr->list, &wc->queues);
 
-			waitqueue_entry_t *wqe = kmalloc(sizeof(waitqueue_entry_t));
+			waitqueue_entry_t *wqe = alloc_waitqueue_entry();
 			wqe->thread = thread;
 			wqe->func = wq_can_wake_thread;
 			wqe->data = (void *)buf;
@@ -346,7 +348,7 @@ DEFINE_SYSCALL3(syscall_mq_send, SYSCALL_MQ_SEND, const struct mq_send_params *,
 		}
 		else
 		{
-			queue_buffer_list_entry_t *bufle = kmalloc(sizeof(queue_buffer_list_entry_t));
+			queue_buffer_list_entry_t *bufle = slub_alloc(queue_buffer_list_entry_slub);
 			bufle->buffer = buf;
 
 			list_add_tail(&bufle->list, &queue->buffer);
@@ -409,7 +411,7 @@ DEFINE_SYSCALL4(syscall_mq_recv, SYSCALL_MQ_RECV, const uint32_t, id, void *, da
 
 		// TODO(tcfw) determine block or async
 
-		waitqueue_entry_t *wqe = kmalloc(sizeof(waitqueue_entry_t));
+		waitqueue_entry_t *wqe = alloc_waitqueue_entry();
 		wqe->thread = thread;
 		wqe->func = wq_can_wake_thread;
 		list_add_tail(&wqe->list, &queue->waiters);
@@ -1,5 +1,4 @@
 #include <kernel/arch.h>
-#include <kernel/devicetree.h>
 #include <kernel/clock.h>
 #include <kernel/cls.h>
 #include <kernel/context.h>
@@ -16,14 +15,14 @@
 #include <kernel/wait.h>
 #include <kernel/tty.h>
 
-static LIST_HEAD(pending);
-
-static spinlock_t pending_lock;
-
 static sched_class_t *sched_class_head;
 
 static double prio_ratios[MAX_PRIO];
 
+static void sched_take_pending(cls_t *cls);
+static void sched_program_timer(cls_t *cls, struct clocksource_t *clk, uint64_t clkval);
+static int sched_imbalanced(cls_t *cls);
+
 static int thread_deadline_comparator(void *n1, void *n2)
 {
 
@@ -33,18 +32,21 @@ static int thread_deadline_comparator(void *n1, void *n2)
 	thread_t *tn1 = (thread_t *)n1;
 	thread_t *tn2 = (thread_t *)n2;
 
-	if (tn1->tid == tn2->tid)
+	if (tn1 == tn2)
 		return 0;
 
 	uint64_t tn1e = tn1->sched_entity.deadline;
 	uint64_t tn2e = tn2->sched_entity.deadline;
 
-	if (tn1e == tn2e)
-		return 0;
-	else if (tn1e < tn2e)
-		return 1;
-	else
-		return -1;
+	if (tn1e != tn2e)
+		return tn1e < tn2e ? 1 : -1;
+
+	// equal deadlines are ordered by tid, then by thread as tids are only unique per process,
+	// so deleting a thread always finds that thread
+	if (tn1->tid != tn2->tid)
+		return tn1->tid < tn2->tid ? 1 : -1;
+
+	return (uintptr_t)tn1 < (uintptr_t)tn2 ? 1 : -1;
 }
 
 void sched_local_init(void)
@@ -52,8 +54,8 @@ void sched_local_init(void)
 	cls_t *cls = get_cls();
 	spinlock_init(&cls->rq.lock);
 
-	skl_init(&cls->rq.lrf, SKIPLIST_DEFAULT_LEVELS, thread_deadline_comparator, 0);
-	INIT_WAITQUEUE(&cls->sleepq);
+	skl_init_embedded(&cls->rq.lrf, SKIPLIST_DEFAULT_LEVELS, thread_deadline_comparator, __builtin_offsetof(thread_t, sched_entity.rq_node));
+	INIT_TIMERQUEUE(&cls->sleepq);
 }
 
 void schedule_start(void)
@@ -63,10 +65,7 @@ void schedule_start(void)
 
 	spinlock_acquire(&cls->rq.lock);
 
-	// check for any pending threads and claim it
-	thread_t *t = sched_get_pending(sched_affinity(cls->id));
-	if (t)
-		t->sched_class->enqueue_thread(&cls->rq, t);
+	sched_take_pending(cls);
 
 	sched_class_t *sc = sched_class_head;
 	thread_t *next;
@@ -76,16 +75,12 @@ void schedule_start(void)
 		sc = sc->next;
 		if (next)
 		{
-			// Set next tick
-			uint64_t freq = cs->getFreq(cs);
-			cs->countNTicks(cs, freq / 250);
-			cs->enableIRQ(cs);
-			cs->enable(cs);
+			sched_program_timer(cls, cs, cs->val(cs));
 
 			spinlock_release(&cls->rq.lock);
 			set_current_thread(next);
 			arch_thread_prep_switch(next);
-			vm_set_table(next->process->vm.vm_table, next->process->pid);
+			vm_set_table(next->process->vm.vm_table, &next->process->vm);
 			switch_to_context(&next->ctx);
 			return;
 		}
@@ -94,49 +89,95 @@ void schedule_start(void)
 	panic("schedule_start should always get a task");
 }
 
-thread_t *sched_get_pending(uint64_t affinity)
+// sched_take_pending enqueues every thread pushed to the core's inbox, in the order they were pushed
+// the rq lock must be held
+static void sched_take_pending(cls_t *cls)
 {
-	int state = spinlock_acquire_irq(&pending_lock);
+	thread_t *pushed = __atomic_exchange_n(&cls->rq.inbox, 0, __ATOMIC_ACQUIRE);
+	thread_t *ordered = 0;
 
-	if (list_empty(pending))
+	// the inbox is a stack, newest first
+	while (pushed != 0)
 	{
-		spinlock_release_irq(state, &pending_lock);
-		return 0;
+		thread_t *next = pushed->pending_next;
+		pushed->pending_next = ordered;
+		ordered = pushed;
+		pushed = next;
 	}
 
-	struct thread_list_entry_t *this;
-	struct thread_list_entry_t *tmp;
-	list_head_for_each_safe(this, tmp, &pending)
+	while (ordered != 0)
 	{
-		if ((this->thread->affinity & affinity) != 0)
+		thread_t *thread = ordered;
+		ordered = thread->pending_next;
+
+		thread->pending_next = 0;
+		__atomic_store_n(&thread->pending_queued, 0, __ATOMIC_RELEASE);
+
+		thread->running_core = cls->id;
+		thread->sched_class->enqueue_thread(&cls->rq, thread);
+	}
+}
+
+// sched_place finds the least loaded core the thread may run on, preferring the current core
+static cls_t *sched_place(thread_t *thread)
+{
+	cls_t *local = get_cls();
+	cls_t *best = 0;
+	uint64_t best_load = 0;
+
+	int cc = cpu_count();
+	for (int i = 0; i < cc; i++)
+	{
+		int c = (local->id + i) % cc;
+		if ((thread->affinity & sched_affinity(c)) == 0)
+			continue;
+
+		cls_t *cls = get_core_cls(c);
+		uint64_t load = __atomic_load_n(&cls->rq.load_avg, __ATOMIC_RELAXED);
+		if (best == 0 || load < best_load)
 		{
-			thread_t *thread = this->thread;
-			list_del((struct list_head *)this);
-			kfree(this);
-			spinlock_release_irq(state, &pending_lock);
-			return thread;
+			best = cls;
+			best_load = load;
 		}
 	}
 
-	spinlock_release_irq(state, &pending_lock);
-	return 0;
+	return best != 0 ? best : local;
 }
 
-void sched_append_pending(thread_t *thread)
+void sched_push_pending(int core, thread_t *thread)
 {
-	int state = spinlock_acquire_irq(&pending_lock);
+	cls_t *cls = get_core_cls(core);
+
+	// a thread is in at most one inbox, as pushing it again would overwrite its link
+	uint32_t queued = 0;
+	if (!__atomic_compare_exchange_n(&thread->pending_queued, &queued, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+		return;
+
+	thread_t *head = __atomic_load_n(&cls->rq.inbox, __ATOMIC_RELAXED);
+	do
+	{
+		thread->pending_next = head;
+	} while (!__atomic_compare_exchange_n(&cls->rq.inbox, &head, thread, 1, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
 
-	struct thread_list_entry_t *entry = kmalloc(sizeof(struct thread_list_entry_t));
-	entry->thread = thread;
+	// pairs with the core setting tickless then checking its inbox in sched_program_timer,
+	// either the core sees the thread or this sees the flag
+	if (__atomic_load_n(&cls->rq.tickless, __ATOMIC_SEQ_CST))
+	{
+		__atomic_store_n(&cls->rq.tickless, 0, __ATOMIC_RELAXED);
+		send_soft_irq(core, SOFT_IRQ_RESCHEDULE);
+	}
+}
 
-	list_add_tail(&entry->list, &pending);
+void sched_append_pending(thread_t *thread)
+{
+	cls_t *cls = sched_place(thread);
 
-	spinlock_release_irq(state, &pending_lock);
+	sched_push_pending(cls->id, thread);
 }
 
 uint64_t sched_affinity(uint64_t cpu_id)
 {
-	return 1 << cpu_id;
+	return 1ULL << cpu_id;
 }
 
 static inline int sched_should_tick(sched_rq_t *rq)
@@ -162,7 +203,7 @@ sched_class_t *sched_get_class(enum Sched_Classes class)
 int thread_is_running(thread_t *thread)
 {
 	cls_t *cur;
-	int cc = devicetree_count_dev_type("cpu");
+	int cc = cpu_count();
 	for (int c = 0; c < cc; c++)
 	{
 		cur = get_core_cls(c);
@@ -186,23 +227,211 @@ void thread_stop_core(unsigned int code)
 	schedule();
 }
 
+// sched_update_load folds the number of runnable threads into the load average
+// the rq lock must be held
+static void sched_update_load(sched_rq_t *rq)
+{
+	int64_t load = (int64_t)rq->lrf.size << SCHED_LOAD_SHIFT;
+	int64_t avg = (int64_t)rq->load_avg;
+
+	avg += (load - avg) >> SCHED_LOAD_DECAY_SHIFT;
+
+	__atomic_store_n(&rq->load_avg, (uint64_t)avg, __ATOMIC_RELAXED);
+}
+
+// sched_steal takes the least urgent thread allowed on this core from the busiest core
+// with threads waiting. Only the busiest core's rq lock is taken, so cores can steal from each other
+static thread_t *sched_steal(cls_t *cls, int newidle)
+{
+	uint64_t local = __atomic_load_n(&cls->rq.load_avg, __ATOMIC_RELAXED);
+	uint64_t affinity = sched_affinity(cls->id);
+
+	cls_t *busiest = 0;
+	uint64_t busiest_load = 0;
+
+	int cc = cpu_count();
+	for (int c = 0; c < cc; c++)
+	{
+		if ((uint32_t)c == cls->id)
+			continue;
+
+		cls_t *other = get_core_cls(c);
+		if (__atomic_load_n(&other->rq.lrf.size, __ATOMIC_RELAXED) == 0)
+			continue;
+
+		uint64_t load = __atomic_load_n(&other->rq.load_avg, __ATOMIC_RELAXED);
+		if (busiest == 0 || load > busiest_load)
+		{
+			busiest = other;
+			busiest_load = load;
+		}
+	}
+
+	if (busiest == 0)
+		return 0;
+
+	// a newly idle core takes any waiting thread, otherwise only pull when more than a thread out
+	if (!newidle && busiest_load < local + SCHED_LOAD_SCALE)
+		return 0;
+
+	thread_t *stolen = 0;
+
+	int state = spinlock_acquire_irq(&busiest->rq.lock);
+
+	// least urgent is last, leaving the busiest core its next threads
+	skl_node_t *node = busiest->rq.lrf.head.forward[0];
+	for (; node != 0; node = node->forward[0])
+	{
+		thread_t *thread = (thread_t *)node->rnode;
+		if ((thread->affinity & affinity) != 0 && thread->state == THREAD_RUNNING)
+			stolen = thread;
+	}
+
+	// only taken if it was still queued there
+	if (stolen != 0 && skl_delete(&busiest->rq.lrf, stolen) != 0)
+		stolen = 0;
+
+	spinlock_release_irq(state, &busiest->rq.lock);
+
+	if (stolen != 0)
+		stolen->running_core = cls->id;
+
+	return stolen;
+}
+
+// sched_kick_idle wakes a tickless idle core, which otherwise would not balance,
+// so it can pull one of this core's waiting threads
+static void sched_kick_idle(cls_t *cls)
+{
+	int cc = cpu_count();
+	for (int i = 1; i < cc; i++)
+	{
+		int c = (cls->id + i) % cc;
+		cls_t *other = get_core_cls(c);
+
+		if (__atomic_load_n(&other->rq.tickless, __ATOMIC_RELAXED) == 0 ||
+			__atomic_load_n(&other->rq.current_thread, __ATOMIC_RELAXED) != other->rq.idle)
+			continue;
+
+		__atomic_store_n(&other->rq.tickless, 0, __ATOMIC_RELAXED);
+		send_soft_irq(c, SOFT_IRQ_RESCHEDULE);
+		return;
+	}
+}
+
+// sched_balance pulls a thread from a busier core when this core is about to idle,
+// or periodically when it is busy but less so than another core
+static thread_t *sched_balance(cls_t *cls, uint64_t clkval, uint64_t interval)
+{
+	thread_t *prev = cls->rq.current_thread;
+	int newidle = __atomic_load_n(&cls->rq.lrf.size, __ATOMIC_RELAXED) == 0 &&
+				  __atomic_load_n(&cls->rq.inbox, __ATOMIC_RELAXED) == 0 &&
+				  (prev == cls->rq.idle || prev->state != THREAD_RUNNING);
+
+	if (!newidle && clkval - cls->rq.last_balance < interval)
+		return 0;
+
+	cls->rq.last_balance = clkval;
+
+	if (!newidle && __atomic_load_n(&cls->rq.lrf.size, __ATOMIC_RELAXED) != 0)
+		sched_kick_idle(cls);
+
+	return sched_steal(cls, newidle);
+}
+
+// sched_imbalanced checks if another core has threads waiting and is at least a thread
+// busier than this core, the same condition a periodic sched_steal pulls on
+static int sched_imbalanced(cls_t *cls)
+{
+	uint64_t local = __atomic_load_n(&cls->rq.load_avg, __ATOMIC_RELAXED);
+
+	int cc = cpu_count();
+	for (int c = 0; c < cc; c++)
+	{
+		if ((uint32_t)c == cls->id)
+			continue;
+
+		cls_t *other = get_core_cls(c);
+		if (__atomic_load_n(&other->rq.lrf.size, __ATOMIC_RELAXED) != 0 &&
+			__atomic_load_n(&other->rq.load_avg, __ATOMIC_RELAXED) >= local + SCHED_LOAD_SCALE)
+			return 1;
+	}
+
+	return 0;
+}
+
+// sched_program_timer sets the timer for the next time the core has something to do,
+// the earliest sleeper, or the end of the time slice when threads are waiting.
+// A core with nothing waiting still balances while another core is busier.
+// Without any of these the timer is left off until a pushed thread kicks the core
+// the rq lock must be held
+static void sched_program_timer(cls_t *cls, struct clocksource_t *clk, uint64_t clkval)
+{
+	uint64_t deadline = 0;
+	int sleepers = timerqueue_next(&cls->sleepq, &deadline);
+
+	if (cls->rq.lrf.size != 0)
+	{
+		__atomic_store_n(&cls->rq.tickless, 0, __ATOMIC_RELAXED);
+
+		uint64_t slice_end = clkval + clk->getFreq(clk) / SCHED_SLICE_HZ;
+		if (!sleepers || slice_end < deadline)
+			deadline = slice_end;
+	}
+	else
+	{
+		// nothing ends the current thread's slice, so new threads must kick the core
+		__atomic_store_n(&cls->rq.tickless, 1, __ATOMIC_SEQ_CST);
+
+		// busy cores only kick tickless cores that are idle, so pull from them on a timer
+		int balance = cls->rq.current_thread != cls->rq.idle && sched_imbalanced(cls);
+		if (balance)
+		{
+			uint64_t balance_at = cls->rq.last_balance + clk->getFreq(clk) / SCHED_BALANCE_HZ;
+			if (!sleepers || balance_at < deadline)
+				deadline = balance_at;
+		}
+
+		// a thread pushed before the flag was set did not kick the core
+		if (__atomic_load_n(&cls->rq.inbox, __ATOMIC_SEQ_CST) != 0)
+			deadline = clkval;
+		else if (!sleepers && !balance)
+		{
+			clk->disableIRQ(clk);
+			clk->disable(clk);
+			return;
+		}
+	}
+
+	uint64_t ticks = deadline > clkval ? deadline - clkval : 1;
+	if (ticks > SCHED_MAX_TIMER_TICKS)
+		ticks = SCHED_MAX_TIMER_TICKS;
+
+	clk->countNTicks(clk, ticks);
+	clk->enableIRQ(clk);
+	clk->enable(clk);
+}
+
 void schedule(void)
 {
 	cls_t *cls = get_cls();
 
+	struct clocksource_t *clk = clock_first(CS_GLOBAL);
+	uint64_t clkval = clk->val(clk);
+
+	thread_t *stolen = sched_balance(cls, clkval, clk->getFreq(clk) / SCHED_BALANCE_HZ);
+
 	int state = spinlock_acquire_irq(&cls->rq.lock);
 
-	spinlock_acquire(&cls->sleepq.lock);
-	try_wake_waitqueue(&cls->sleepq);
-	spinlock_release(&cls->sleepq.lock);
+	// threads woken or pushed while scheduling are taken below without a kick
+	__atomic_store_n(&cls->rq.tickless, 0, __ATOMIC_RELAXED);
 
-	struct clocksource_t *clk = clock_first(CS_GLOBAL);
-	uint64_t clkval = clk->val(clk);
+	if (stolen)
+		stolen->sched_class->enqueue_thread(&cls->rq, stolen);
+
+	timerqueue_expire(&cls->sleepq, clkval);
 
-	// check for any pending threads and claim it
-	thread_t *p = sched_get_pending(sched_affinity(cls->id));
-	if (p)
-		p->sched_class->enqueue_thread(&cls->rq, p);
+	sched_take_pending(cls);
 
 	thread_t *prev = cls->rq.current_thread;
 
@@ -217,6 +446,8 @@ void schedule(void)
 	else
 		prev->sched_class->dequeue_thread(&cls->rq, prev);
 
+	sched_update_load(&cls->rq);
+
 	sched_class_t *sc = sched_class_head;
 	if (sched_should_tick(&cls->rq))
 	{
@@ -237,6 +468,8 @@ void schedule(void)
 		sc = sc->next;
 		if (next)
 		{
+			sched_program_timer(cls, clk, clkval);
+
 			spinlock_release_irq(state, &cls->rq.lock);
 			if (next == prev)
 				return;
@@ -295,7 +528,11 @@ static void idle_noop(sched_rq_t *rq, thread_t *thread) {}
 static void wait_kthread()
 {
 	while (1)
-		wait_task();
+	{
+		// use idle time to top up the zeroed page pool before sleeping
+		if (page_zero_pool_fill() == 0)
+			wfi();
+	}
 }
 
 sched_class_t idle;
@@ -329,9 +566,6 @@ sched_class_t idle = {
 
 void sched_init(void)
 {
-	spinlock_init(&pending_lock);
-	INIT_LIST_HEAD(&pending);
-
 	lrf.next = &idle;
 	sched_class_head = &lrf;
 
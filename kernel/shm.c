@@ -0,0 +1,350 @@
+#include "errno.h"
+#include <kernel/list.h>
+#include <kernel/mm.h>
+#include <kernel/paging.h>
+#include <kernel/regions.h>
+#include <kernel/shm.h>
+#include <kernel/skiplist.h>
+#include <kernel/stdint.h>
+#include <kernel/strings.h>
+#include <kernel/syscall.h>
+#include <kernel/thread.h>
+#include <kernel/uaccess.h>
+#include <kernel/umm.h>
+#include <kernel/vm.h>
+
+static uint32_t shm_id_counter;
+static spinlock_t shm_lock;
+
+// all segments by ID
+static skiplist_t shm_segments;
+
+// named segments by name
+static skiplist_t shm_names;
+
+skiplist_t *shm_get_skl()
+{
+	return &shm_segments;
+}
+
+static int shm_id_comparator(void *rnode, void *list_rnode)
+{
+	shm_t *a = (shm_t *)rnode;
+	shm_t *b = (shm_t *)list_rnode;
+
+	if (a->id == b->id)
+		return 0;
+	else if (a->id < b->id)
+		return -1;
+	return 1;
+}
+
+static int shm_name_comparator(void *rnode, void *list_rnode)
+{
+	int cmp = strcmp(((shm_t *)rnode)->name, ((shm_t *)list_rnode)->name);
+
+	if (cmp == 0)
+		return 0;
+	else if (cmp < 0)
+		return -1;
+	return 1;
+}
+
+// shm_find_by_id finds the segment with the ID. shm_lock must be held
+static shm_t *shm_find_by_id(uint32_t id)
+{
+	shm_t ss;
+	ss.id = id;
+
+	shm_t *seg = (shm_t *)skl_search(&shm_segments, &ss, shm_id_comparator);
+	if (seg == 0 || seg->id != id)
+		return 0;
+
+	return seg;
+}
+
+// shm_find_by_name finds the segment with the name. shm_lock must be held
+static shm_t *shm_find_by_name(const char *name)
+{
+	shm_t ss;
+	memcpy(&ss.name, name, MAX_SHM_NAME_SIZE);
+	ss.name[MAX_SHM_NAME_SIZE - 1] = 0;
+
+	shm_t *seg = (shm_t *)skl_search(&shm_names, &ss, shm_name_comparator);
+	if (seg == 0 || strcmp(seg->name, ss.name) != 0)
+		return 0;
+
+	return seg;
+}
+
+// next_shm_id finds an unused segment ID. shm_lock must be held
+static uint32_t next_shm_id()
+{
+	for (int tries = 0; tries < 5; tries++)
+	{
+		uint32_t next = shm_id_counter++;
+		if (next != 0 && shm_find_by_id(next) == 0)
+			return next;
+	}
+
+	return 0;
+}
+
+// shm_get_existing is the result of getting a segment which already exists
+static uint64_t shm_get_existing(shm_t *seg, uint32_t flags, size_t size)
+{
+	if ((flags & SHM_GET_EXCL) != 0)
+		return -ERREXISTS;
+
+	if (seg->size < size)
+		return -ERRSIZE;
+
+	return seg->id;
+}
+
+void shm_init()
+{
+	spinlock_init(&shm_lock);
+	skl_init(&shm_segments, SKIPLIST_DEFAULT_LEVELS, shm_id_comparator, 0);
+	skl_init(&shm_names, SKIPLIST_DEFAULT_LEVELS, shm_name_comparator, 0);
+	shm_id_counter = 1;
+}
+
+DEFINE_SYSCALL1(syscall_shm_get, SYSCALL_SHM_GET, const struct shm_get_params *, params)
+{
+	int ok = access_ok(ACCESS_TYPE_READ, (void *)params, sizeof(struct shm_get_params));
+	if (ok < 0)
+		return ok;
+
+	int named = params->name[0] != 0;
+	size_t size = params->size;
+
+	if (size % PAGE_SIZE != 0)
+		size += PAGE_SIZE - (size % PAGE_SIZE);
+
+	if (size > MAX_SHM_SIZE)
+		return -ERRSIZE;
+
+	if (named)
+	{
+		spinlock_acquire(&shm_lock);
+
+		uint64_t ret = 0;
+		shm_t *seg = shm_find_by_name(params->name);
+		if (seg != 0)
+			ret = shm_get_existing(seg, params->flags, size);
+
+		spinlock_release(&shm_lock);
+
+		if (seg != 0)
+			return ret;
+	}
+
+	if (size == 0)
+		return -ERRSIZE;
+
+	shm_t *seg = kmalloc(sizeof(shm_t));
+	if (seg == 0)
+		return -ERRNOMEM;
+
+	memset(seg, 0, sizeof(*seg));
+
+	seg->page = page_zalloc_s(size);
+	if (seg->page == 0)
+	{
+		kfree(seg);
+		return -ERRNOMEM;
+	}
+
+	seg->size = size;
+	seg->owner = thread->process->pid;
+	if (named)
+	{
+		memcpy(&seg->name, &params->name, MAX_SHM_NAME_SIZE);
+		seg->name[MAX_SHM_NAME_SIZE - 1] = 0;
+	}
+
+	spinlock_acquire(&shm_lock);
+
+	// may have lost a race to create the same name
+	shm_t *existing = named ? shm_find_by_name(seg->name) : 0;
+	if (existing == 0)
+		seg->id = next_shm_id();
+
+	if (existing != 0 || seg->id == 0)
+	{
+		uint64_t ret = existing != 0 ? shm_get_existing(existing, params->flags, size) : (uint64_t)-ERREXHAUSTED;
+
+		spinlock_release(&shm_lock);
+
+		page_free(seg->page);
+		kfree(seg);
+		return ret;
+	}
+
+	skl_insert(&shm_segments, seg);
+	if (named)
+		skl_insert(&shm_names, seg);
+
+	spinlock_release(&shm_lock);
+
+	return seg->id;
+}
+
+DEFINE_SYSCALL3(syscall_shm_ctrl, SYSCALL_SHM_CTRL, uint32_t, id, int, op, uint64_t, arg)
+{
+	// reserved for ops taking an argument
+	(void)arg;
+
+	spinlock_acquire(&shm_lock);
+
+	shm_t *seg = shm_find_by_id(id);
+	if (seg == 0)
+	{
+		spinlock_release(&shm_lock);
+		return -ERRNOENT;
+	}
+
+	switch (op)
+	{
+	case SHM_CTRL_OP_SIZE:
+	{
+		size_t size = seg->size;
+		spinlock_release(&shm_lock);
+		return size;
+	}
+	case SHM_CTRL_OP_REMOVE:
+		if (seg->owner != thread->process->pid)
+		{
+			spinlock_release(&shm_lock);
+			return -ERRACCESS;
+		}
+
+		skl_delete(&shm_segments, seg);
+		if (seg->name[0] != 0)
+			skl_delete(&shm_names, seg);
+
+		spinlock_release(&shm_lock);
+
+		// attached mappings keep the block until they are detached
+		if (page_block_ref_put(seg->page) == 0)
+			page_free(seg->page);
+
+		kfree(seg);
+		return 0;
+	default:
+		spinlock_release(&shm_lock);
+		return -ERRINVAL;
+	}
+}
+
+DEFINE_SYSCALL3(syscall_shm_attach, SYSCALL_SHM_ATTACH, uint32_t, id, uintptr_t, vaddr, uint64_t, flags)
+{
+	if (vaddr % PAGE_SIZE != 0)
+		return -ERRINVAL;
+
+	spinlock_acquire(&shm_lock);
+
+	shm_t *seg = shm_find_by_id(id);
+	if (seg == 0)
+	{
+		spinlock_release(&shm_lock);
+		return -ERRNOENT;
+	}
+
+	// the mapping's reference keeps the block after the segment is removed
+	void *page = seg->page;
+	size_t size = seg->size;
+	page_block_ref_get(page);
+
+	spinlock_release(&shm_lock);
+
+	uint64_t mapflags = MEMORY_TYPE_USER | MEMORY_USER_NON_EXEC | VM_MAP_FLAG_SHARED | VM_MAP_FLAG_SHM;
+	if ((flags & SHM_ATTACH_RDONLY) != 0)
+		mapflags |= MEMORY_PERM_RO | VM_MAP_FLAG_SHM_RDONLY;
+	else
+		mapflags |= MEMORY_PERM_W;
+
+	uint64_t ret;
+	vm_mapping *mapping = kmalloc(sizeof(*mapping));
+	if (mapping == 0)
+	{
+		ret = -ERRNOMEM;
+		goto put_page;
+	}
+
+	memset(mapping, 0, sizeof(*mapping));
+
+	spinlock_acquire(&thread->process->lock);
+
+	uintptr_t mapaddr = vaddr;
+	if (mapaddr == 0)
+		mapaddr = thread->process->vm.brk;
+
+	if (mapaddr % PAGE_SIZE != 0)
+		mapaddr += PAGE_SIZE - (mapaddr % PAGE_SIZE);
+
+	vm_mapping *next = vm_maps_first_from(&thread->process->vm, mapaddr);
+	vm_mapping *prev = vm_maps_find(&thread->process->vm, mapaddr);
+
+	if ((mapaddr + size) > VIRT_OFFSET || mapaddr < thread->process->vm.start_brk ||
+		(prev != 0 && prev->vm_addr + prev->length > mapaddr) ||
+		(next != 0 && next->vm_addr < mapaddr + size))
+	{
+		ret = -ERREXISTS;
+		goto unlock;
+	}
+
+	uintptr_t pa = vm_va_to_pa(vm_get_current_table(), (uintptr_t)page);
+
+	ret = vm_map_region(thread->process->vm.vm_table, pa, mapaddr, size - 1, mapflags);
+	if ((int64_t)ret < 0)
+		goto unlock;
+
+	mapping->flags = mapflags;
+	mapping->length = size;
+	mapping->page = page;
+	mapping->phy_addr = pa;
+	mapping->vm_addr = mapaddr;
+
+	vm_maps_insert(&thread->process->vm, mapping);
+
+	if (vaddr == 0)
+		thread->process->vm.brk = mapaddr + size;
+
+	spinlock_release(&thread->process->lock);
+
+	return mapaddr;
+
+unlock:
+	spinlock_release(&thread->process->lock);
+	kfree(mapping);
+
+put_page:
+	if (page_block_ref_put(page) == 0)
+		page_free(page);
+
+	return ret;
+}
+
+DEFINE_SYSCALL1(syscall_shm_detach, SYSCALL_SHM_DETACH, uintptr_t, addr)
+{
+	spinlock_acquire(&thread->process->lock);
+
+	vm_mapping *mapping = vm_maps_find(&thread->process->vm, addr);
+	if (mapping == 0 || mapping->vm_addr != addr || (mapping->flags & VM_MAP_FLAG_SHM) == 0)
+	{
+		spinlock_release(&thread->process->lock);
+		return -ERRINVAL;
+	}
+
+	// frees the block if the segment has already been removed
+	vm_release_mapping(&thread->process->vm, mapping, 1);
+	vm_maps_remove(&thread->process->vm, mapping);
+
+	spinlock_release(&thread->process->lock);
+
+	kfree(mapping);
+
+	return 0;
+}
@@ -20,9 +20,51 @@ void skl_init(skiplist_t *skl, int max_levels, skiplist_compare insert_comparato
 	skl->levels = max_levels;
 	skl->compare = insert_comparator;
 	skl->flags = flags;
+	skl->node_offset = 0;
 	skl->head.forward = kmalloc(sizeof(skl_node_t *) * skl->levels);
 }
 
+void skl_init_embedded(skiplist_t *skl, int max_levels, skiplist_compare insert_comparator, size_t node_offset)
+{
+	// embedded nodes have a fixed number of forward pointers
+	if (max_levels > SKIPLIST_DEFAULT_LEVELS)
+		max_levels = SKIPLIST_DEFAULT_LEVELS;
+
+	skl_init(skl, max_levels, insert_comparator, SKIPLIST_FLAG_EMBEDDED);
+	skl->node_offset = node_offset;
+}
+
+// skl_alloc_node gets a node for the real node, returning 0 if its embedded node is already in use
+static skl_node_t *skl_alloc_node(skiplist_t *skl, void *rnode)
+{
+	if ((skl->flags & SKIPLIST_FLAG_EMBEDDED) != 0)
+	{
+		skl_embedded_node_t *en = (skl_embedded_node_t *)((uintptr_t)rnode + skl->node_offset);
+		if (en->node.rnode != 0)
+			return 0;
+
+		en->node.forward = en->forward;
+		return &en->node;
+	}
+
+	skl_node_t *x = kmalloc(sizeof(skl_node_t));
+	x->forward = kmalloc(sizeof(skl_node_t *) * skl->levels);
+	return x;
+}
+
+// skl_free_node releases a node removed from the skip list
+static void skl_free_node(skiplist_t *skl, skl_node_t *x)
+{
+	if ((skl->flags & SKIPLIST_FLAG_EMBEDDED) != 0)
+	{
+		x->rnode = 0;
+		return;
+	}
+
+	kfree(x->forward);
+	kfree(x);
+}
+
 int skl_insert(skiplist_t *skl, void *rnode)
 {
 	skl_node_t *update[skl->levels];
@@ -49,11 +91,13 @@ int skl_insert(skiplist_t *skl, void *rnode)
 	if (x != 0 && x->rnode == rnode)
 		return -1;
 
+	x = skl_alloc_node(skl, rnode);
+	if (x == 0)
+		return -1;
+
 	level = rand_level(skl->levels);
 
-	x = kmalloc(sizeof(skl_node_t));
 	x->rnode = rnode;
-	x->forward = kmalloc(sizeof(skl_node_t *) * skl->levels);
 	for (i = 0; i < level; i++)
 	{
 		x->forward[i] = update[i]->forward[i];
@@ -89,15 +133,14 @@ int skl_delete(skiplist_t *skl, void *rnode)
 	x = x->forward[0];
 	if (x != NULL && rnode == x->rnode)
 	{
-		for (i = 0; i <= skl->levels; i++)
+		for (i = 0; i < skl->levels; i++)
 		{
 			if (update[i]->forward[i] != x)
 				break;
 			update[i]->forward[i] = x->forward[i];
 		}
 
-		kfree(x->forward);
-		kfree(x);
+		skl_free_node(skl, x);
 
 		skl->size--;
 		return 0;
@@ -112,15 +155,8 @@ void *skl_search(skiplist_t *skl, void *rnode, skiplist_compare search_comparato
 
 	for (int i = skl->levels - 1; i >= 0; i--)
 	{
-		if (x->forward[i] == 0)
-			continue;
-
-		while (search_comparator(rnode, x->forward[i]->rnode) == 1)
-		{
+		while (x->forward[i] != 0 && search_comparator(rnode, x->forward[i]->rnode) == 1)
 			x = x->forward[i];
-			if (!x)
-				break;
-		}
 	}
 
 	if (x->forward[0] != NULL)
@@ -143,17 +179,15 @@ void *skl_pull_first(skiplist_t *skl)
 	skl_node_t *x = skl->head.forward[0];
 	if (x)
 	{
-		skl_node_t *next = x->forward[0];
-
+		// the first node is first in every level it is in
 		for (int i = skl->levels - 1; i >= 0; i--)
 		{
 			if (skl->head.forward[i] == x)
-				skl->head.forward[i] = next;
+				skl->head.forward[i] = x->forward[i];
 		}
 
 		void *v = x->rnode;
-		kfree(x->forward);
-		kfree(x);
+		skl_free_node(skl, x);
 
 		skl->size--;
 
@@ -161,4 +195,13 @@ void *skl_pull_first(skiplist_t *skl)
 	}
 
 	return 0;
-}
\ No newline at end of file
+}
+
+void skl_destroy(skiplist_t *skl)
+{
+	while (skl_pull_first(skl) != 0)
+		;
+
+	kfree(skl->head.forward);
+	skl->head.forward = 0;
+}
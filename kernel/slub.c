@@ -1,26 +1,43 @@
 #include <kernel/arch.h>
-#include <kernel/devicetree.h>
+#include <kernel/cls.h>
 #include <kernel/list.h>
 #include <kernel/mm.h>
 #include <kernel/paging.h>
 #include <kernel/panic.h>
 #include <kernel/slub.h>
 #include <kernel/strings.h>
+#include <kernel/sync.h>
 #include <kernel/tty.h>
 
+// slub_header_size is the size of the slub struct, cache line aligned for the trailing per-CPU caches
+static size_t slub_header_size(void)
+{
+	size_t size = sizeof(slub_t);
+	if (size % CACHE_LINE_SIZE != 0)
+		size += CACHE_LINE_SIZE - (size % CACHE_LINE_SIZE);
+
+	return size;
+}
+
+size_t slub_struct_size(unsigned int ncpu)
+{
+	return slub_header_size() + (sizeof(slub_cpu_t) * ncpu);
+}
+
 void slub_init(slub_t *slub)
 {
-	slub->object_count = 0;
 	slub->cache_alloc_order = (1 << (slub->object_size / PAGE_SIZE)) >> 1;
 
+	spinlock_init(&slub->lock);
 	INIT_LIST_HEAD(&slub->partial);
-	slub->per_cpu_partial = (slub_cache_entry_t **)((char *)slub + sizeof(slub_t));
+	slub->per_cpu = (slub_cpu_t *)((char *)slub + slub_header_size());
 }
 
 static void slub_init_cache_entry(slub_t *slub, slub_cache_entry_t *cache_entry)
 {
 	memset(cache_entry, 0, PAGE_SIZE);
 	cache_entry->slub = slub;
+	cache_entry->owner = SLUB_CACHE_NO_OWNER;
 
 	int reserved_area = sizeof(slub_cache_entry_t);
 	cache_entry->first = (void *)(reserved_area + (void *)cache_entry);
@@ -47,30 +64,34 @@ static void slub_init_cache_entry(slub_t *slub, slub_cache_entry_t *cache_entry)
 		prev->poison = POISON_VALUE;
 }
 
-static void *slub_alloc_from_cache_entry(slub_t *slub, slub_cache_entry_t *entry)
+// slub_cache_entry_pop takes the first free object from the cache entry freelist
+static void *slub_cache_entry_pop(slub_cache_entry_t *entry)
 {
-	if (entry->first == 0)
+	slub_entry_t *addr = (slub_entry_t *)entry->first;
+	if (addr == 0)
 		return 0;
 
-	int state = spinlock_acquire_irq(&entry->lock);
-
-	slub_entry_t *addr = (slub_entry_t *)entry->first;
 	entry->first = addr->next_offset;
 	entry->used++;
 
-	spinlock_release_irq(state, &entry->lock);
-
 	return addr;
 }
 
-static slub_cache_entry_t *slub_get_per_cpu_cache(slub_t *slub)
+// slub_cache_entry_push returns an object to the cache entry freelist
+static void slub_cache_entry_push(slub_cache_entry_t *entry, slub_entry_t *obj)
 {
-	return slub->per_cpu_partial[cpu_id()];
+	obj->next_offset = entry->first;
+	entry->first = obj;
+	entry->used--;
 }
 
-static void slub_set_per_cpu_cache(slub_t *slub, slub_cache_entry_t *cache)
+// slub_cache_entry_push_remote defers a free from a CPU which does not own the cache entry
+// the cache entry lock must be held
+static void slub_cache_entry_push_remote(slub_cache_entry_t *entry, slub_entry_t *obj)
 {
-	slub->per_cpu_partial[cpu_id()] = cache;
+	obj->next_offset = entry->remote_free;
+	entry->remote_free = obj;
+	entry->remote_count++;
 }
 
 static slub_cache_entry_t *slub_new_cache_entry(slub_t *slub)
@@ -81,41 +102,83 @@ static slub_cache_entry_t *slub_new_cache_entry(slub_t *slub)
 	return &cache->slub;
 }
 
-static int slub_cache_entry_is_empty(slub_t *slub, slub_cache_entry_t *entry)
+// slub_cpu_refill_or_release is called by the owning CPU once the local freelist is empty.
+// Any remote frees are spliced back into the local freelist, otherwise the now full
+// cache entry is released from the CPU
+static void slub_cpu_refill_or_release(slub_cpu_t *cpu, slub_cache_entry_t *cache)
 {
-	return entry->used == 0;
+	spinlock_acquire(&cache->lock);
+
+	if (cache->remote_free != 0)
+	{
+		cache->first = cache->remote_free;
+		cache->used -= cache->remote_count;
+		cache->remote_free = 0;
+		cache->remote_count = 0;
+	}
+	else
+	{
+		// full cache entries are not tracked until an object is freed
+		cache->owner = SLUB_CACHE_NO_OWNER;
+		cpu->cache = 0;
+	}
+
+	spinlock_release(&cache->lock);
 }
 
-void *slub_alloc(slub_t *slub)
+// slub_cpu_acquire_cache claims a partial cache entry for the CPU, or allocates a new one
+static slub_cache_entry_t *slub_cpu_acquire_cache(slub_t *slub, slub_cpu_t *cpu)
 {
-	void *addr;
-	slub_cache_entry_t *cpu_cache = slub_get_per_cpu_cache(slub);
+	slub_cache_entry_t *cache = 0;
 
-	if (cpu_cache != 0)
+	spinlock_acquire(&slub->lock);
+
+	if (!list_is_empty(&slub->partial))
 	{
-		// alloc from cpu cache
-		addr = slub_alloc_from_cache_entry(slub, cpu_cache);
+		cache = (slub_cache_entry_t *)slub->partial.next;
+		cpu->partial_hits++;
+
+		spinlock_acquire(&cache->lock);
+		list_del(&cache->list);
+		cache->flags &= ~SLUB_CACHE_FLAG_PARTIAL;
+		cache->owner = cpu_id();
+		spinlock_release(&cache->lock);
 	}
-	else if (!list_is_empty(&slub->partial))
-	{
-		// alloc from partial cache
-		int sstate = spinlock_acquire_irq(&slub->lock);
 
-		slub_cache_entry_t *cache = (slub_cache_entry_t *)slub->partial.next;
-		addr = slub_alloc_from_cache_entry(slub, cache);
-		if (cache->first == 0)
-			list_del(cache);
+	spinlock_release(&slub->lock);
 
-		spinlock_release_irq(sstate, &slub->lock);
-	}
-	else
+	if (cache == 0)
 	{
-		// alloc new cache
-		cpu_cache = slub_new_cache_entry(slub);
-		slub_set_per_cpu_cache(slub, cpu_cache);
-		addr = slub_alloc_from_cache_entry(slub, cpu_cache);
+		cache = slub_new_cache_entry(slub);
+		cache->owner = cpu_id();
+		__atomic_add_fetch(&slub->pages, 1 << slub->cache_alloc_order, __ATOMIC_RELAXED);
 	}
 
+	cpu->cache = cache;
+	cpu->refills++;
+
+	return cache;
+}
+
+void *slub_alloc(slub_t *slub)
+{
+	int state = local_irq_save();
+
+	slub_cpu_t *cpu = &slub->per_cpu[cpu_id()];
+	slub_cache_entry_t *cache = cpu->cache;
+
+	if (cache == 0)
+		cache = slub_cpu_acquire_cache(slub, cpu);
+
+	// owned cache entries always have at least one free object
+	void *addr = slub_cache_entry_pop(cache);
+	if (cache->first == 0)
+		slub_cpu_refill_or_release(cpu, cache);
+
+	cpu->allocs++;
+
+	local_irq_restore(state);
+
 	// check if posioned
 	if (slub->object_size >= sizeof(slub_entry_t))
 		if (((slub_entry_t *)addr)->poison != POISON_VALUE)
@@ -123,87 +186,144 @@ void *slub_alloc(slub_t *slub)
 
 	memset(addr, 0, slub->object_size);
 
-	int state = spinlock_acquire_irq(&slub->lock);
-	slub->object_count++;
-	spinlock_release_irq(state, &slub->lock);
-
-	// if cache entry full
-	if (cpu_cache != 0 && cpu_cache->first == 0)
-		slub_set_per_cpu_cache(slub, 0);
-
 	if (slub->ctor != 0)
 		slub->ctor(addr);
 
-	// terminal_logf("alloc'd 0x%X (size 0x%X, slub_cache 0x%X)", addr, slub->object_size, cpu_cache);
+	// terminal_logf("alloc'd 0x%X (size 0x%X, slub_cache 0x%X)", addr, slub->object_size, cache);
 
 	return addr;
 }
 
-static int slub_is_per_cpu_cache(slub_t *slub, slub_cache_entry_t *entry)
+// slub_free_slow frees an object into a cache entry which may need to move on or off the partial list
+static void slub_free_slow(slub_t *slub, slub_cache_entry_t *cache, slub_entry_t *entry)
 {
-	int cpuN = devicetree_count_dev_type("cpu");
+	int release = 0;
 
-	for (int i = 0; i < cpuN; i++)
+	spinlock_acquire(&slub->lock);
+	spinlock_acquire(&cache->lock);
+
+	if (cache->owner != SLUB_CACHE_NO_OWNER)
 	{
-		if (slub->per_cpu_partial[i] == entry)
-			return 1;
+		// claimed by another CPU since we last looked
+		slub_cache_entry_push_remote(cache, entry);
 	}
+	else
+	{
+		slub_cache_entry_push(cache, entry);
+
+		if (cache->used == 0)
+		{
+			if ((cache->flags & SLUB_CACHE_FLAG_PARTIAL) != 0)
+				list_del(&cache->list);
+
+			release = 1;
+		}
+		else if ((cache->flags & SLUB_CACHE_FLAG_PARTIAL) == 0)
+		{
+			// cache was full
+			list_add(&cache->list, &slub->partial);
+			cache->flags |= SLUB_CACHE_FLAG_PARTIAL;
+		}
+	}
+
+	spinlock_release(&cache->lock);
+	spinlock_release(&slub->lock);
 
-	return 0;
+	if (release)
+	{
+		__atomic_sub_fetch(&slub->pages, 1 << slub->cache_alloc_order, __ATOMIC_RELAXED);
+		page_free((void *)cache);
+	}
 }
 
 void slub_free(void *obj)
 {
-	int lstate_c, lstate_n;
-
 	slub_cache_entry_t *cache = (slub_cache_entry_t *)((void *)obj - ((uintptr_t)obj % PAGE_SIZE));
 	slub_t *slub = cache->slub;
 	slub_entry_t *entry = (slub_entry_t *)obj;
 
-	lstate_c = spinlock_acquire_irq(&cache->lock);
+	int state = local_irq_save();
+	int32_t id = cpu_id();
 
-	if (cache->first == 0)
-	{
-		// cache was full
-		// so shouldn't be a per-cpu cache anymore
-		lstate_n = spinlock_acquire_irq(&slub->lock);
-		list_add(&cache->list, &slub->partial);
-		spinlock_release_irq(lstate_n, &slub->lock);
-	}
-
-	entry->next_offset = cache->first;
-	cache->first = entry;
+	slub->per_cpu[id].frees++;
 
 	if (slub->object_size >= sizeof(slub_entry_t))
 		entry->poison = POISON_VALUE;
 
-	cache->used--;
+	// only the owning CPU can change the owner of an owned cache entry
+	if (__atomic_load_n(&cache->owner, __ATOMIC_RELAXED) == id)
+	{
+		slub_cache_entry_push(cache, entry);
+		goto out;
+	}
 
-	spinlock_release_irq(lstate_c, &cache->lock);
+	spinlock_acquire(&cache->lock);
 
-	lstate_n = spinlock_acquire_irq(&slub->lock);
+	if (cache->owner != SLUB_CACHE_NO_OWNER)
+	{
+		slub_cache_entry_push_remote(cache, entry);
+		spinlock_release(&cache->lock);
+		goto out;
+	}
 
-	if ((slub_cache_entry_is_empty(slub, cache) == 0) && (slub_is_per_cpu_cache(slub, cache) == 0))
+	if (cache->first != 0 && cache->used > 1)
 	{
-		list_del((struct list_head *)cache);
-		page_free((void *)cache);
+		// stays on the partial list
+		slub_cache_entry_push(cache, entry);
+		spinlock_release(&cache->lock);
+		goto out;
 	}
 
-	slub->object_count--;
+	spinlock_release(&cache->lock);
+
+	// the object still holds the cache entry page until it is pushed back
+	slub_free_slow(slub, cache, entry);
+
+out:
+	local_irq_restore(state);
 
 	// terminal_logf("free'd 0x%X (size 0x%X)", obj, slub->object_size);
+}
+
+int64_t slub_object_count(slub_t *slub)
+{
+	int cpuN = cpu_count();
+	int64_t count = 0;
+
+	for (int i = 0; i < cpuN; i++)
+		count += slub->per_cpu[i].allocs - slub->per_cpu[i].frees;
+
+	return count;
+}
+
+void slub_stats(slub_t *slub, slub_stats_t *stats)
+{
+	int cpuN = cpu_count();
+
+	memset(stats, 0, sizeof(*stats));
+
+	for (int i = 0; i < cpuN; i++)
+	{
+		slub_cpu_t *cpu = &slub->per_cpu[i];
 
-	spinlock_release_irq(lstate_n, &slub->lock);
+		stats->allocs += __atomic_load_n(&cpu->allocs, __ATOMIC_RELAXED);
+		stats->frees += __atomic_load_n(&cpu->frees, __ATOMIC_RELAXED);
+		stats->refills += __atomic_load_n(&cpu->refills, __ATOMIC_RELAXED);
+		stats->partial_hits += __atomic_load_n(&cpu->partial_hits, __ATOMIC_RELAXED);
+	}
+
+	stats->pages = __atomic_load_n(&slub->pages, __ATOMIC_RELAXED);
 }
 
 slub_t *DEFINE_DYN_SLUB(unsigned int objsize)
 {
-	slub_t *slub = (slub_t *)page_alloc_s(sizeof(slub_t));
-	memset(slub, 0, PAGE_SIZE);
+	size_t size = slub_struct_size(cpu_count());
+
+	slub_t *slub = (slub_t *)page_alloc_s(size);
+	memset(slub, 0, size);
 
 	slub->object_size = objsize;
-	slub->cache_alloc_order = (1 << (objsize / PAGE_SIZE)) >> 1;
 	slub_init(slub);
 
 	return slub;
-}
\ No newline at end of file
+}
@@ -17,29 +17,31 @@ DEFINE_SYSCALL2(syscall_mem_unmap, SYSCALL_MEM_UMAP, uintptr_t, addr, size_t, le
 {
 	// terminal_logf("MUNM: addr=0x%X length=0x%X", addr, length);
 
-	int unmapAddr = addr;
+	uintptr_t unmapAddr = addr;
 	if (unmapAddr < thread->process->vm.start_brk)
 		unmapAddr = thread->process->vm.start_brk;
 
 	spinlock_acquire(&thread->process->lock);
 
-	vm_mapping *this, *next;
-	list_head_for_each_safe(this, next, &thread->process->vm.vm_maps)
+	vm_mapping *this = vm_maps_first_from(&thread->process->vm, unmapAddr);
+	vm_mapping *next;
+
+	// mappings are in address order, so stop at the first one past the range
+	for (; this != 0 && this->vm_addr <= (unmapAddr + length); this = next)
 	{
-		if (this->vm_addr < unmapAddr || this->vm_addr > (unmapAddr + length))
-			continue;
+		next = this->list.next != &thread->process->vm.vm_maps ? (vm_mapping *)this->list.next : 0;
 
 		// terminal_logf("unmapping addr 0x%X", this->vm_addr);
 
-		// TODO(tcfw) free shared pages when references go to zero
-		if (this->page != 0 && this->phy_addr == 0 && (this->flags & VM_MAP_FLAG_SHARED) == 0)
+		// shared memory blocks are freed with the last mapping or segment reference
+		if ((this->flags & (VM_MAP_FLAG_COW | VM_MAP_FLAG_SHM)) != 0 ||
+			(this->page != 0 && this->phy_addr == 0 && (this->flags & VM_MAP_FLAG_SHARED) == 0))
 		{
 			// terminal_log("and freed pages");
-			vm_unmap_region(thread->process->vm.vm_table, this->vm_addr, this->length - 1);
-			page_free(this->page);
+			vm_release_mapping(&thread->process->vm, this, 1);
 		}
 
-		list_del(&this->list);
+		vm_maps_remove(&thread->process->vm, this);
 		kfree(this);
 	}
 
@@ -119,7 +121,7 @@ DEFINE_SYSCALL4(syscall_mem_map, SYSCALL_MEM_MAP, uintptr_t, paddr, uintptr_t, v
 
 		spinlock_acquire(&thread->process->lock);
 
-		list_add_tail(&mapping->list, &thread->process->vm.vm_maps);
+		vm_maps_insert(&thread->process->vm, mapping);
 		thread->process->vm.brk = mapaddr + maplength;
 
 		spinlock_release(&thread->process->lock);
@@ -155,7 +157,7 @@ DEFINE_SYSCALL4(syscall_mem_map, SYSCALL_MEM_MAP, uintptr_t, paddr, uintptr_t, v
 
 	spinlock_acquire(&thread->process->lock);
 
-	list_add_tail(&mapping->list, &thread->process->vm.vm_maps);
+	vm_maps_insert(&thread->process->vm, mapping);
 	thread->process->vm.brk = mapaddr + maplength;
 
 	spinlock_release(&thread->process->lock);
@@ -163,4 +165,145 @@ DEFINE_SYSCALL4(syscall_mem_map, SYSCALL_MEM_MAP, uintptr_t, paddr, uintptr_t, v
 	// terminal_logf("mapped addr 0x%X, len 0x%X, mapflags 0x%X", mapaddr, maplength, mapflags);
 
 	return actualise_lazy_reservation(thread, mapping, mapflags);
-}
\ No newline at end of file
+}
+
+// mem_protect_flags converts MMAP_* protection flags into mapping permissions
+// Neither read nor write leaves the memory inaccessible to user space
+static uint64_t mem_protect_flags(int flags)
+{
+	uint64_t perms = 0;
+
+	if ((flags & MMAP_WRITE) != 0)
+		perms |= MEMORY_PERM_W;
+	else if ((flags & MMAP_READ) != 0)
+		perms |= MEMORY_PERM_RO;
+
+	if ((flags & MMAP_EXEC) == 0)
+		perms |= MEMORY_USER_NON_EXEC;
+
+	return perms;
+}
+
+// mem_protect_sync_icache cleans the backed pages of the range to the point of unification
+// and invalidates the instruction caches. Pages not yet faulted in hold no code
+static void mem_protect_sync_icache(vm_table *table, uintptr_t addr, uintptr_t end)
+{
+	for (uintptr_t va = addr; va < end; va += PAGE_SIZE)
+	{
+		uintptr_t pa = vm_va_to_pa(table, va);
+		if (pa != 0)
+			vm_clean_dcache_pou((void *)vm_pa_to_kva(pa), PAGE_SIZE);
+	}
+
+	vm_invalidate_icache();
+}
+
+DEFINE_SYSCALL3(syscall_mem_protect, SYSCALL_MEM_PROTECT, uintptr_t, addr, size_t, length, int, flags)
+{
+	uint64_t perm_mask = MEMORY_PERM_RO | MEMORY_PERM_W | MEMORY_NON_EXEC | MEMORY_USER_NON_EXEC;
+	uint64_t perms = mem_protect_flags(flags);
+
+	if (addr % PAGE_SIZE != 0)
+		return -ERRINVAL;
+
+	if (length % PAGE_SIZE != 0)
+		length += PAGE_SIZE - (length % PAGE_SIZE);
+
+	uintptr_t end = addr + length;
+	if (length == 0 || end > VIRT_OFFSET || end < addr)
+		return -ERRINVAL;
+
+	vm_t *vm = &thread->process->vm;
+	int ret = 0;
+
+	spinlock_acquire(&thread->process->lock);
+
+	// the whole range must be mapped before anything is changed
+	vm_mapping *first = vm_maps_find(vm, addr);
+	uintptr_t covered = addr;
+
+	for (vm_mapping *this = first; this != 0 && covered < end;)
+	{
+		if (this->vm_addr > covered || this->vm_addr + this->length <= covered)
+			break;
+
+		// writing would modify the loaded image directly
+		if ((perms & MEMORY_PERM_W) != 0 && (this->flags & VM_MAP_FLAG_PHY_KERNEL) != 0 && this->page == 0)
+		{
+			ret = -ERRACCESS;
+			goto out;
+		}
+
+		// segments attached read only stay read only
+		if ((perms & MEMORY_PERM_W) != 0 && (this->flags & VM_MAP_FLAG_SHM_RDONLY) != 0)
+		{
+			ret = -ERRACCESS;
+			goto out;
+		}
+
+		covered = (this->vm_addr + this->length + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+		this = this->list.next != &vm->vm_maps ? (vm_mapping *)this->list.next : 0;
+	}
+
+	if (covered < end)
+	{
+		ret = -ERRNOENT;
+		goto out;
+	}
+
+	// both edges are split before any flags change, so a failed split leaves the range as it was
+	if (first->vm_addr < addr)
+	{
+		first = vm_split_mapping(vm, first, addr - first->vm_addr);
+		if (first == 0)
+		{
+			ret = -ERRNOMEM;
+			goto out;
+		}
+	}
+
+	vm_mapping *last = vm_maps_find(vm, end - 1);
+	if (last->vm_addr + last->length > end && vm_split_mapping(vm, last, end - last->vm_addr) == 0)
+	{
+		ret = -ERRNOMEM;
+		goto out;
+	}
+
+	for (vm_mapping *this = first; this != 0 && this->vm_addr < end;)
+	{
+		this->flags = (this->flags & ~perm_mask) | perms;
+
+		this = this->list.next != &vm->vm_maps ? (vm_mapping *)this->list.next : 0;
+	}
+
+	// entries are rewritten in place with one invalidation for the range
+	for (vm_mapping *this = first; this != 0 && this->vm_addr < end;)
+	{
+		// copy on write pages stay read only until they are written to
+		uint64_t entry_flags = this->flags;
+		if ((entry_flags & VM_MAP_FLAG_COW) != 0 && (entry_flags & MEMORY_PERM_W) != 0)
+			entry_flags = (entry_flags & ~MEMORY_PERM_W) | MEMORY_PERM_RO;
+
+		uintptr_t start = this->vm_addr & ~(PAGE_SIZE - 1);
+		uintptr_t stop = (this->vm_addr + this->length + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+		if (start < addr)
+			start = addr;
+		if (stop > end)
+			stop = end;
+
+		vm_update_region(vm->vm_table, vm, start, stop - start - 1, entry_flags);
+
+		this = this->list.next != &vm->vm_maps ? (vm_mapping *)this->list.next : 0;
+	}
+
+	vm_invalidate_region(vm->vm_table, vm, addr, length - 1);
+
+	// code may have been written through the data side before becoming executable
+	if ((perms & MEMORY_USER_NON_EXEC) == 0)
+		mem_protect_sync_icache(vm->vm_table, addr, end);
+
+out:
+	spinlock_release(&thread->process->lock);
+
+	return ret;
+}
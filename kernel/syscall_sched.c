@@ -4,11 +4,13 @@
 #include <kernel/list.h>
 #include <kernel/mm.h>
 #include <kernel/sched.h>
+#include <kernel/strings.h>
 #include <kernel/sync.h>
 #include <kernel/syscall.h>
 #include <kernel/thread.h>
 #include <kernel/tty.h>
 #include <kernel/uaccess.h>
+#include <kernel/umm.h>
 
 DEFINE_SYSCALL0(syscall_sched_yield, SYSCALL_SCHED_YIELD)
 {
@@ -98,7 +100,7 @@ DEFINE_SYSCALL3(syscall_thread_start, SYSCALL_THREAD_START, void *, func, void *
 	if (access < 0)
 		return access;
 
-	thread_t *newthread = (thread_t *)page_alloc_s(sizeof(thread_t));
+	thread_t *newthread = alloc_thread();
 	if (!newthread)
 	{
 		return -ERRNOMEM;
@@ -110,7 +112,7 @@ DEFINE_SYSCALL3(syscall_thread_start, SYSCALL_THREAD_START, void *, func, void *
 	newthread->ctx.sp = (uintptr_t)stack;
 	newthread->ctx.regs[0] = (uint64_t)arg;
 
-	thread_list_entry_t *tle = kmalloc(sizeof(thread_list_entry_t));
+	thread_list_entry_t *tle = alloc_thread_list_entry();
 	if (!tle)
 	{
 		free_thread(newthread);
@@ -128,6 +130,83 @@ DEFINE_SYSCALL3(syscall_thread_start, SYSCALL_THREAD_START, void *, func, void *
 	return newthread->tid;
 }
 
+DEFINE_SYSCALL0(syscall_clone, SYSCALL_CLONE)
+{
+	process_t *parent = thread->process;
+
+	process_t *proc = (process_t *)page_alloc_s(sizeof(process_t));
+	if (!proc)
+		return -ERRNOMEM;
+	memset(proc, 0, sizeof(*proc));
+
+	init_proc(proc, parent->cmd);
+
+	proc->pid = alloc_pid();
+	proc->parent = parent;
+	proc->uid = parent->uid;
+	proc->euid = parent->euid;
+	proc->gid = parent->gid;
+	proc->egid = parent->egid;
+
+	// writable pages are shared copy-on-write, so cloning does not copy any memory
+	spinlock_acquire(&parent->lock);
+	int ret = vm_clone(&parent->vm, &proc->vm);
+	spinlock_release(&parent->lock);
+
+	if (ret < 0)
+		goto free_proc_ret;
+
+	thread_t *newthread = alloc_thread();
+	if (!newthread)
+	{
+		ret = -ERRNOMEM;
+		goto free_proc_ret;
+	}
+
+	newthread->process = proc;
+	init_thread(newthread);
+	memcpy(&newthread->ctx, &thread->ctx, sizeof(newthread->ctx));
+	memcpy(&newthread->sigactions, &thread->sigactions, sizeof(newthread->sigactions));
+	newthread->affinity = thread->affinity;
+
+	// the child sees clone return 0, with the carry flag clear as for any successful syscall
+	newthread->ctx.regs[0] = 0;
+	newthread->ctx.spsr &= ~(1 << 29);
+
+	thread_list_entry_t *tle = alloc_thread_list_entry();
+	if (!tle)
+	{
+		free_thread(newthread);
+		ret = -ERRNOMEM;
+		goto free_proc_ret;
+	}
+
+	tle->thread = newthread;
+	list_add_tail(&tle->list, &proc->threads);
+
+	process_list_entry_t *child = kmalloc(sizeof(process_list_entry_t));
+	if (child)
+	{
+		child->process = proc;
+		spinlock_acquire(&parent->lock);
+		list_add_tail(&child->list, &parent->children);
+		spinlock_release(&parent->lock);
+	}
+
+	newthread->state = THREAD_RUNNING;
+	proc->state = RUNNING;
+	sched_append_pending(newthread);
+
+	terminal_logf("cloned PID=0x%x into PID=0x%x", parent->pid, proc->pid);
+
+	return proc->pid;
+
+free_proc_ret:
+	free_process(proc);
+
+	return ret;
+}
+
 DEFINE_SYSCALL3(syscall_kill, SYSCALL_KILL, pid_t, pid, tid_t, tid, uint64_t, sig)
 {
 	terminal_logf("received kill call 0x%X:0x%X ~> 0x%X", pid, tid, sig);
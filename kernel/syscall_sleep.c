@@ -34,7 +34,7 @@ DEFINE_SYSCALL2(syscall_nanosleep, SYSCALL_NANOSLEEP, const timespec_t *, uts, t
 
 	// terminal_logf("TID 0x%X:0x%X sleeping for 0x%Xs 0x%Xns", thread->process->pid, thread->tid, ts.seconds, ts.nanoseconds);
 
-	waitqueue_entry_t *wqe = kmalloc(sizeof(waitqueue_entry_t));
+	waitqueue_entry_t *wqe = alloc_waitqueue_entry();
 	if (wqe == NULL)
 	{
 		kfree(thread->wc);
@@ -42,12 +42,20 @@ DEFINE_SYSCALL2(syscall_nanosleep, SYSCALL_NANOSLEEP, const timespec_t *, uts, t
 		return -ERRNOMEM;
 	}
 
+	struct thread_wait_cond_sleep *sleep_cond = (struct thread_wait_cond_sleep *)thread->wc;
+
 	wqe->thread = thread;
-	wqe->func = wq_can_wake_thread;
+	wqe->data = sleep_cond;
 
-	spinlock_acquire(&cls->sleepq.lock);
-	list_add_tail(&wqe->list, &cls->sleepq.head);
-	spinlock_release(&cls->sleepq.lock);
+	ret = timerqueue_add(&cls->sleepq, wqe, timespec_to_cs(clock_first(CS_GLOBAL), &sleep_cond->timer));
+	if (ret < 0)
+	{
+		kfree(wqe);
+		kfree(thread->wc);
+		thread->wc = NULL;
+		set_thread_state(thread, THREAD_RUNNING);
+		return ret;
+	}
 
 	return 0;
 }
\ No newline at end of file
@@ -1,4 +1,5 @@
-#include <kernel/devicetree.h>
+#include <kernel/cls.h>
+#include <kernel/mm.h>
 #include <kernel/msgs.h>
 #include <kernel/paging.h>
 #include <kernel/syscall.h>
@@ -8,6 +9,7 @@
 
 #define SYSINFO_OP_FIELD_NCPU (1)
 #define SYSINFO_OP_FIELD_PAGE_SIZE (2)
+#define SYSINFO_OP_SLUB_STATS (3)
 
 DEFINE_SYSCALL1(syscall_kname, SYSCALL_KNAME, struct kname *, data)
 {
@@ -27,6 +29,42 @@ DEFINE_SYSCALL1(syscall_kname, SYSCALL_KNAME, struct kname *, data)
 	return 0;
 }
 
+static int sysinfo_slub_stats(struct sysinfo_slub *data)
+{
+	int access = access_ok(ACCESS_TYPE_WRITE, data, sizeof(*data));
+	if (access < 0)
+		return access;
+
+	uint32_t n = 0;
+	slub_t *slub = get_slub_head();
+
+	while (slub && n < SYSINFO_SLUB_MAX_CLASSES)
+	{
+		slub_stats_t stats;
+		slub_stats(slub, &stats);
+
+		struct sysinfo_slub_class class =
+			{
+				.object_size = slub->object_size,
+				.objects = stats.allocs - stats.frees,
+				.allocs = stats.allocs,
+				.frees = stats.frees,
+				.refills = stats.refills,
+				.partial_hits = stats.partial_hits,
+				.pages = stats.pages,
+			};
+
+		copy_to_user(&class, &data->classes[n], sizeof(class));
+
+		slub = slub->next;
+		n++;
+	}
+
+	copy_to_user(&n, &data->nclasses, sizeof(n));
+
+	return n;
+}
+
 DEFINE_SYSCALL2(syscall_sysinfo, SYSCALL_SYSINFO, uint64_t, op, struct sysinfo *, data)
 {
 	switch (op)
@@ -34,9 +72,11 @@ DEFINE_SYSCALL2(syscall_sysinfo, SYSCALL_SYSINFO, uint64_t, op, struct sysinfo *
 	case 0: // sysinfo
 		goto sysinfo;
 	case SYSINFO_OP_FIELD_NCPU: // ncpu
-		return devicetree_count_dev_type("cpu");
+		return cpu_count();
 	case SYSINFO_OP_FIELD_PAGE_SIZE: // page size
 		return PAGE_SIZE;
+	case SYSINFO_OP_SLUB_STATS: // kmalloc slub class stats
+		return sysinfo_slub_stats((struct sysinfo_slub *)data);
 	}
 
 sysinfo:
@@ -46,7 +86,7 @@ sysinfo:
 
 	struct sysinfo info =
 		{
-			.ncpu = devicetree_count_dev_type("cpu"),
+			.ncpu = cpu_count(),
 			.page_size = PAGE_SIZE,
 		};
 
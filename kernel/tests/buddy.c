@@ -0,0 +1,215 @@
+#include <tests/tests.h>
+#include <kernel/buddy.h>
+#include <kernel/mm.h>
+
+#define TEST_BUDDY_ARENA ((unsigned char *)0x100000000ULL)
+#define TEST_BUDDY_BATCH (256)
+
+/*
+ * The buddy never touches the arena memory itself, so these tests run against
+ * an arena address which is never mapped
+ */
+static struct buddy_t test_buddy;
+
+static void test_buddy_init(size_t size)
+{
+	test_buddy.next = 0;
+	test_buddy.index = 0;
+	test_buddy.size = size;
+	test_buddy.arena = TEST_BUDDY_ARENA;
+	buddy_init(&test_buddy);
+}
+
+NAMED_TEST("buddy alloc", test_buddy_alloc)
+{
+	test_buddy_init(BUDDY_ARENA_SIZE);
+
+	void *a = buddy_alloc(&test_buddy, 0);
+	void *b = buddy_alloc(&test_buddy, 0);
+	void *c = buddy_alloc(&test_buddy, 3);
+
+	assert_eq_msg(a, TEST_BUDDY_ARENA, "first alloc should be at the start of the arena");
+	assert_eq_msg(b, TEST_BUDDY_ARENA + BUDDY_BLOCK_SIZE, "second alloc should be the companion buddy");
+	assert_eq_msg(c, TEST_BUDDY_ARENA + 8 * BUDDY_BLOCK_SIZE, "order 3 alloc should skip the split order 3 block");
+	assert_msg((test_buddy.free_orders & (1 << BUDDY_MAX_ORDER)) == 0, "max order should be split");
+
+	buddy_free(&test_buddy, b);
+	buddy_free(&test_buddy, a);
+	buddy_free(&test_buddy, c);
+
+	assert_eq_msg(test_buddy.free_orders, 1 << BUDDY_MAX_ORDER, "frees should coalesce back into the max order");
+
+	TEST_PASS
+}
+
+NAMED_TEST("buddy partial arena", test_buddy_partial_arena)
+{
+	test_buddy_init(5 * BUDDY_BLOCK_SIZE);
+
+	assert_eq_msg(buddy_alloc(&test_buddy, 3), NULL, "order 3 should not fit in a 5 page arena");
+	assert_eq_msg(buddy_alloc(&test_buddy, 2), TEST_BUDDY_ARENA, "order 2 should be at the start of the arena");
+	assert_eq_msg(buddy_alloc(&test_buddy, 0), TEST_BUDDY_ARENA + 4 * BUDDY_BLOCK_SIZE, "order 0 should be the trailing page");
+	assert_eq_msg(buddy_alloc(&test_buddy, 0), NULL, "arena should be full");
+
+	TEST_PASS
+}
+
+NAMED_TEST("buddy free maps track whole blocks", test_buddy_free_maps)
+{
+	test_buddy_init(BUDDY_ARENA_SIZE);
+
+	// fill all but the last batch, which is then a single whole block
+	int filled = (1 << BUDDY_MAX_ORDER) - TEST_BUDDY_BATCH;
+	for (int i = 0; i < filled; i++)
+		assert_eq_msg(buddy_alloc(&test_buddy, 0), TEST_BUDDY_ARENA + i * BUDDY_BLOCK_SIZE, "allocs should take the lowest free page");
+
+	int batch_order = __builtin_ctz(TEST_BUDDY_BATCH);
+	assert_eq_msg(test_buddy.free_orders, 1 << batch_order, "only the batch order should have a free block");
+	assert_eq_msg(test_buddy.free_summary[0], 0, "order 0 should have no free blocks");
+	assert_msg(test_buddy.free_summary[batch_order] != 0, "batch order summary should show the free block");
+
+	// splitting the block leaves one free block at each order below it
+	assert_eq_msg(buddy_alloc(&test_buddy, 0), TEST_BUDDY_ARENA + filled * BUDDY_BLOCK_SIZE, "alloc should split the free block");
+	assert_eq_msg(test_buddy.free_orders, (1 << batch_order) - 1, "split should free one block per lower order");
+
+	for (int i = 1; i < TEST_BUDDY_BATCH; i++)
+		buddy_alloc(&test_buddy, 0);
+
+	assert_eq_msg(test_buddy.free_orders, 0, "full arena should have no free orders");
+	for (int i = 0; i <= BUDDY_MAX_ORDER; i++)
+		assert_eq_msg(test_buddy.free_summary[i], 0, "full arena should have empty summaries");
+	assert_eq_msg(buddy_alloc(&test_buddy, 0), NULL, "full arena should fail allocs");
+
+	TEST_PASS
+}
+
+NAMED_TEST("buddy index", test_buddy_index)
+{
+	static struct buddy_t buddies[3];
+	static struct buddy_index_t index;
+
+	for (int i = 0; i < 3; i++)
+	{
+		buddies[i].next = i < 2 ? &buddies[i + 1] : 0;
+		buddies[i].size = BUDDY_ARENA_SIZE;
+		buddies[i].arena = TEST_BUDDY_ARENA + (i * BUDDY_ARENA_SIZE);
+		buddy_init(&buddies[i]);
+	}
+
+	buddy_index_init(&index, buddies, 3);
+
+	void *a = buddy_alloc(buddies, BUDDY_MAX_ORDER);
+	void *b = buddy_alloc(buddies, 0);
+	void *c = buddy_alloc(buddies, BUDDY_MAX_ORDER);
+
+	assert_eq_msg(a, TEST_BUDDY_ARENA, "first max order alloc should take the first arena");
+	assert_eq_msg(b, TEST_BUDDY_ARENA + BUDDY_ARENA_SIZE, "order 0 should skip the full arena");
+	assert_eq_msg(c, TEST_BUDDY_ARENA + 2 * BUDDY_ARENA_SIZE, "max order should skip the split arena");
+	assert_eq_msg(buddy_alloc(buddies, BUDDY_MAX_ORDER), NULL, "no arena should satisfy max order");
+
+	buddy_free(buddies, a);
+	assert_eq_msg(buddies[0].frees, 1, "free should resolve to the first arena");
+	assert_eq_msg(buddy_alloc(buddies, 1), TEST_BUDDY_ARENA, "freed arena should be preferred again");
+
+	TEST_PASS
+}
+
+NAMED_TEST("buddy span alloc", test_buddy_span_alloc)
+{
+	static struct buddy_t buddies[4];
+	static struct buddy_index_t index;
+
+	for (int i = 0; i < 4; i++)
+	{
+		buddies[i].next = i < 3 ? &buddies[i + 1] : 0;
+		buddies[i].size = BUDDY_ARENA_SIZE;
+		buddies[i].arena = TEST_BUDDY_ARENA + (i * BUDDY_ARENA_SIZE);
+		buddy_init(&buddies[i]);
+	}
+
+	buddy_index_init(&index, buddies, 4);
+
+	void *a = buddy_alloc(buddies, 0);
+	void *b = buddy_alloc_span(buddies, 3);
+
+	assert_eq_msg(b, TEST_BUDDY_ARENA + BUDDY_ARENA_SIZE, "span should skip the split arena");
+	assert_eq_msg(buddy_alloc_span(buddies, 2), NULL, "no free arenas should remain for another span");
+
+	buddy_free(buddies, b);
+	assert_eq_msg(buddies[3].free_orders, 1 << BUDDY_MAX_ORDER, "freeing the span should free the last arena");
+
+	buddy_free(buddies, a);
+	assert_eq_msg(buddy_alloc(buddies, BUDDY_MAX_ORDER + 2), TEST_BUDDY_ARENA, "order above max should be a span of arenas");
+
+	TEST_PASS
+}
+
+NAMED_TEST("page free reuses cached page", test_page_cpu_cache)
+{
+	struct page *a = page_alloc(0);
+	assert_msg(a != NULL, "page should be allocated");
+
+	page_free(a);
+
+	struct page *b = page_alloc(0);
+	assert_eq_msg(b, a, "freed page should be reused from the CPU page cache");
+	assert_eq_msg(buddy_alloc_order(get_pages_head(), b), 0, "cached page should remain allocated in the buddy");
+
+	page_free(b);
+
+	TEST_PASS
+}
+
+NAMED_TEST("page zalloc from zeroed pool", test_page_zalloc)
+{
+	uint64_t *dirty = (uint64_t *)page_alloc(0);
+	dirty[0] = 0xDEADBEEF;
+	page_free(dirty);
+
+	// fill lower orders first, so this tops up order 0 if it has room
+	page_zero_pool_fill();
+
+	int pooled = page_zero_pool_count(0);
+	assert_msg(pooled > 0, "pool should hold a zeroed page");
+
+	uint64_t *a = (uint64_t *)page_zalloc(0);
+	assert_msg(a != NULL, "page should be allocated");
+	assert_eq_msg(page_zero_pool_count(0), pooled - 1, "page should be served from the zeroed pool");
+
+	for (size_t i = 0; i < PAGE_SIZE / sizeof(uint64_t); i++)
+	{
+		if (a[i] != 0)
+		{
+			terminal_logf("zalloc'd page not zero at 0x%X", i);
+			TEST_FAIL
+		}
+	}
+
+	page_free(a);
+
+	TEST_PASS
+}
+
+NAMED_TEST("page refs count shared owners", test_page_refs)
+{
+	struct page *a = page_alloc(0);
+	assert_msg(a != NULL, "page should be allocated");
+
+	assert_eq_msg(page_ref_count(a), 0, "new page should have no extra references");
+
+	page_ref_get(a);
+	page_ref_get(a);
+	assert_eq_msg(page_ref_count(a), 2, "each get should add a reference");
+
+	assert_eq_msg(page_ref_put(a), 2, "put should return the count before the drop");
+	assert_eq_msg(page_ref_put(a), 1, "put should return the count before the drop");
+	assert_eq_msg(page_ref_put(a), 0, "last owner should see no extra references");
+
+	page_block_ref_get(a);
+	assert_eq_msg(page_block_ref_put(a), 1, "shared block should not be freed on the first put");
+	assert_eq_msg(page_block_ref_put(a), 0, "last block owner should free the block");
+
+	page_free(a);
+
+	TEST_PASS
+}
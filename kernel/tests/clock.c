@@ -0,0 +1,23 @@
+#include <tests/tests.h>
+#include <kernel/clock.h>
+
+NAMED_TEST("timespec to counter value", test_timespec_to_cs)
+{
+	struct clocksource_t *cs = clock_first(CS_GLOBAL);
+	uint64_t freq = cs->getFreq(cs);
+
+	timespec_t ts = {.seconds = 2, .nanoseconds = 0};
+	assert_eq_msg(timespec_to_cs(cs, &ts), 2 * freq, "whole seconds should be exact");
+
+	ts.nanoseconds = 1;
+	assert_eq_msg(timespec_to_cs(cs, &ts), 2 * freq + 1, "part of a tick should round up");
+
+	timespec_t now;
+	timespec_from_cs(cs, &now);
+	assert_msg(timespec_to_cs(cs, &now) <= cs->val(cs), "current time should have been reached");
+
+	ts.seconds = -1;
+	assert_eq_msg(timespec_to_cs(cs, &ts), 0, "negative time should clamp to zero");
+
+	TEST_PASS
+}
@@ -94,4 +94,37 @@ NAMED_TEST("futex_wake", test_futex_wake)
 	mark_zombie_thread(t2);
 
 	TEST_PASS
-}
\ No newline at end of file
+}
+
+NAMED_TEST("futex_wake cancels timeout", test_futex_wake_timeout)
+{
+	int val = 3;
+	thread_t *t1 = create_kthread(NULL, "test1", NULL);
+	thread_t *t2 = create_kthread(NULL, "test2", NULL);
+	set_current_thread(t1);
+
+	timerqueue_head_t *sleepq = &get_cls()->sleepq;
+	size_t queued = sleepq->size;
+
+	int ret = futex_do_sleep(&val, 3, 1000LL << 30);
+	if (ret != 0)
+		TEST_FAIL_MSG("futex_do_sleep unexpected return result");
+
+	waitqueue_entry_t *timeout = ((struct thread_wait_cond_futex *)t1->wc)->timeout;
+	assert_msg(timeout != NULL, "futex should have a timeout");
+	assert_eq_msg(timeout->tq, sleepq, "timeout should be queued on the sleeping core");
+	assert_eq_msg(sleepq->size, queued + 1, "timeout should be in the sleep queue");
+
+	set_current_thread(t2);
+
+	ret = futex_do_wake(&val, 1, 3);
+	if (ret != 1)
+		TEST_FAIL_MSGF("futex_do_wake unexpected return result, was expecting 1 thread to have woken, got %d", ret);
+
+	assert_eq_msg(sleepq->size, queued, "wake should remove the timeout");
+
+	mark_zombie_thread(t1);
+	mark_zombie_thread(t2);
+
+	TEST_PASS
+}
@@ -0,0 +1,116 @@
+#include <kernel/cls.h>
+#include <kernel/mm.h>
+#include <kernel/shm.h>
+#include <kernel/thread.h>
+#include <kernel/umm.h>
+#include <kernel/unistd.h>
+#include <kernel/vm.h>
+#include <tests/tests.h>
+#include "errno.h"
+
+NAMED_TEST("shm_get_named", test_shm_get_named)
+{
+	thread_t *t = create_kthread(NULL, "test", NULL);
+	set_current_thread(t);
+
+	struct shm_get_params params = {
+		.size = PAGE_SIZE + 1,
+		.name = "shm_get_named",
+	};
+
+	int id = syscall_shm_get(t, &params);
+	if (id <= 0)
+	{
+		terminal_logf("unexpected shm_get result, got %d", id);
+		mark_zombie_thread(t);
+		TEST_FAIL
+	}
+
+	assert_eq_msg(syscall_shm_ctrl(t, id, SHM_CTRL_OP_SIZE, 0), 2 * PAGE_SIZE, "segment size should be page aligned");
+
+	params.size = 0;
+	assert_eq_msg((int)syscall_shm_get(t, &params), id, "getting an existing name should return the same segment");
+
+	params.flags = SHM_GET_EXCL;
+	assert_eq_msg((int)syscall_shm_get(t, &params), -ERREXISTS, "exclusive get should fail on an existing name");
+
+	params.flags = 0;
+	params.size = 4 * PAGE_SIZE;
+	assert_eq_msg((int)syscall_shm_get(t, &params), -ERRSIZE, "existing segment should not be grown");
+
+	assert_eq_msg(syscall_shm_ctrl(t, id, SHM_CTRL_OP_REMOVE, 0), 0, "owner should be able to remove the segment");
+	assert_eq_msg((int)syscall_shm_ctrl(t, id, SHM_CTRL_OP_SIZE, 0), -ERRNOENT, "removed segment should not be found");
+	assert_eq_msg(shm_get_skl()->size, 0, "no segments should remain");
+
+	mark_zombie_thread(t);
+
+	TEST_PASS
+}
+
+#define TEST_SHM_START_BRK (0x10000000ULL)
+#define TEST_SHM_VADDR (0x40000000ULL)
+
+NAMED_TEST("shm attach detach", test_shm_attach_detach)
+{
+	thread_t *t = create_kthread(NULL, "test", NULL);
+	set_current_thread(t);
+
+	struct shm_get_params params = {
+		.size = 2 * PAGE_SIZE,
+	};
+
+	int id = syscall_shm_get(t, &params);
+	assert_msg(id > 0, "anonymous segment should be created");
+
+	// a bare address space to attach into
+	static process_t proc;
+	spinlock_init(&proc.lock);
+	vm_maps_init(&proc.vm);
+	proc.vm.asid = 0;
+	proc.vm.vm_table = (vm_table *)page_alloc_s(sizeof(vm_table));
+	vm_init_table(proc.vm.vm_table);
+	proc.vm.start_brk = TEST_SHM_START_BRK;
+	proc.vm.brk = TEST_SHM_START_BRK;
+	proc.pid = t->process->pid;
+
+	process_t *kproc = t->process;
+	t->process = &proc;
+
+	uintptr_t addr = syscall_shm_attach(t, id, TEST_SHM_VADDR, 0);
+	assert_eq_msg(addr, TEST_SHM_VADDR, "segment should be attached at the requested address");
+	assert_eq_msg((int)syscall_shm_attach(t, id, TEST_SHM_VADDR + PAGE_SIZE, 0), -ERREXISTS, "attaching over a mapping should fail");
+
+	uintptr_t ro = syscall_shm_attach(t, id, 0, SHM_ATTACH_RDONLY);
+	assert_eq_msg(ro, TEST_SHM_START_BRK, "attaching without an address should use the break");
+
+	vm_mapping *map = vm_maps_find(&proc.vm, addr);
+	assert_msg(map != NULL && (map->flags & VM_MAP_FLAG_SHM) != 0, "attached segment should be a shm mapping");
+	assert_eq_msg(vm_maps_find(&proc.vm, ro)->page, map->page, "both mappings should share the block");
+	assert_eq_msg(vm_va_to_pa(proc.vm.vm_table, addr + PAGE_SIZE), map->phy_addr + PAGE_SIZE, "whole segment should be mapped");
+
+	void *page = map->page;
+	*(uint64_t *)page = 0xC0FFEE;
+
+	assert_eq_msg((int)syscall_shm_detach(t, addr + PAGE_SIZE), -ERRINVAL, "detach should need the start of the mapping");
+	assert_eq_msg(syscall_shm_detach(t, addr), 0, "detach should succeed");
+	assert_eq_msg(vm_va_to_pa(proc.vm.vm_table, addr), 0, "detached segment should be unmapped");
+
+	// the remaining mapping keeps the block after the segment is gone
+	assert_eq_msg(syscall_shm_ctrl(t, id, SHM_CTRL_OP_REMOVE, 0), 0, "segment should be removed while attached");
+	assert_eq_msg((int)syscall_shm_ctrl(t, id, SHM_CTRL_OP_SIZE, 0), -ERRNOENT, "removed segment should not be found");
+	assert_eq_msg(*(uint64_t *)page, 0xC0FFEE, "attached block should not be freed by the remove");
+
+	assert_eq_msg(syscall_shm_detach(t, ro), 0, "last detach should succeed");
+
+	// freed blocks are reused first from the per-CPU page cache
+	void *next = page_alloc_s(2 * PAGE_SIZE);
+	assert_eq_msg(next, page, "last detach should free the block");
+	page_free(next);
+
+	t->process = kproc;
+	vm_maps_destroy(&proc.vm);
+	vm_free_table(proc.vm.vm_table);
+	mark_zombie_thread(t);
+
+	TEST_PASS
+}
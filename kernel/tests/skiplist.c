@@ -0,0 +1,64 @@
+#include <tests/tests.h>
+#include <kernel/skiplist.h>
+
+#define TEST_SKL_COUNT (64)
+
+typedef struct test_skl_item_t
+{
+	int key;
+	skl_embedded_node_t node;
+} test_skl_item_t;
+
+static int test_skl_comparator(void *rnode, void *list_rnode)
+{
+	if (list_rnode == 0)
+		return 1;
+
+	int a = ((test_skl_item_t *)rnode)->key;
+	int b = ((test_skl_item_t *)list_rnode)->key;
+
+	if (a == b)
+		return 0;
+	else if (a < b)
+		return -1;
+	return 1;
+}
+
+NAMED_TEST("skip list embedded nodes", test_skl_embedded)
+{
+	static test_skl_item_t items[TEST_SKL_COUNT];
+	skiplist_t skl;
+
+	skl_init_embedded(&skl, SKIPLIST_DEFAULT_LEVELS, test_skl_comparator, __builtin_offsetof(test_skl_item_t, node));
+
+	// insert out of order
+	for (int i = 0; i < TEST_SKL_COUNT; i++)
+	{
+		int n = (i * 37) % TEST_SKL_COUNT;
+		items[n].key = n;
+		assert_eq_msg(skl_insert(&skl, &items[n]), 0, "insert should succeed");
+	}
+
+	assert_eq_msg(skl_insert(&skl, &items[10]), -1, "an item should only be inserted once");
+	assert_eq_msg(skl.size, TEST_SKL_COUNT, "all items should be in the list");
+
+	assert_eq_msg(skl_delete(&skl, &items[10]), 0, "delete should find the item");
+	assert_eq_msg(items[10].node.node.rnode, NULL, "deleted node should be free to reuse");
+
+	for (int i = 0; i < TEST_SKL_COUNT; i++)
+	{
+		if (i == 10)
+			continue;
+
+		// every level should still be ordered after pulling the first
+		assert_eq_msg(skl_search(&skl, &items[TEST_SKL_COUNT - 1], test_skl_comparator), &items[TEST_SKL_COUNT - 1], "search should find the last item");
+		assert_eq_msg(skl_pull_first(&skl), &items[i], "pull should return items in order");
+	}
+
+	assert_eq_msg(skl.size, 0, "list should be empty");
+	assert_eq_msg(skl_insert(&skl, &items[0]), 0, "pulled items should be insertable again");
+
+	skl_destroy(&skl);
+
+	TEST_PASS
+}
@@ -7,16 +7,16 @@ TEST("slub alloc")
 	slub_t *slub = DEFINE_DYN_SLUB(8U);
 
 	void *addr = slub_alloc(slub);
-	void *aa_first = slub->per_cpu_partial[0]->first;
+	void *aa_first = slub->per_cpu[0].cache->first;
 	void *addr2 = slub_alloc(slub);
 
 	assert_neq_msg(addr, 0, "slub alloc addr should not be zero");
-	assert_eq_msg(slub->object_count, 2, "slub alloc object count should be 1");
-	assert_eq_msg(slub->per_cpu_partial[0]->first, aa_first + slub->object_size, "slub cache first should have shifted sizeof(object)");
+	assert_eq_msg(slub_object_count(slub), 2, "slub alloc object count should be 1");
+	assert_eq_msg(slub->per_cpu[0].cache->first, aa_first + slub->object_size, "slub cache first should have shifted sizeof(object)");
 	assert_eq_msg(addr2, aa_first, "addr2 should be addr + sizeof(object)");
 
 	// cleanup
-	page_free(slub->per_cpu_partial[0]);
+	page_free(slub->per_cpu[0].cache);
 	page_free(slub);
 
 	TEST_PASS;
@@ -31,9 +31,9 @@ TEST("slub free")
 	void *addr3 = slub_alloc(slub);
 
 	assert_eq_msg(addr, addr3, "addr3 should have same allocd same address as addr");
-	assert_eq_msg(slub->object_count, 2, "slub should only have 2 objects");
+	assert_eq_msg(slub_object_count(slub), 2, "slub should only have 2 objects");
 
-	page_free(slub->per_cpu_partial[0]);
+	page_free(slub->per_cpu[0].cache);
 	page_free(slub);
 	TEST_PASS;
 }
@@ -48,8 +48,8 @@ NAMED_TEST("slub multi cache", test_slub_multi_cache)
 	void *addr3 = slub_alloc(slub);
 
 	assert_neq_msg(addr1, addr3, "addr3 should have same allocd from per-cpu cache first");
-	assert_eq_msg(slub->object_count, 3, "slub should only have 2 objects");
-	assert_eq_msg(slub->per_cpu_partial[0], NULL, "slub per_cpu cache should be full");
+	assert_eq_msg(slub_object_count(slub), 3, "slub should only have 2 objects");
+	assert_eq_msg(slub->per_cpu[0].cache, NULL, "slub per_cpu cache should be full");
 	assert_list_not_empty_msg(&slub->partial, "slub partial should cotain a cache");
 
 	slub_free(addr3);
@@ -66,20 +66,88 @@ TEST("slub huge alloc")
 
 	assert_neq(addr, NULL);
 	assert_neq_msg(addr, NULL, "addr should not be null");
-	assert_eq_msg(slub->per_cpu_partial[0], NULL, "slub per_cpu cache should be full");
+	assert_eq_msg(slub->per_cpu[0].cache, NULL, "slub per_cpu cache should be full");
 
 	slub_free(addr);
 
 	assert_list_empty_msg(&slub->partial, "slub partial should not be empty");
-	assert_eq_msg(slub->per_cpu_partial[0], NULL, "per-cpu cache should be empty");
+	assert_eq_msg(slub->per_cpu[0].cache, NULL, "per-cpu cache should be empty");
 
 	void *addr2 = slub_alloc(slub);
 	assert_neq(addr2, NULL);
-	assert_eq_msg(slub->per_cpu_partial[0], NULL, "per-cpu cache should still be empty");
+	assert_eq_msg(slub->per_cpu[0].cache, NULL, "per-cpu cache should still be empty");
 	assert_list_empty_msg(&slub->partial, "slub partial should still be empty");
 
 	slub_free(addr2);
 
 	page_free(slub);
 	TEST_PASS;
-}
\ No newline at end of file
+}
+
+TEST("slub remote free")
+{
+	slub_t *slub = DEFINE_DYN_SLUB(16U);
+	void *addr = slub_alloc(slub);
+	void *addr2 = slub_alloc(slub);
+
+	slub_cache_entry_t *cache = slub->per_cpu[0].cache;
+	void *first = cache->first;
+
+	// pretend another core owns the cache
+	cache->owner = 1;
+	slub_free(addr);
+	cache->owner = 0;
+
+	assert_eq_msg(cache->remote_free, addr, "remote free should be deferred");
+	assert_eq_msg(cache->first, first, "remote free should not touch the local freelist");
+	assert_eq_msg(slub_object_count(slub), 1, "slub should only have 1 object");
+
+	slub_free(addr2);
+	assert_eq_msg(cache->first, addr2, "local free should go to the local freelist");
+
+	page_free(cache);
+	page_free(slub);
+	TEST_PASS;
+}
+
+TEST("kmalloc size classes")
+{
+	void *small = kmalloc(200);
+	void *large = kmalloc(PAGE_SIZE + 1);
+
+	slub_cache_entry_t *cache = (slub_cache_entry_t *)((uintptr_t)small & ~(PAGE_SIZE - 1));
+
+	assert_neq_msg(small, NULL, "small alloc should not be null");
+	assert_eq_msg(cache->slub->object_size, 256, "200 bytes should be served by the 256 byte class");
+	assert_neq_msg(large, NULL, "oversized alloc should fall back to pages");
+	assert_eq_msg((uintptr_t)large & (PAGE_SIZE - 1), 0, "oversized alloc should be page aligned");
+
+	kfree(small);
+	kfree(large);
+
+	TEST_PASS;
+}
+
+TEST("slub stats")
+{
+	slub_t *slub = DEFINE_DYN_SLUB(64U);
+	slub_stats_t stats;
+
+	void *addr = slub_alloc(slub);
+	void *addr2 = slub_alloc(slub);
+	slub_free(addr);
+
+	slub_stats(slub, &stats);
+
+	assert_eq_msg(stats.allocs, 2, "slub stats should count 2 allocs");
+	assert_eq_msg(stats.frees, 1, "slub stats should count 1 free");
+	assert_eq_msg(stats.refills, 1, "slub stats should count 1 refill");
+	assert_eq_msg(stats.partial_hits, 0, "slub stats should not have hit the partial list");
+	assert_eq_msg(stats.pages, 1, "slub stats should hold 1 page");
+
+	slub_free(addr2);
+	page_free(slub->per_cpu[0].cache);
+	page_free(slub);
+
+	TEST_PASS;
+}
@@ -0,0 +1,286 @@
+#include <tests/tests.h>
+#include <kernel/cls.h>
+#include <kernel/mm.h>
+#include <kernel/thread.h>
+#include <kernel/umm.h>
+#include <kernel/vm.h>
+
+#define TEST_VM_MAPS_COUNT (64)
+#define TEST_VM_MAPS_STRIDE (0x10000)
+
+NAMED_TEST("vm maps ordered lookup", test_vm_maps_lookup)
+{
+	static vm_mapping maps[TEST_VM_MAPS_COUNT];
+	vm_t vm;
+
+	vm_maps_init(&vm);
+
+	// insert out of order
+	for (int i = 0; i < TEST_VM_MAPS_COUNT; i++)
+	{
+		int n = (i * 37) % TEST_VM_MAPS_COUNT;
+		maps[n].vm_addr = TEST_VM_MAPS_STRIDE * (n + 1);
+		maps[n].length = PAGE_SIZE;
+		vm_maps_insert(&vm, &maps[n]);
+	}
+
+	assert_eq_msg(vm.vm_maps.next, &maps[0].list, "mapping list should be in address order");
+	assert_eq_msg(vm_maps_find(&vm, 0), NULL, "no mapping should be below the first");
+	assert_eq_msg(vm_maps_find(&vm, maps[5].vm_addr + 0x10), &maps[5], "find should return the containing mapping");
+	assert_eq_msg(vm_maps_find(&vm, maps[5].vm_addr + PAGE_SIZE), &maps[5], "find should return the mapping below a gap");
+	assert_eq_msg(vm_maps_first_from(&vm, maps[5].vm_addr + 1), &maps[6], "first from should skip mappings starting below");
+
+	vm_maps_remove(&vm, &maps[6]);
+	assert_eq_msg(vm_maps_first_from(&vm, maps[5].vm_addr + 1), &maps[7], "removed mapping should not be found");
+
+	vm_maps_destroy(&vm);
+
+	TEST_PASS
+}
+
+#define TEST_VM_TABLE_VADDR (0x40000000ULL)
+
+NAMED_TEST("vm table pages are recycled", test_vm_table_recycle)
+{
+	vm_table *table = (vm_table *)page_alloc_s(sizeof(vm_table));
+	vm_init_table(table);
+
+	uintptr_t pa = vm_va_to_pa(vm_get_kernel(), (uintptr_t)table);
+
+	// a lone page, so the unmap empties its L3 table
+	vm_map_region(table, pa, TEST_VM_TABLE_VADDR, PAGE_SIZE - 1, MEMORY_TYPE_USER | MEMORY_PERM_RO);
+	uintptr_t l3 = (uintptr_t)vm_va_to_pte(table, TEST_VM_TABLE_VADDR) & ~(PAGE_SIZE - 1);
+
+	vm_unmap_region(table, 0, TEST_VM_TABLE_VADDR, PAGE_SIZE - 1);
+	assert_eq_msg(vm_va_to_pa(table, TEST_VM_TABLE_VADDR), 0, "unmapped page should not translate");
+
+	vm_map_region(table, pa, TEST_VM_TABLE_VADDR + PAGE_SIZE, PAGE_SIZE - 1, MEMORY_TYPE_USER | MEMORY_PERM_RO);
+	uint64_t *pte = vm_va_to_pte(table, TEST_VM_TABLE_VADDR + PAGE_SIZE);
+	assert_eq_msg((uintptr_t)pte & ~(PAGE_SIZE - 1), l3, "emptied table should be reused for the next table level");
+	assert_eq_msg(*(pte - 1), 0, "reused table should be zeroed");
+
+	vm_free_table(table);
+
+	TEST_PASS
+}
+
+NAMED_TEST("vm map region uses blocks and contiguous runs", test_vm_map_region_sizes)
+{
+	vm_table *table = (vm_table *)page_alloc_s(sizeof(vm_table));
+	vm_init_table(table);
+
+	void *mem = page_alloc_s(L2_BLOCK_SIZE);
+	uintptr_t pa = vm_va_to_pa(vm_get_kernel(), (uintptr_t)mem);
+	assert_eq_msg(pa & (L2_BLOCK_SIZE - 1), 0, "block allocation should be physically aligned");
+
+	// aligned on both sides, so a single L2 block
+	vm_map_region(table, pa, TEST_VM_TABLE_VADDR, L2_BLOCK_SIZE - 1, MEMORY_TYPE_USER | MEMORY_PERM_RO);
+	uint64_t *pte = vm_va_to_pte(table, TEST_VM_TABLE_VADDR);
+	assert_msg(pte != NULL, "block should be mapped");
+	assert_eq_msg(*pte & VM_ENTRY_ISTABLE, 0, "aligned region should be mapped by a block entry");
+	assert_eq_msg(vm_va_to_pa(table, TEST_VM_TABLE_VADDR + 0x1234), pa + 0x1234, "block should translate within");
+
+	vm_unmap_region(table, 0, TEST_VM_TABLE_VADDR, L2_BLOCK_SIZE - 1);
+
+	// one 64KiB run, not enough for a block
+	uintptr_t va = TEST_VM_TABLE_VADDR + VM_CONTIGUOUS_SIZE;
+	vm_map_region(table, pa, va, VM_CONTIGUOUS_SIZE - 1, MEMORY_TYPE_USER | MEMORY_PERM_RO);
+	for (int i = 0; i < VM_CONTIGUOUS_ENTRIES; i++)
+	{
+		pte = vm_va_to_pte(table, va + i * PAGE_SIZE);
+		assert_msg((*pte & VM_ENTRY_ISTABLE) != 0, "run should be mapped by page entries");
+		assert_msg((*pte & VM_ENTRY_CONTIGUOUS) != 0, "aligned run should have the contiguous hint");
+	}
+
+	// unmapping one page breaks the run but keeps its neighbours
+	vm_unmap_region(table, 0, va + 4 * PAGE_SIZE, PAGE_SIZE - 1);
+	assert_eq_msg(vm_va_to_pa(table, va + 4 * PAGE_SIZE), 0, "unmapped page should not translate");
+	for (int i = 0; i < VM_CONTIGUOUS_ENTRIES; i++)
+	{
+		if (i == 4)
+			continue;
+
+		pte = vm_va_to_pte(table, va + i * PAGE_SIZE);
+		assert_eq_msg(*pte & VM_ENTRY_CONTIGUOUS, 0, "broken run should lose the contiguous hint");
+		assert_eq_msg(vm_va_to_pa(table, va + i * PAGE_SIZE), pa + i * PAGE_SIZE, "rest of the run should stay mapped");
+	}
+
+	vm_free_table(table);
+	page_free(mem);
+
+	TEST_PASS
+}
+
+NAMED_TEST("vm partial unmap splits blocks", test_vm_unmap_split)
+{
+	vm_table *table = (vm_table *)page_alloc_s(sizeof(vm_table));
+	vm_init_table(table);
+
+	void *mem = page_alloc_s(2 * L2_BLOCK_SIZE);
+	uintptr_t pa = vm_va_to_pa(vm_get_kernel(), (uintptr_t)mem);
+
+	vm_map_region(table, pa, TEST_VM_TABLE_VADDR, 2 * L2_BLOCK_SIZE - 1, MEMORY_TYPE_USER | MEMORY_PERM_RO);
+	assert_eq_msg(*vm_va_to_pte(table, TEST_VM_TABLE_VADDR) & VM_ENTRY_ISTABLE, 0, "first half should be a block");
+	assert_eq_msg(*vm_va_to_pte(table, TEST_VM_TABLE_VADDR + L2_BLOCK_SIZE) & VM_ENTRY_ISTABLE, 0, "second half should be a block");
+
+	// the middle 2MiB straddles both blocks
+	uintptr_t start = TEST_VM_TABLE_VADDR + L2_BLOCK_SIZE / 2;
+	uintptr_t end = start + L2_BLOCK_SIZE;
+	vm_unmap_region(table, 0, start, L2_BLOCK_SIZE - 1);
+
+	assert_eq_msg(vm_va_to_pa(table, start - PAGE_SIZE), pa + L2_BLOCK_SIZE / 2 - PAGE_SIZE, "page before the region should stay mapped");
+	assert_eq_msg(vm_va_to_pa(table, start), 0, "first page of the region should be unmapped");
+	assert_eq_msg(vm_va_to_pa(table, end - PAGE_SIZE), 0, "last page of the region should be unmapped");
+	assert_eq_msg(vm_va_to_pa(table, end), pa + L2_BLOCK_SIZE / 2 + L2_BLOCK_SIZE, "page after the region should stay mapped");
+	assert_msg((*vm_va_to_pte(table, start - PAGE_SIZE) & VM_ENTRY_ISTABLE) != 0, "first block should be split into pages");
+	assert_msg((*vm_va_to_pte(table, end) & VM_ENTRY_ISTABLE) != 0, "second block should be split into pages");
+
+	vm_free_table(table);
+	page_free(mem);
+
+	TEST_PASS
+}
+
+NAMED_TEST("vm split mapping", test_vm_split_mapping)
+{
+	static vm_mapping map;
+	vm_t vm;
+
+	vm_maps_init(&vm);
+
+	map.vm_addr = TEST_VM_MAPS_STRIDE;
+	map.phy_addr = 0x80000000;
+	map.length = 4 * PAGE_SIZE;
+	map.flags = MEMORY_TYPE_USER | MEMORY_PERM_W;
+	vm_maps_insert(&vm, &map);
+
+	vm_mapping *sib = vm_split_mapping(&vm, &map, PAGE_SIZE);
+	assert_msg(sib != NULL, "split should allocate the remainder");
+
+	assert_eq_msg(map.length, PAGE_SIZE, "split mapping should end at the offset");
+	assert_eq_msg(sib->vm_addr, TEST_VM_MAPS_STRIDE + PAGE_SIZE, "remainder should start at the offset");
+	assert_eq_msg(sib->phy_addr, 0x80000000 + PAGE_SIZE, "remainder should keep its physical pages");
+	assert_eq_msg(sib->length, 3 * PAGE_SIZE, "remainder should cover the rest of the mapping");
+	assert_eq_msg(sib->flags, map.flags, "remainder should keep the permissions");
+	assert_eq_msg(vm_maps_find(&vm, sib->vm_addr + PAGE_SIZE), sib, "remainder should be indexed");
+
+	vm_maps_remove(&vm, sib);
+	kfree(sib);
+	vm_maps_destroy(&vm);
+
+	TEST_PASS
+}
+
+#define TEST_VM_START_BRK (0x10000000ULL)
+#define TEST_VM_LAZY_VADDR (0x40000000ULL)
+#define TEST_VM_LAZY_FLAGS (MEMORY_TYPE_USER | MEMORY_PERM_W | MEMORY_USER_NON_EXEC)
+
+// test_vm_process gives the thread a bare address space to fault in
+static void test_vm_process(process_t *proc, thread_t *t)
+{
+	spinlock_init(&proc->lock);
+	vm_maps_init(&proc->vm);
+	proc->vm.asid = 0;
+	proc->vm.vm_table = (vm_table *)page_alloc_s(sizeof(vm_table));
+	vm_init_table(proc->vm.vm_table);
+	proc->vm.start_brk = TEST_VM_START_BRK;
+	proc->vm.brk = TEST_VM_START_BRK;
+	proc->pid = t->process->pid;
+
+	t->process = proc;
+	set_current_thread(t);
+}
+
+// test_vm_process_free releases the mappings and tables of the address space
+static void test_vm_process_free(process_t *proc)
+{
+	vm_mapping *this, *next;
+	list_head_for_each_safe(this, next, &proc->vm.vm_maps)
+	{
+		vm_release_mapping(&proc->vm, this, 0);
+		vm_maps_remove(&proc->vm, this);
+		kfree(this);
+	}
+
+	vm_maps_destroy(&proc->vm);
+	vm_free_table(proc->vm.vm_table);
+}
+
+NAMED_TEST("vm lazy huge fault maps a block", test_vm_lazy_huge_fault)
+{
+	static process_t proc;
+	thread_t *t = create_kthread(NULL, "test", NULL);
+	process_t *kproc = t->process;
+	test_vm_process(&proc, t);
+
+	// an aligned block with a page either side
+	uintptr_t addr = TEST_VM_LAZY_VADDR - PAGE_SIZE;
+	lazy_mem_map(t, addr, L2_BLOCK_SIZE + 2 * PAGE_SIZE, TEST_VM_LAZY_FLAGS);
+
+	user_data_abort(TEST_VM_LAZY_VADDR + 0x1234, USER_DATA_ABORT_WRITE, 0);
+
+	uint64_t *pte = vm_va_to_pte(proc.vm.vm_table, TEST_VM_LAZY_VADDR);
+	assert_msg(pte != NULL, "faulted block should be mapped");
+	assert_eq_msg(*pte & VM_ENTRY_ISTABLE, 0, "aligned block should be mapped by a block entry");
+	assert_eq_msg(vm_va_to_pa(proc.vm.vm_table, TEST_VM_LAZY_VADDR) & (L2_BLOCK_SIZE - 1), 0, "block should be physically aligned");
+
+	vm_mapping *map = vm_maps_find(&proc.vm, TEST_VM_LAZY_VADDR);
+	assert_eq_msg(map->vm_addr, TEST_VM_LAZY_VADDR, "block should be split from the head");
+	assert_eq_msg(map->length, L2_BLOCK_SIZE, "block should be split from the tail");
+	assert_eq_msg(vm_va_to_pte(proc.vm.vm_table, addr), 0, "head should still be lazy");
+	assert_eq_msg(vm_va_to_pte(proc.vm.vm_table, TEST_VM_LAZY_VADDR + L2_BLOCK_SIZE), 0, "tail should still be lazy");
+
+	t->process = kproc;
+	test_vm_process_free(&proc);
+	mark_zombie_thread(t);
+
+	TEST_PASS
+}
+
+NAMED_TEST("vm lazy fault around window", test_vm_lazy_fault_around)
+{
+	static process_t proc;
+	thread_t *t = create_kthread(NULL, "test", NULL);
+	process_t *kproc = t->process;
+	test_vm_process(&proc, t);
+
+	// not covering an aligned block, so every fault maps a window
+	uintptr_t addr = TEST_VM_LAZY_VADDR + PAGE_SIZE;
+	uintptr_t end = TEST_VM_LAZY_VADDR + 2 * L2_BLOCK_SIZE - PAGE_SIZE;
+	lazy_mem_map(t, addr, end - addr, TEST_VM_LAZY_FLAGS);
+
+	// sequential faults double the window from 64KiB up to 1MiB
+	static const size_t windows[] = {0x10000, 0x20000, 0x40000, 0x80000, 0x100000, 0x100000};
+	for (size_t i = 0; i < sizeof(windows) / sizeof(windows[0]); i++)
+	{
+		user_data_abort(addr, USER_DATA_ABORT_WRITE, 0);
+
+		vm_mapping *map = vm_maps_find(&proc.vm, addr);
+		assert_eq_msg(map->vm_addr, addr, "window should start at the fault");
+		assert_eq_msg(map->length, windows[i], "window should double up to the cap");
+		assert_msg(vm_va_to_pa(proc.vm.vm_table, addr + windows[i] - PAGE_SIZE) != 0, "whole window should be mapped");
+
+		addr += windows[i];
+
+		vm_mapping *rest = vm_maps_find(&proc.vm, addr);
+		assert_eq_msg(rest->vm_addr, addr, "remainder should start after the window");
+		assert_eq_msg(rest->fault_next, addr, "remainder should carry the next fault address");
+		assert_eq_msg(rest->fault_window, windows[i], "remainder should carry the window");
+		assert_eq_msg(vm_va_to_pa(proc.vm.vm_table, addr), 0, "remainder should still be lazy");
+	}
+
+	// a fault past the window starts over from an aligned 64KiB window
+	uintptr_t far = addr + 0x100000 + PAGE_SIZE;
+	user_data_abort(far, USER_DATA_ABORT_READ, 0);
+
+	vm_mapping *map = vm_maps_find(&proc.vm, far);
+	assert_eq_msg(map->vm_addr, far & ~(0x10000ULL - 1), "non sequential fault should map an aligned window");
+	assert_eq_msg(map->fault_window, 0x10000, "non sequential fault should reset the window");
+	assert_eq_msg(vm_va_to_pa(proc.vm.vm_table, addr), 0, "pages between the windows should still be lazy");
+
+	t->process = kproc;
+	test_vm_process_free(&proc);
+	mark_zombie_thread(t);
+
+	TEST_PASS
+}
@@ -0,0 +1,54 @@
+#include <tests/tests.h>
+#include <kernel/cls.h>
+#include <kernel/mm.h>
+#include <kernel/wait.h>
+
+#define TEST_TIMERQUEUE_COUNT (40)
+
+NAMED_TEST("timer queue expires in order", test_timerqueue_expire)
+{
+	static int cond;
+	waitqueue_entry_t *entries[TEST_TIMERQUEUE_COUNT];
+	timerqueue_head_t tq;
+	uint64_t next;
+
+	INIT_TIMERQUEUE(&tq);
+
+	// not waiting on the condition, so expiring never wakes it
+	thread_t *t = create_kthread(NULL, "test", NULL);
+
+	// insert out of order, expiring at 100, 200, ...
+	for (int i = 0; i < TEST_TIMERQUEUE_COUNT; i++)
+	{
+		int n = (i * 17) % TEST_TIMERQUEUE_COUNT;
+		entries[n] = alloc_waitqueue_entry();
+		entries[n]->thread = t;
+		entries[n]->data = &cond;
+		assert_eq_msg(timerqueue_add(&tq, entries[n], (n + 1) * 100), 0, "add should grow the queue");
+	}
+
+	assert_eq_msg(tq.size, TEST_TIMERQUEUE_COUNT, "all entries should be queued");
+	assert_msg(timerqueue_next(&tq, &next), "queue should have a next expiry");
+	assert_eq_msg(next, 100, "next expiry should be the earliest");
+
+	assert_eq_msg(timerqueue_cancel(entries[0]), 1, "cancel should remove a queued entry");
+	assert_eq_msg(timerqueue_cancel(entries[20]), 1, "cancel should remove a queued entry");
+	timerqueue_next(&tq, &next);
+	assert_eq_msg(next, 200, "next expiry should skip the cancelled entry");
+
+	timerqueue_expire(&tq, 1050);
+	assert_eq_msg(tq.size, TEST_TIMERQUEUE_COUNT - 11, "only expired entries should be taken");
+	timerqueue_next(&tq, &next);
+	assert_eq_msg(next, 1100, "next expiry should be the first not yet expired");
+
+	timerqueue_expire(&tq, TEST_TIMERQUEUE_COUNT * 100);
+	assert_eq_msg(tq.size, 0, "all entries should have expired");
+	assert_eq_msg(timerqueue_next(&tq, &next), 0, "empty queue should have no expiry");
+
+	assert_eq_msg(t->state, THREAD_RUNNING, "thread not waiting on the condition should not be woken");
+
+	mark_zombie_thread(t);
+	kfree(tq.heap);
+
+	TEST_PASS
+}
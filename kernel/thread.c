@@ -11,6 +11,7 @@
 #include <kernel/syscall.h>
 #include <kernel/thread.h>
 #include <kernel/tty.h>
+#include <kernel/umm.h>
 #include <kernel/uaccess.h>
 #include <kernel/vm.h>
 
@@ -22,6 +23,25 @@ static spinlock_t procs_lock;
 
 static process_t kthreads_proc;
 
+static slub_t *thread_slub;
+static slub_t *thread_list_entry_slub;
+
+void init_thread_caches(void)
+{
+	thread_slub = DEFINE_DYN_SLUB(sizeof(thread_t));
+	thread_list_entry_slub = DEFINE_DYN_SLUB(sizeof(thread_list_entry_t));
+}
+
+thread_t *alloc_thread(void)
+{
+	return (thread_t *)slub_alloc(thread_slub);
+}
+
+thread_list_entry_t *alloc_thread_list_entry(void)
+{
+	return (thread_list_entry_t *)slub_alloc(thread_list_entry_slub);
+}
+
 void init_proc(process_t *proc, char *cmd)
 {
 	spinlock_init(&proc->lock);
@@ -29,13 +49,14 @@ void init_proc(process_t *proc, char *cmd)
 	INIT_LIST_HEAD(&proc->queues);
 	INIT_LIST_HEAD(&proc->threads);
 	INIT_LIST_HEAD(&proc->children);
-	INIT_LIST_HEAD(&proc->vm.vm_maps);
+	vm_maps_init(&proc->vm);
 
 	strncpy(proc->cmd, cmd, CMD_MAX);
 	proc->state = STOPPED;
 	proc->exitCode = -1;
 	proc->nexttid = 1;
 
+	proc->vm.asid = 0;
 	proc->vm.vm_table = (vm_table *)page_alloc_s(sizeof(vm_table));
 	vm_init_table(proc->vm.vm_table);
 
@@ -47,6 +68,14 @@ void init_proc(process_t *proc, char *cmd)
 	spinlock_release(&procs_lock);
 }
 
+pid_t alloc_pid(void)
+{
+	// init is always pid 1
+	static pid_t nextpid = 2;
+
+	return __atomic_fetch_add(&nextpid, 1, __ATOMIC_RELAXED);
+}
+
 void init_kthread_proc()
 {
 	kthreads_proc.pid = 0;
@@ -56,7 +85,7 @@ void init_kthread_proc()
 	kthreads_proc.egid = 0;
 
 	INIT_LIST_HEAD(&kthreads_proc.queues);
-	INIT_LIST_HEAD(&kthreads_proc.vm.vm_maps);
+	vm_maps_init(&kthreads_proc.vm);
 	INIT_LIST_HEAD(&kthreads_proc.threads);
 
 	strncpy(&kthreads_proc.cmd, "kthread", CMD_MAX);
@@ -82,7 +111,7 @@ void init_thread(thread_t *thread)
 
 	thread->sched_class = sched_get_class(SCHED_CLASS_LRF);
 
-	thread_list_entry_t *entry = kmalloc(sizeof(thread_list_entry_t));
+	thread_list_entry_t *entry = alloc_thread_list_entry();
 	entry->thread = thread;
 
 	spinlock_acquire(&threads_lock);
@@ -92,7 +121,7 @@ void init_thread(thread_t *thread)
 
 thread_t *create_kthread(void(entry)(void *), const char *name, void *data)
 {
-	thread_t *thread = (thread_t *)page_alloc_s(sizeof(thread_t));
+	thread_t *thread = alloc_thread();
 	void *stack = (void *)page_alloc_s((size_t)KTHREAD_STACK_SIZE);
 
 	thread->affinity = ~0;
@@ -115,14 +144,14 @@ thread_t *create_kthread(void(entry)(void *), const char *name, void *data)
 	struct clocksource_t *cs = clock_first(CS_GLOBAL);
 	thread->timing.last_system = cs->val(cs);
 
-	thread_list_entry_t *tentry = kmalloc(sizeof(thread_list_entry_t));
+	thread_list_entry_t *tentry = alloc_thread_list_entry();
 	tentry->thread = thread;
 
 	spinlock_acquire(&threads_lock);
 	list_add_tail(&tentry->list, &threads);
 	spinlock_release(&threads_lock);
 
-	thread_list_entry_t *tpentry = kmalloc(sizeof(thread_list_entry_t));
+	thread_list_entry_t *tpentry = alloc_thread_list_entry();
 	tpentry->thread = thread;
 
 	list_add_tail(&tpentry->list, &kthreads_proc.threads);
@@ -144,11 +173,13 @@ static void thread_wake_from_sleep(thread_t *thread)
 	timespec_from_cs(cs, &now);
 	timespec_diff(&sleep_cond->timer, &now, &rem);
 
-	if (rem.seconds < 0)
+	// the expiry counter rounds up, so a full sleep never leaves time remaining
+	if (rem.seconds < 0 || (rem.seconds == 0 && rem.nanoseconds == 0))
 		thread_return_wc(thread, 0);
 	else
 	{
-		if (sleep_cond->user_rem != 0)
+		// only writable while the sleeper's address space is live
+		if (sleep_cond->user_rem != 0 && current->process == thread->process)
 			copy_to_user(&rem, sleep_cond->user_rem, sizeof(timespec_t));
 
 		thread_return_wc(thread, (void *)-ERRINTR);
@@ -163,29 +194,24 @@ static void thread_wake_from_wait(thread_t *thread)
 {
 	struct thread_wait_cond_futex *futex_cond = (struct thread_wait_cond_futex *)thread->wc;
 
+	// woken before the timeout, otherwise the expiring core frees it
 	if (futex_cond->timeout)
-	{
-		// terminal_logf("waking thread from futex timeout");
-		if (futex_cond->timeout->timeout != 0)
-		{
-			// terminal_logf("after ts=0x%Xs 0x%Xns", futex_cond->timeout->timeout->seconds, futex_cond->timeout->timeout->nanoseconds);
-
-			kfree(futex_cond->timeout->timeout);
-			futex_cond->timeout->timeout = NULL;
-		}
-	}
+		timerqueue_cancel(futex_cond->timeout);
 
+	// entries taken by futex_do_wake are freed by it
 	futex_hb_t *hb = futex_hb(&futex_cond->queue->key);
 	spinlock_acquire(&hb->lock);
-	list_del(&futex_cond->queue->list);
-	kfree(futex_cond->queue);
+	if (!futex_cond->queue->taken)
+	{
+		list_del(&futex_cond->queue->list);
+		kfree(futex_cond->queue);
+	}
 	spinlock_release(&hb->lock);
 }
 
-void wake_thread(thread_t *thread)
+// thread_wake_wc releases the thread from its wait condition. The thread's wc_lock must be held
+static void thread_wake_wc(thread_t *thread)
 {
-	spinlock_acquire(&thread->wc_lock);
-
 	if (thread->wc)
 	{
 		switch (thread->wc->type)
@@ -207,11 +233,34 @@ void wake_thread(thread_t *thread)
 	}
 
 	set_thread_state(thread, THREAD_RUNNING);
+}
 
+void wake_thread(thread_t *thread)
+{
+	spinlock_acquire(&thread->wc_lock);
+	thread_wake_wc(thread);
 	spinlock_release(&thread->wc_lock);
 
-	cls_t *cls = get_core_cls(thread->running_core);
-	thread->sched_class->enqueue_thread(&cls->rq, thread);
+	// through the inbox, as the core may be another, or tickless and need a kick
+	sched_push_pending(thread->running_core, thread);
+}
+
+int wake_thread_cond(thread_t *thread, const void *cond)
+{
+	spinlock_acquire(&thread->wc_lock);
+
+	if (thread->wc != cond || thread->state == THREAD_DEAD)
+	{
+		spinlock_release(&thread->wc_lock);
+		return 0;
+	}
+
+	thread_wake_wc(thread);
+	spinlock_release(&thread->wc_lock);
+
+	sched_push_pending(thread->running_core, thread);
+
+	return 1;
 }
 
 static int can_wake_thread_from_sleep(thread_t *thread)
@@ -292,6 +341,11 @@ int sleep_thread(thread_t *thread, const timespec_t *ts, timespec_t *user_rem)
 	sleep_cond->cond.type = SLEEP;
 	sleep_cond->timer.seconds = sts.seconds + ts->seconds;
 	sleep_cond->timer.nanoseconds = sts.nanoseconds + ts->nanoseconds;
+	if (sleep_cond->timer.nanoseconds >= 1000000000L)
+	{
+		sleep_cond->timer.seconds++;
+		sleep_cond->timer.nanoseconds -= 1000000000L;
+	}
 	sleep_cond->user_rem = user_rem;
 
 	thread->wc = sleep_cond;
@@ -378,16 +432,19 @@ void mark_zombie_thread(thread_t *thread)
 
 void free_process(process_t *proc)
 {
-	if (proc->vm.vm_table)
-		page_free(proc->vm.vm_table);
-
+	// the table is still needed to find copy-on-write pages
 	vm_mapping *vmm_cur, *vmm_next;
 	list_head_for_each_safe(vmm_cur, vmm_next, &proc->vm.vm_maps)
 	{
-		page_free(vmm_cur->page);
+		vm_release_mapping(&proc->vm, vmm_cur, 0);
 		kfree(vmm_cur);
 	}
 
+	vm_maps_destroy(&proc->vm);
+
+	if (proc->vm.vm_table)
+		vm_free_table_deferred(proc->vm.vm_table);
+
 	page_free(proc);
 }
 
@@ -399,5 +456,5 @@ void free_thread(thread_t *thread)
 		kfree(thread->wc);
 	}
 
-	page_free(thread);
+	slub_free(thread);
 }
\ No newline at end of file
@@ -11,6 +11,116 @@
 
 #define LAZY_MAX_ALLOC_SIZE (65536)
 
+// Lazy regions covering a whole aligned block are faulted in as a single block mapping
+#define LAZY_HUGE_ALLOC_SIZE (L2_BLOCK_SIZE)
+
+// Max window mapped ahead of sequential faults, the window doubles
+// from LAZY_MAX_ALLOC_SIZE on each sequential fault up to this size
+#define LAZY_FAULT_AROUND_MAX (1024 * 1024)
+
+// Split a lazy mapping at the offset, returning the upper mapping
+static vm_mapping *lazy_split(thread_t *thread, vm_mapping *map, uint64_t offset);
+static uint64_t lazy_block_size(uint64_t size);
+
+// Orders mappings by address, then by pointer for mappings sharing an address
+static int vm_maps_comparator(void *rnode, void *list_rnode);
+
+// Finds the first mapping starting above the address of the key
+static int vm_maps_after_comparator(void *rnode, void *list_rnode);
+
+// Finds the first mapping starting at or above the address of the key
+static int vm_maps_from_comparator(void *rnode, void *list_rnode);
+
+static int vm_maps_comparator(void *rnode, void *list_rnode)
+{
+	vm_mapping *map = (vm_mapping *)rnode;
+	vm_mapping *list_map = (vm_mapping *)list_rnode;
+
+	if (list_map == 0)
+		return -1;
+
+	if (map->vm_addr != list_map->vm_addr)
+		return map->vm_addr < list_map->vm_addr ? -1 : 1;
+
+	if (map == list_map)
+		return 0;
+
+	return (uintptr_t)map < (uintptr_t)list_map ? -1 : 1;
+}
+
+static int vm_maps_after_comparator(void *rnode, void *list_rnode)
+{
+	vm_mapping *key = (vm_mapping *)rnode;
+	vm_mapping *list_map = (vm_mapping *)list_rnode;
+
+	if (list_map == 0)
+		return -1;
+
+	return list_map->vm_addr <= key->vm_addr ? 1 : -1;
+}
+
+static int vm_maps_from_comparator(void *rnode, void *list_rnode)
+{
+	vm_mapping *key = (vm_mapping *)rnode;
+	vm_mapping *list_map = (vm_mapping *)list_rnode;
+
+	if (list_map == 0)
+		return -1;
+
+	return list_map->vm_addr < key->vm_addr ? 1 : -1;
+}
+
+void vm_maps_init(vm_t *vm)
+{
+	INIT_LIST_HEAD(&vm->vm_maps);
+	skl_init(&vm->vm_maps_index, SKIPLIST_DEFAULT_LEVELS, vm_maps_comparator, 0);
+}
+
+void vm_maps_destroy(vm_t *vm)
+{
+	skl_destroy(&vm->vm_maps_index);
+}
+
+int vm_maps_insert(vm_t *vm, vm_mapping *map)
+{
+	vm_mapping *next = (vm_mapping *)skl_search(&vm->vm_maps_index, map, vm_maps_comparator);
+
+	if (skl_insert(&vm->vm_maps_index, map) < 0)
+		return -ERREXISTS;
+
+	// the list stays sorted so ranges can be walked in order
+	if (next != 0)
+		list_add_tail(&map->list, &next->list);
+	else
+		list_add_tail(&map->list, &vm->vm_maps);
+
+	return 0;
+}
+
+void vm_maps_remove(vm_t *vm, vm_mapping *map)
+{
+	skl_delete(&vm->vm_maps_index, map);
+	list_del(&map->list);
+}
+
+vm_mapping *vm_maps_find(vm_t *vm, uintptr_t addr)
+{
+	vm_mapping key = {.vm_addr = addr};
+	vm_mapping *next = (vm_mapping *)skl_search(&vm->vm_maps_index, &key, vm_maps_after_comparator);
+
+	struct list_head *prev = next != 0 ? next->list.prev : vm->vm_maps.prev;
+	if (prev == &vm->vm_maps)
+		return 0;
+
+	return (vm_mapping *)prev;
+}
+
+vm_mapping *vm_maps_first_from(vm_t *vm, uintptr_t addr)
+{
+	vm_mapping key = {.vm_addr = addr};
+	return (vm_mapping *)skl_search(&vm->vm_maps_index, &key, vm_maps_from_comparator);
+}
+
 uint64_t lazy_mem_map(thread_t *thread, uintptr_t addr, size_t length, int flags)
 {
 	vm_mapping *map = kmalloc(sizeof(*map));
@@ -22,10 +132,12 @@ uint64_t lazy_mem_map(thread_t *thread, uintptr_t addr, size_t length, int flags
 	map->page = 0;
 	map->phy_addr = 0;
 	map->vm_addr = addr;
+	map->fault_next = 0;
+	map->fault_window = 0;
 
 	spinlock_acquire(&thread->process->lock);
 
-	list_add_tail(&map->list, &thread->process->vm.vm_maps);
+	vm_maps_insert(&thread->process->vm, map);
 	thread->process->vm.brk = addr + length;
 
 	spinlock_release(&thread->process->lock);
@@ -35,129 +147,432 @@ uint64_t lazy_mem_map(thread_t *thread, uintptr_t addr, size_t length, int flags
 	return addr;
 }
 
+// lazy_block_size rounds the size down to a power of two number of pages, so the block
+// allocated for it is no larger than what is mapped
+static uint64_t lazy_block_size(uint64_t size)
+{
+	if (size <= PAGE_SIZE)
+		return PAGE_SIZE;
+
+	return 1ULL << (63 - __builtin_clzll(size));
+}
+
 int64_t actualise_lazy_reservation(thread_t *thread, vm_mapping *map, int flags)
 {
-	uint64_t wantSize = map->length;
-	uint64_t maplength = map->length;
-	void *page = NULL;
+	vm_mapping *cur = map;
+	uint64_t remaining = map->length;
+	uint64_t maxSize = map->length;
 	int64_t ret = 0;
 
 	// terminal_logf("actualising addr=0x%X len=0x%X", map->vm_addr, map->length);
 
-	while (wantSize > 0)
+	while (remaining > 0)
 	{
-		page = page_alloc_s(wantSize);
-		if (page != 0)
-			break;
+		uint64_t wantSize = lazy_block_size(remaining < maxSize ? remaining : maxSize);
+		void *page = page_zalloc_s(wantSize);
 
-		if (wantSize <= PAGE_SIZE)
-			break;
+		// memory is fragmented, fall back to the largest block which is free
+		while (page == NULL && wantSize > PAGE_SIZE)
+		{
+			wantSize = lazy_block_size(wantSize - 1);
+			page = page_zalloc_s(wantSize);
+		}
+
+		if (page == NULL)
+			return -ERRNOMEM;
+
+		maxSize = wantSize;
+
+		// reused pages may still be in the instruction cache with another process's code
+		if ((flags & MEMORY_USER_NON_EXEC) == 0)
+			vm_sync_icache(page, wantSize);
+
+		uintptr_t pa = vm_va_to_pa(vm_get_current_table(), (uintptr_t)page);
+
+		spinlock_acquire(&thread->process->lock);
+
+		vm_mapping *split = 0;
+		if (wantSize < remaining)
+		{
+			split = kmalloc(sizeof(*split));
+			if (split == 0)
+			{
+				spinlock_release(&thread->process->lock);
+				page_free(page);
+				return -ERRNOMEM;
+			}
+
+			split->flags = flags | VM_MAP_FLAG_LAZY;
+			split->length = remaining - wantSize;
+			split->page = 0;
+			split->phy_addr = 0;
+			split->vm_addr = cur->vm_addr + wantSize;
+			split->fault_next = cur->fault_next;
+			split->fault_window = cur->fault_window;
+
+			cur->length = wantSize;
+			vm_maps_insert(&thread->process->vm, split);
+		}
+
+		cur->phy_addr = pa;
+		cur->page = page;
+		cur->flags = flags & ~(VM_MAP_FLAG_LAZY);
 
-		wantSize >>= 1;
-		wantSize += PAGE_SIZE - (wantSize % PAGE_SIZE);
+		ret = vm_map_region(thread->process->vm.vm_table, pa, cur->vm_addr, wantSize - 1, cur->flags);
+
+		spinlock_release(&thread->process->lock);
+
+		if (ret < 0)
+			return ret;
+
+		remaining -= wantSize;
+		cur = split;
 	}
 
-	if (page == NULL)
-		return -ERRNOMEM;
+	// new entries were previously invalid so there is nothing to invalidate
+	return map->vm_addr;
+}
+
+vm_mapping *has_mapping(thread_t *thread, uintptr_t addr, size_t length)
+{
+	uintptr_t mapTop = addr + length;
+
+	spinlock_acquire(&thread->process->lock);
+
+	vm_mapping *this = vm_maps_find(&thread->process->vm, addr);
+	if (this != 0 && this->vm_addr + this->length < mapTop)
+		this = 0;
 
-	maplength -= wantSize;
-	memset(page, 0, wantSize);
+	spinlock_release(&thread->process->lock);
 
-	uintptr_t pa = vm_va_to_pa(vm_get_current_table(), (uintptr_t)page);
+	return this;
+}
+
+vm_mapping *vm_split_mapping(vm_t *vm, vm_mapping *map, size_t offset)
+{
+	vm_mapping *sibmap = kmalloc(sizeof(*map));
+	if (sibmap == 0)
+		return 0;
+
+	sibmap->flags = map->flags;
+	sibmap->phy_addr = map->phy_addr != 0 ? map->phy_addr + offset : 0;
+	sibmap->vm_addr = map->vm_addr + offset;
+	sibmap->length = map->length - offset;
+	sibmap->fault_next = map->fault_next;
+	sibmap->fault_window = map->fault_window;
+
+	// both halves hold the block, which is freed with the last of them
+	sibmap->page = map->page;
+	if (map->page != 0)
+		page_block_ref_get(map->page);
+
+	map->length = offset;
+	vm_maps_insert(vm, sibmap);
+
+	return sibmap;
+}
 
+static vm_mapping *lazy_split(thread_t *thread, vm_mapping *map, uint64_t offset)
+{
 	spinlock_acquire(&thread->process->lock);
+	vm_mapping *sibmap = vm_split_mapping(&thread->process->vm, map, offset);
+	spinlock_release(&thread->process->lock);
 
-	map->phy_addr = pa;
-	map->page = page;
-	map->flags = flags & ~(VM_MAP_FLAG_LAZY);
+	return sibmap;
+}
 
-	ret = vm_map_region(thread->process->vm.vm_table, pa, map->vm_addr, wantSize - 1, map->flags);
-	if (ret < 0)
-		goto out;
+int vm_alloc_lazy_mapping(thread_t *thread, vm_mapping *map, uint64_t alloc_size)
+{
+	if (alloc_size < map->length && (map->length - alloc_size) > PAGE_SIZE)
+		if (lazy_split(thread, map, alloc_size) == 0)
+			return -ERRNOMEM;
+
+	return actualise_lazy_reservation(thread, map, map->flags);
+}
+
+// vm_mapping_in_block checks if the page mapped at the address is still the page of the
+// block allocated for the mapping. Split mappings share a block, so only the address is checked
+static int vm_mapping_in_block(vm_mapping *map, uintptr_t va, uintptr_t pa)
+{
+	return map->page != 0 && pa == map->phy_addr + (va - (map->vm_addr & ~(PAGE_SIZE - 1)));
+}
+
+// vm_clone_mapping maps the pages of the mapping into the table, taking a reference on each
+// page if they are shared copy-on-write
+static int vm_clone_mapping(vm_t *from, vm_t *to, vm_mapping *map, uint64_t flags)
+{
+	uintptr_t start = map->vm_addr & ~(PAGE_SIZE - 1);
+	uintptr_t end = map->vm_addr + map->length;
+	int cow = (map->flags & VM_MAP_FLAG_COW) != 0;
+
+	for (uintptr_t va = start; va < end;)
+	{
+		uint64_t *pte = vm_va_to_pte(from->vm_table, va);
+		uint64_t step = PAGE_SIZE;
 
-	if (maplength > 0)
+		// blocks are kept whole if they are within the mapping
+		if (pte != 0 && (*pte & VM_ENTRY_ISTABLE) == 0 && (va & (L2_BLOCK_SIZE - 1)) == 0 && va + L2_BLOCK_SIZE <= end)
+			step = L2_BLOCK_SIZE;
+
+		// mappings can share a page if they are not page aligned
+		if (pte == 0 || vm_va_to_pa(to->vm_table, va) != 0)
+		{
+			va += step;
+			continue;
+		}
+
+		uintptr_t pa = vm_va_to_pa(from->vm_table, va);
+
+		int ret = vm_map_region(to->vm_table, pa, va, step - 1, flags);
+		if (ret < 0)
+			return ret;
+
+		if (cow)
+			for (uint64_t off = 0; off < step; off += PAGE_SIZE)
+				page_ref_get((void *)vm_pa_to_kva(pa + off));
+
+		va += step;
+	}
+
+	return 0;
+}
+
+int vm_clone(vm_t *from, vm_t *to)
+{
+	vm_mapping *map;
+
+	list_head_for_each(map, &from->vm_maps)
 	{
-		// split mapping
-		map->length = wantSize;
+		vm_mapping *copy = kmalloc(sizeof(*copy));
+		if (copy == 0)
+			return -ERRNOMEM;
 
-		vm_mapping *split = kmalloc(sizeof(*split));
-		if (split == 0)
+		uint64_t flags = map->flags;
+		int lazy = map->page == 0 && map->phy_addr == 0;
+
+		// private memory is shared read only until either side writes to it. Read only mappings
+		// are included as mem_protect may make them writable later, unless they map the loaded image
+		int image = (map->flags & VM_MAP_FLAG_PHY_KERNEL) != 0 && map->page == 0 && (map->flags & MEMORY_PERM_W) == 0;
+		if (!lazy && !image && (map->flags & (VM_MAP_FLAG_SHARED | VM_MAP_FLAG_DEVICE)) == 0)
 		{
-			ret = -ERRNOMEM;
-			goto out;
+			map->flags |= VM_MAP_FLAG_COW;
+			flags = (map->flags & ~MEMORY_PERM_W) | MEMORY_PERM_RO;
 		}
 
-		split->flags = map->flags;
-		split->length = wantSize;
-		split->page = 0;
-		split->phy_addr = 0;
-		split->vm_addr = map->vm_addr + wantSize;
+		memcpy(copy, map, sizeof(*copy));
+		vm_maps_insert(to, copy);
 
-		list_add_after(&split->list, &map->list);
+		if (lazy)
+			continue;
 
-		spinlock_release(&thread->process->lock);
-		ret = actualise_lazy_reservation(thread, split, flags);
+		if (copy->page != 0)
+			page_block_ref_get(copy->page);
+
+		// other threads of the parent must stop writing before the child sees the pages
+		if ((map->flags & VM_MAP_FLAG_COW) != 0 && (map->flags & MEMORY_PERM_W) != 0)
+		{
+			uintptr_t start = map->vm_addr & ~(PAGE_SIZE - 1);
+			uintptr_t end = (map->vm_addr + map->length + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+			vm_protect_region(from->vm_table, from, start, end - start - 1, flags);
+		}
+
+		int ret = vm_clone_mapping(from, to, copy, flags);
 		if (ret < 0)
 			return ret;
 	}
-	vm_clear_caches();
 
-	ret = map->vm_addr;
+	to->start_code = from->start_code;
+	to->end_code = from->end_code;
+	to->start_data = from->start_data;
+	to->end_data = from->end_data;
+	to->start_brk = from->start_brk;
+	to->brk = from->brk;
+	to->start_stack = from->start_stack;
+	to->arg_start = from->arg_start;
+	to->arg_end = from->arg_end;
+	to->env_start = from->env_start;
+	to->env_end = from->env_end;
 
-out:
-	spinlock_release(&thread->process->lock);
-	return ret;
+	return 0;
 }
 
-vm_mapping *has_mapping(thread_t *thread, uintptr_t addr, size_t length)
+void vm_release_mapping(vm_t *vm, vm_mapping *map, int unmap)
 {
-	uintptr_t mapTop = addr + length;
-	vm_mapping *this = NULL;
-	uintptr_t top = 0;
+	uintptr_t start = map->vm_addr & ~(PAGE_SIZE - 1);
+	uintptr_t end = (map->vm_addr + map->length + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+
+	if ((map->flags & VM_MAP_FLAG_COW) != 0)
+	{
+		// pages may have been copied away from the block, or shared from another block
+		for (uintptr_t va = start; va < end; va += PAGE_SIZE)
+		{
+			uintptr_t pa = vm_va_to_pa(vm->vm_table, va);
+			if (pa == 0)
+				continue;
+
+			if (unmap)
+				vm_unmap_region(vm->vm_table, vm, va, PAGE_SIZE - 1);
+
+			void *page = (void *)vm_pa_to_kva(pa);
+
+			// pages in the block are freed with the block
+			if (page_ref_put(page) == 0 && !vm_mapping_in_block(map, va, pa))
+				page_free(page);
+		}
+	}
+	else if (unmap)
+		vm_unmap_region(vm->vm_table, vm, start, end - start - 1);
+
+	if (map->page != 0 && page_block_ref_put(map->page) == 0)
+		page_free(map->page);
+}
+
+// vm_cow_fault gives the mapping a private copy of the page written to, or takes the page
+// over if no other address space still shares it
+static int vm_cow_fault(thread_t *thread, vm_mapping *map, uintptr_t addr)
+{
+	vm_table *table = thread->process->vm.vm_table;
+	uintptr_t va = addr & ~(PAGE_SIZE - 1);
+	int ret = 0;
 
 	spinlock_acquire(&thread->process->lock);
 
-	list_head_for_each(this, &thread->process->vm.vm_maps)
+	uintptr_t pa = vm_va_to_pa(table, va);
+	if (pa == 0)
 	{
-		top = this->vm_addr + this->length;
+		ret = -ERRFAULT;
+		goto out;
+	}
 
-		if (this->vm_addr <= addr && top >= mapTop)
-		{
-			spinlock_release(&thread->process->lock);
-			return this;
-		}
+	void *page = (void *)vm_pa_to_kva(pa);
+
+	if (page_ref_count(page) == 0)
+	{
+		ret = vm_protect_region(table, &thread->process->vm, va, PAGE_SIZE - 1, map->flags);
+		goto out;
+	}
+
+	void *copy = page_alloc(0);
+	if (copy == 0)
+	{
+		ret = -ERRNOMEM;
+		goto out;
 	}
 
+	memcpy(copy, page, PAGE_SIZE);
+
+	if ((map->flags & MEMORY_USER_NON_EXEC) == 0)
+		vm_sync_icache(copy, PAGE_SIZE);
+
+	ret = vm_remap_page(table, &thread->process->vm, va, vm_va_to_pa(vm_get_current_table(), (uintptr_t)copy), map->flags);
+	if (ret < 0)
+	{
+		page_free(copy);
+		goto out;
+	}
+
+	// the other owners may have released the page while it was copied
+	if (page_ref_put(page) == 0 && !vm_mapping_in_block(map, va, pa))
+		page_free(page);
+
+out:
 	spinlock_release(&thread->process->lock);
+	return ret;
+}
+
+// vm_cow_break_range gives the thread private copies of the shared copy on write pages in
+// the range, as kernel stores to user memory fault at EL1 rather than through user_data_abort
+int vm_cow_break_range(thread_t *thread, uintptr_t addr, size_t length)
+{
+	uintptr_t end = addr + length;
+
+	for (uintptr_t va = addr & ~(PAGE_SIZE - 1); va < end; va += PAGE_SIZE)
+	{
+		vm_mapping *map = has_mapping(thread, va, 1);
+		if (map == 0 || (map->flags & VM_MAP_FLAG_COW) == 0 || (map->flags & MEMORY_PERM_W) == 0)
+			continue;
+
+		// pages already copied or taken over are writable
+		uint64_t *pte = vm_va_to_pte(thread->process->vm.vm_table, va);
+		if (pte == 0 || (*pte & VM_ENTRY_PERM_RO) == 0)
+			continue;
+
+		int ret = vm_cow_fault(thread, map, va);
+		if (ret < 0)
+			return ret;
+	}
+
 	return 0;
 }
 
-int vm_alloc_lazy_mapping(thread_t *thread, vm_mapping *map, uint64_t alloc_size)
+// lazy_fault_huge backs the aligned block around the address with a single block if the
+// lazy mapping covers all of it, returning 1 if mapped or 0 if it does not cover the block
+static int lazy_fault_huge(thread_t *thread, vm_mapping *map, uintptr_t addr)
 {
+	uintptr_t start = addr & ~(LAZY_HUGE_ALLOC_SIZE - 1);
 
-	if (alloc_size < map->length && (map->length - alloc_size) > PAGE_SIZE)
+	if (start < map->vm_addr || start + LAZY_HUGE_ALLOC_SIZE > map->vm_addr + map->length)
+		return 0;
+
+	if (start > map->vm_addr)
 	{
-		spinlock_acquire(&thread->process->lock);
-		// split
-		vm_mapping *sibmap = kmalloc(sizeof(*map));
-		if (sibmap == 0)
-		{
-			spinlock_release(&thread->process->lock);
+		map = lazy_split(thread, map, start - map->vm_addr);
+		if (map == 0)
 			return -ERRNOMEM;
-		}
+	}
 
-		sibmap->flags = map->flags;
-		sibmap->phy_addr = map->phy_addr + alloc_size;
-		sibmap->vm_addr = map->vm_addr + alloc_size;
-		sibmap->length = map->length - alloc_size;
-		sibmap->page = 0;
-		list_add_after(&sibmap->list, &map->list);
+	if (map->length != LAZY_HUGE_ALLOC_SIZE)
+		if (lazy_split(thread, map, LAZY_HUGE_ALLOC_SIZE) == 0)
+			return -ERRNOMEM;
 
-		map->length = alloc_size;
-		spinlock_release(&thread->process->lock);
+	// falls back to smaller pages if no block is free or it is not physically aligned
+	int64_t ret = actualise_lazy_reservation(thread, map, map->flags);
+	if (ret < 0)
+		return ret;
+
+	return 1;
+}
+
+// lazy_fault_around maps a window of the lazy mapping around the address, growing the
+// window while faults follow on from the previous window
+static int lazy_fault_around(thread_t *thread, vm_mapping *map, uintptr_t addr)
+{
+	uint64_t window = LAZY_MAX_ALLOC_SIZE;
+	uintptr_t start = addr & ~(LAZY_MAX_ALLOC_SIZE - 1);
+
+	if (map->fault_window != 0 && addr >= map->fault_next && addr < map->fault_next + map->fault_window)
+	{
+		// sequential
+		window = map->fault_window << 1;
+		if (window > LAZY_FAULT_AROUND_MAX)
+			window = LAZY_FAULT_AROUND_MAX;
+
+		start = addr & ~(PAGE_SIZE - 1);
 	}
 
-	return actualise_lazy_reservation(thread, map, map->flags);
+	if (start < map->vm_addr)
+		start = map->vm_addr;
+
+	if (start > map->vm_addr)
+	{
+		map = lazy_split(thread, map, start - map->vm_addr);
+		if (map == 0)
+			return -ERRNOMEM;
+	}
+
+	// carried over to the remainder when split
+	map->fault_next = start + window;
+	map->fault_window = window;
+
+	if (window < map->length && map->length - window > PAGE_SIZE)
+		if (lazy_split(thread, map, window) == 0)
+			return -ERRNOMEM;
+
+	int64_t ret = actualise_lazy_reservation(thread, map, map->flags);
+	if (ret < 0)
+		return ret;
+
+	return 1;
 }
 
 void user_data_abort(const uintptr_t daddr, enum UserDataAbortOp op, uintptr_t pc)
@@ -169,9 +584,17 @@ void user_data_abort(const uintptr_t daddr, enum UserDataAbortOp op, uintptr_t p
 	vm_mapping *map = has_mapping(thread, daddr, 8);
 	if (map == 0)
 		send_signal(thread, SIG_SEGV);
+	else if ((map->flags & VM_MAP_FLAG_COW) != 0 && (map->flags & MEMORY_PERM_W) != 0 && op == USER_DATA_ABORT_WRITE)
+	{
+		int ret = vm_cow_fault(thread, map, daddr);
+		if (ret < 0)
+			terminal_logf("failed to copy on write on TID (0x%x:0x%x): request=0x%X PC=0x%X ~> ret=%d", thread->process->pid, thread->tid, daddr, pc, ret);
+	}
 	else if ((map->flags | VM_MAP_FLAG_LAZY) > 0 && map->page == 0 && map->phy_addr == 0)
 	{
-		int ret = vm_alloc_lazy_mapping(thread, map, LAZY_MAX_ALLOC_SIZE);
+		int ret = lazy_fault_huge(thread, map, daddr);
+		if (ret == 0)
+			ret = lazy_fault_around(thread, map, daddr);
 		if (ret <= 0)
 			terminal_logf("failed to actualise lazy reservation on TID (0x%x:0x%x): request=0x%X wnr=%d PC=0x%X ~> ret=%d", thread->process->pid, thread->tid, daddr, op, pc, ret);
 	}
@@ -1,8 +1,25 @@
+#include <errno.h>
 #include <kernel/cls.h>
 #include <kernel/mm.h>
 #include <kernel/sync.h>
+#include <kernel/slub.h>
+#include <kernel/strings.h>
 #include <kernel/wait.h>
 
+#define TIMERQUEUE_MIN_CAP (16)
+
+static slub_t *waitqueue_entry_slub;
+
+void init_waitqueue_cache(void)
+{
+	waitqueue_entry_slub = DEFINE_DYN_SLUB(sizeof(waitqueue_entry_t));
+}
+
+waitqueue_entry_t *alloc_waitqueue_entry(void)
+{
+	return (waitqueue_entry_t *)slub_alloc(waitqueue_entry_slub);
+}
+
 void try_wake_waitqueue(waitqueue_head_t *wq)
 {
 	cls_t *cls = get_cls();
@@ -46,3 +63,174 @@ int wq_can_wake_thread(waitqueue_entry_t *wq_entry)
 
 	return can_wake_thread(wq_entry->thread);
 }
+
+// timerqueue_set places the entry in the heap slot
+static inline void timerqueue_set(timerqueue_head_t *tq, size_t idx, waitqueue_entry_t *wqe)
+{
+	tq->heap[idx] = wqe;
+	wqe->tq_idx = idx;
+}
+
+// timerqueue_sift_up moves an entry towards the root until its parent expires first
+static void timerqueue_sift_up(timerqueue_head_t *tq, size_t idx)
+{
+	waitqueue_entry_t *wqe = tq->heap[idx];
+
+	while (idx > 0)
+	{
+		size_t parent = (idx - 1) / 2;
+		if (tq->heap[parent]->expires <= wqe->expires)
+			break;
+
+		timerqueue_set(tq, idx, tq->heap[parent]);
+		idx = parent;
+	}
+
+	timerqueue_set(tq, idx, wqe);
+}
+
+// timerqueue_sift_down moves an entry towards the leaves until its children expire after it
+static void timerqueue_sift_down(timerqueue_head_t *tq, size_t idx)
+{
+	waitqueue_entry_t *wqe = tq->heap[idx];
+
+	while (1)
+	{
+		size_t child = idx * 2 + 1;
+		if (child >= tq->size)
+			break;
+
+		if (child + 1 < tq->size && tq->heap[child + 1]->expires < tq->heap[child]->expires)
+			child++;
+
+		if (wqe->expires <= tq->heap[child]->expires)
+			break;
+
+		timerqueue_set(tq, idx, tq->heap[child]);
+		idx = child;
+	}
+
+	timerqueue_set(tq, idx, wqe);
+}
+
+// timerqueue_remove takes the entry out of the heap slot. The queue lock must be held
+static void timerqueue_remove(timerqueue_head_t *tq, size_t idx)
+{
+	waitqueue_entry_t *wqe = tq->heap[idx];
+	wqe->tq = 0;
+
+	tq->size--;
+	if (idx == tq->size)
+		return;
+
+	// fill the hole with the last entry, which may belong above or below it
+	timerqueue_set(tq, idx, tq->heap[tq->size]);
+	if (idx > 0 && tq->heap[idx]->expires < tq->heap[(idx - 1) / 2]->expires)
+		timerqueue_sift_up(tq, idx);
+	else
+		timerqueue_sift_down(tq, idx);
+}
+
+int timerqueue_add(timerqueue_head_t *tq, waitqueue_entry_t *wqe, uint64_t expires)
+{
+	spinlock_acquire(&tq->lock);
+
+	if (tq->size == tq->cap)
+	{
+		size_t cap = tq->cap == 0 ? TIMERQUEUE_MIN_CAP : tq->cap * 2;
+		waitqueue_entry_t **heap = kmalloc(cap * sizeof(waitqueue_entry_t *));
+		if (heap == 0)
+		{
+			spinlock_release(&tq->lock);
+			return -ERRNOMEM;
+		}
+
+		if (tq->heap != 0)
+		{
+			memcpy(heap, tq->heap, tq->size * sizeof(waitqueue_entry_t *));
+			kfree(tq->heap);
+		}
+
+		tq->heap = heap;
+		tq->cap = cap;
+	}
+
+	wqe->expires = expires;
+	wqe->tq = tq;
+
+	timerqueue_set(tq, tq->size, wqe);
+	tq->size++;
+	timerqueue_sift_up(tq, wqe->tq_idx);
+
+	spinlock_release(&tq->lock);
+
+	return 0;
+}
+
+int timerqueue_cancel(waitqueue_entry_t *wqe)
+{
+	// the expiring core frees the entry only after trying to wake the thread,
+	// which waits for the caller's wc_lock, so the entry can still be read
+	timerqueue_head_t *tq = wqe->tq;
+	if (tq == 0)
+		return 0;
+
+	spinlock_acquire(&tq->lock);
+
+	if (wqe->tq != tq)
+	{
+		spinlock_release(&tq->lock);
+		return 0;
+	}
+
+	timerqueue_remove(tq, wqe->tq_idx);
+
+	spinlock_release(&tq->lock);
+
+	kfree(wqe);
+
+	return 1;
+}
+
+int timerqueue_next(timerqueue_head_t *tq, uint64_t *expires)
+{
+	int found = 0;
+
+	spinlock_acquire(&tq->lock);
+
+	if (tq->size != 0)
+	{
+		*expires = tq->heap[0]->expires;
+		found = 1;
+	}
+
+	spinlock_release(&tq->lock);
+
+	return found;
+}
+
+void timerqueue_expire(timerqueue_head_t *tq, uint64_t now)
+{
+	LIST_HEAD(expired);
+
+	spinlock_acquire(&tq->lock);
+
+	while (tq->size != 0 && tq->heap[0]->expires <= now)
+	{
+		waitqueue_entry_t *wqe = tq->heap[0];
+		timerqueue_remove(tq, 0);
+		list_add_tail(&wqe->list, &expired);
+	}
+
+	spinlock_release(&tq->lock);
+
+	// woken without the queue lock, as waking a thread cancels its other entries
+	waitqueue_entry_t *this;
+	waitqueue_entry_t *tmp;
+	list_head_for_each_safe(this, tmp, &expired)
+	{
+		list_del(&this->list);
+		wake_thread_cond(this->thread, this->data);
+		kfree(this);
+	}
+}